@@ -95,10 +95,11 @@ static void hk_revert_al_snapshot(struct super_block *sb, struct hk_inode *pi)
     }
 }
 
-/* Undo Recovery (Undo Journal) */
-static int hk_journal_recovery(struct super_block *sb, int txid, struct hk_journal *jnl)
+/* Undo one op of a journal. je[] are its jentries as do_start_tx wrote them,
+   i.e. the valid ones of hk_ji_obj_type in enum order, not in the order of
+   hk_tx_args_map. */
+static void hk_journal_undo(struct super_block *sb, u8 jtype, struct hk_jentry **je)
 {
-    int ret = 0;
     struct hk_sb_info *sbi = HK_SB(sb);
     struct hk_jentry *je_pi;
     struct hk_jentry *je_pd;
@@ -111,21 +112,16 @@ static int hk_journal_recovery(struct super_block *sb, int txid, struct hk_journ
 
     struct hk_attr_log *al;
 
-    unsigned long irq_flags = 0;
-    u8 jtype = jnl->jhdr.jtype;
-
-    hk_memunlock_all(sb, &irq_flags);
     switch (jtype) {
-    case IDLE:
-        goto out;
     case CREATE:
     case MKDIR:
     case LINK:
     case SYMLINK:
         /* fall thru */
-        je_pi = hk_get_jentry_by_slotid(sb, txid, 0);
-        je_pd = hk_get_jentry_by_slotid(sb, txid, 1);
-        je_pi_par = hk_get_jentry_by_slotid(sb, txid, 2);
+        je_pi = je[0];
+        je_pd = je[1];
+        /* JI_PD_NEW, the symname block of a symlink, precedes JI_PI_PAR */
+        je_pi_par = jtype == SYMLINK ? je[3] : je[2];
 
         /* clear pi */
         pi = TRANS_OFS_TO_ADDR(sbi, je_pi->data);
@@ -139,23 +135,25 @@ static int hk_journal_recovery(struct super_block *sb, int txid, struct hk_journ
 
         /* clear pi_par's attr log, since we've apply before transaction start */
         pi_par = TRANS_OFS_TO_ADDR(sbi, je_pi_par->data);
+        /* the dir index may hold the dentry undone, scan the dir instead */
+        pi_par->i_dindex = 0;
         al = hk_get_attr_log_by_ino(sb, pi_par->ino);
-        if (al->ino == pi_par->ino) {
+        if (al && al->ino == pi_par->ino) {
             hk_revert_al_snapshot(sb, pi_par);
         }
 
         /* if this is a symlink, we clear its data block for symname later */
         break;
     case UNLINK:
-        je_pi = hk_get_jentry_by_slotid(sb, txid, 0);
-        je_pd = hk_get_jentry_by_slotid(sb, txid, 1);
-        je_pi_par = hk_get_jentry_by_slotid(sb, txid, 2);
+        je_pi = je[0];
+        je_pd = je[1];
+        je_pi_par = je[2];
 
         /* validate inode */
         pi = TRANS_OFS_TO_ADDR(sbi, je_pi->data);
         pi->valid = 1;
         al = hk_get_attr_log_by_ino(sb, pi->ino);
-        if (al->ino == pi->ino) {
+        if (al && al->ino == pi->ino) {
             hk_revert_al_snapshot(sb, pi);
         }
 
@@ -165,22 +163,23 @@ static int hk_journal_recovery(struct super_block *sb, int txid, struct hk_journ
 
         /* 3. invalid blks belongs to inode, we don't need invalidators */
         pi_par = TRANS_OFS_TO_ADDR(sbi, je_pi_par->data);
+        pi_par->i_dindex = 0;
         al = hk_get_attr_log_by_ino(sb, pi_par->ino);
-        if (al->ino == pi_par->ino) {
+        if (al && al->ino == pi_par->ino) {
             hk_revert_al_snapshot(sb, pi_par);
         }
         break;
     case RENAME:
-        je_pi = hk_get_jentry_by_slotid(sb, txid, 0);     /* self */
-        je_pd = hk_get_jentry_by_slotid(sb, txid, 1);     /* self-dentry */
-        je_pd_new = hk_get_jentry_by_slotid(sb, txid, 2); /* new-dentry */
-        je_pi_par = hk_get_jentry_by_slotid(sb, txid, 3); /* parent */
-        je_pi_new = hk_get_jentry_by_slotid(sb, txid, 4); /* new-parent */
+        je_pi = je[0];     /* self */
+        je_pd = je[1];     /* self-dentry */
+        je_pd_new = je[2]; /* new-dentry */
+        je_pi_par = je[3]; /* parent */
+        je_pi_new = je[4]; /* new-parent */
 
         /* revert to rename non happen */
         pi = TRANS_OFS_TO_ADDR(sbi, je_pi->data);
         al = hk_get_attr_log_by_ino(sb, pi->ino);
-        if (al->ino == pi->ino) {
+        if (al && al->ino == pi->ino) {
             hk_revert_al_snapshot(sb, pi);
         }
 
@@ -188,17 +187,19 @@ static int hk_journal_recovery(struct super_block *sb, int txid, struct hk_journ
         pd->valid = 1;
 
         pd_new = TRANS_OFS_TO_ADDR(sbi, je_pd_new->data);
-        pd->valid = 0;
+        pd_new->valid = 0;
 
         pi_par = TRANS_OFS_TO_ADDR(sbi, je_pi_par->data);
+        pi_par->i_dindex = 0;
         al = hk_get_attr_log_by_ino(sb, pi_par->ino);
-        if (al->ino == pi_par->ino) {
+        if (al && al->ino == pi_par->ino) {
             hk_revert_al_snapshot(sb, pi_par);
         }
 
         pi_new = TRANS_OFS_TO_ADDR(sbi, je_pi_new->data);
+        pi_new->i_dindex = 0;
         al = hk_get_attr_log_by_ino(sb, pi_new->ino);
-        if (al->ino == pi_new->ino) {
+        if (al && al->ino == pi_new->ino) {
             hk_revert_al_snapshot(sb, pi_new);
         }
 
@@ -206,9 +207,74 @@ static int hk_journal_recovery(struct super_block *sb, int txid, struct hk_journ
     default:
         break;
     }
+}
+
+/* A COMPOUND journal is a list of ops, each led by a J_OP jentry. They are
+   undone from the last to the first. */
+static int hk_journal_undo_compound(struct super_block *sb, struct hk_journal *jnl)
+{
+    struct hk_sb_info *sbi = HK_SB(sb);
+    struct hk_jentry *(*je)[HK_MAX_OBJ_INVOVED];
+    struct hk_jentry *jcur;
+    u8 *jtypes;
+    int nr_ops = 0, nr_je = 0;
+    int opid;
+
+    je = kcalloc(HK_TX_BATCH_OPS, sizeof(*je), GFP_KERNEL);
+    jtypes = kcalloc(HK_TX_BATCH_OPS, sizeof(u8), GFP_KERNEL);
+    if (!je || !jtypes) {
+        kfree(je);
+        kfree(jtypes);
+        return -ENOMEM;
+    }
+
+    traverse_journal_entry(sbi, jcur, jnl)
+    {
+        if (jcur->type == J_OP) {
+            if (nr_ops == HK_TX_BATCH_OPS) {
+                break;
+            }
+            jtypes[nr_ops++] = le64_to_cpu(jcur->data);
+            nr_je = 0;
+        } else if (nr_ops > 0 && nr_je < HK_MAX_OBJ_INVOVED) {
+            je[nr_ops - 1][nr_je++] = jcur;
+        }
+    }
+
+    for (opid = nr_ops - 1; opid >= 0; opid--) {
+        hk_journal_undo(sb, jtypes[opid], je[opid]);
+    }
+
+    kfree(je);
+    kfree(jtypes);
+    return 0;
+}
+
+/* Undo Recovery (Undo Journal) */
+static int hk_journal_recovery(struct super_block *sb, int txid, struct hk_journal *jnl)
+{
+    int ret = 0;
+    struct hk_jentry *je[HK_MAX_OBJ_INVOVED];
+    unsigned long irq_flags = 0;
+    u8 jtype = jnl->jhdr.jtype;
+    int slotid;
+
+    if (jtype == IDLE) {
+        goto out;
+    }
+
+    hk_memunlock_all(sb, &irq_flags);
+    if (jtype == COMPOUND) {
+        ret = hk_journal_undo_compound(sb, jnl);
+    } else {
+        for (slotid = 0; slotid < HK_MAX_OBJ_INVOVED; slotid++) {
+            je[slotid] = hk_get_jentry_by_slotid(sb, txid, slotid);
+        }
+        hk_journal_undo(sb, jtype, je);
+    }
     hk_memlock_all(sb, &irq_flags);
 
-    hk_finish_tx(sb, txid);
+    hk_discard_tx(sb, txid);
 out:
     return ret;
 }
@@ -284,6 +350,26 @@ int hk_invalidate_data_blocks(struct super_block *sb, struct linix *ix, loff_t s
     return 0;
 }
 
+#ifdef CONFIG_EXTENT_HDR
+/* tstamp of the header that describes addr, which is the head of the run
+   covering it unless a newer header was committed on the block itself */
+static u64 hk_recovery_blk_tstamp(struct super_block *sb, struct hk_recovery_node *rn, u64 addr)
+{
+    struct hk_header *hdr = sm_get_hdr_by_addr(sb, addr);
+    struct hk_range_node *run;
+    struct hk_header *head;
+
+    run = hk_range_find_cover(&rn->runs, hk_get_dblk_by_addr(HK_SB(sb), addr));
+    if (run) {
+        head = sm_get_hdr_by_blk(sb, run->range_low);
+        if (!(hdr->valid == 1 && hdr->tstamp > head->tstamp)) {
+            return head->tstamp;
+        }
+    }
+    return hdr->tstamp;
+}
+#endif
+
 u64 sm_get_next_addr_by_cur_index(struct super_block *sb, struct linix *ix, u64 cur_index)
 {
     struct hk_sb_info *sbi = HK_SB(sb);
@@ -311,8 +397,13 @@ int hk_failure_recovery(struct super_block *sb)
     struct hk_attr_log *al;
     struct hk_header *hdr, *est_hdr;
     struct hk_inode *pi;
-    u64 blk = 0, ino = 0;
+    u64 blk = 0, ino = 0, f_blk = 0;
     u64 addr = 0, est_addr = 0;
+    u64 est_tstamp = 0;
+#ifdef CONFIG_EXTENT_HDR
+    struct hk_header *cover = NULL;
+    u64 cover_addr = 0, cover_end = 0;
+#endif
     int cpuid, alid, txid;
     unsigned long irq_flags = 0;
     bool hdr_real_valid = false;
@@ -322,6 +413,11 @@ int hk_failure_recovery(struct super_block *sb)
     int ret = 0;
 
     /* Step 1: Undo Transactions */
+    ret = hk_build_attr_log_map(sb);
+    if (ret) {
+        hk_warn("%s: failed to map attr logs, %d\n", __func__, ret);
+        return ret;
+    }
     for (txid = 0; txid < sbi->j_slots; txid++) {
         jnl = hk_get_journal_by_txid(sb, txid);
         if (jnl->jhdr.jofs_head != jnl->jhdr.jofs_tail) {
@@ -348,10 +444,27 @@ int hk_failure_recovery(struct super_block *sb)
         layout->num_gaps_indram = 0;
         ind_update(&layout->ind, PREP_LAYOUT_APPEND, layout->layout_blks);
 
+#ifdef CONFIG_EXTENT_HDR
+        cover = NULL;
+        cover_end = 0;
+#endif
         traverse_layout_blks(addr, layout)
         {
             HK_ASSERT(addr != 0);
             hdr = sm_get_hdr_by_addr(sb, addr);
+            f_blk = hdr->f_blk;
+#ifdef CONFIG_EXTENT_HDR
+            /* A follower of a run takes the identity of its head, unless a
+               newer header has been committed on it after the run was cut */
+            if (addr < cover_end && !(hdr->valid == 1 && hdr->tstamp > cover->tstamp)) {
+                f_blk = cover->f_blk + (addr - cover_addr) / HK_PBLK_SZ;
+                hdr = cover;
+            } else if (hdr->valid == 1 && sm_hdr_run(hdr) > 1) {
+                cover = hdr;
+                cover_addr = addr;
+                cover_end = addr + sm_hdr_run(hdr) * HK_PBLK_SZ;
+            }
+#endif
             if (hdr->valid == 1) {
                 ino = le64_to_cpu(hdr->ino);
                 rn = hk_get_recovery_node(&recovery_table, ino);
@@ -362,14 +475,33 @@ int hk_failure_recovery(struct super_block *sb)
                     rn->size = 0;
                     rn->cmtime = 0;
                     linix_init(sbi, &rn->ix, 1);
+#ifdef CONFIG_EXTENT_HDR
+                    rn->runs = RB_ROOT_CACHED;
+#endif
                     hk_insert_recovery_node(&recovery_table, rn);
                 }
+#ifdef CONFIG_EXTENT_HDR
+                if (hdr == cover && addr == cover_addr) {
+                    node = hk_alloc_hk_range_node();
+                    node->range_low = hk_get_dblk_by_addr(sbi, addr);
+                    node->range_high = node->range_low + sm_hdr_run(hdr) - 1;
+                    if (hk_range_insert_range_node(&rn->runs, node)) {
+                        hk_free_hk_range_node(node);
+                    }
+                }
+#endif
 
-                est_addr = TRANS_OFS_TO_ADDR(sbi, linix_get(&rn->ix, hdr->f_blk));
+                hdr_real_valid = false;
+                est_addr = TRANS_OFS_TO_ADDR(sbi, linix_get(&rn->ix, f_blk));
                 if (est_addr) {
                     HK_ASSERT(est_addr != 0);
+#ifdef CONFIG_EXTENT_HDR
+                    est_tstamp = hk_recovery_blk_tstamp(sb, rn, est_addr);
+#else
                     est_hdr = sm_get_hdr_by_addr(sb, est_addr);
-                    if (est_hdr->tstamp < hdr->tstamp) {
+                    est_tstamp = est_hdr->tstamp;
+#endif
+                    if (est_tstamp < hdr->tstamp) {
                         hdr_real_valid = true;
                     }
                 } else {
@@ -381,7 +513,7 @@ int hk_failure_recovery(struct super_block *sb)
                     rn->tstamp = hdr->tstamp > rn->tstamp ? hdr->tstamp : rn->tstamp;
                     rn->cmtime = hdr->cmtime > rn->cmtime ? hdr->cmtime : rn->cmtime;
                     HK_ASSERT(addr != 0);
-                    linix_insert(&rn->ix, hdr->f_blk, addr, true);
+                    linix_insert(&rn->ix, f_blk, addr, true);
                     ind_update(&layout->ind, VALIDATE_BLK, 1);
                 } else {
                     blk = hk_get_dblk_by_addr(sbi, addr);
@@ -442,6 +574,33 @@ int hk_failure_recovery(struct super_block *sb)
 
             hk_dbgv("size: %llu, round blks: %llu", size, _round_up(size, PAGE_SIZE) / PAGE_SIZE);
 
+#ifdef CONFIG_EXTENT_HDR
+            /* Only heads are linked, each trimmed to the blocks it still
+               describes, so that rebuilding never maps a superseded block */
+            pi->root.ofs_next = TRANS_ADDR_TO_OFS(sbi, &pi->root);
+            for (blk = 0; blk < (_round_up(size, PAGE_SIZE) / PAGE_SIZE); blk++) {
+                u32 run = 1;
+
+                addr = sm_get_cur_addr_by_cur_index(sb, &rn->ix, blk);
+                if (addr == 0) {
+                    continue;
+                }
+
+                hdr = sm_get_hdr_by_addr(sb, addr);
+                if (hdr->valid != 1 || hdr->ino != rn->ino || hdr->f_blk != blk) {
+                    continue;
+                }
+
+                while (run < sm_hdr_run(hdr) &&
+                       sm_get_cur_addr_by_cur_index(sb, &rn->ix, blk + run) == addr + run * HK_PBLK_SZ) {
+                    run++;
+                }
+                hdr->run = run;
+
+                sm_insert_hdr(sb, (struct hk_header *)&pi->root, hdr,
+                              (struct hk_header *)TRANS_OFS_TO_ADDR(sbi, pi->root.ofs_next));
+            }
+#else
             for (blk = 0; blk < (_round_up(size, PAGE_SIZE) / PAGE_SIZE); blk++) {
                 next_addr = sm_get_next_addr_by_cur_index(sb, &rn->ix, blk);
                 prev_addr = sm_get_prev_addr_by_cur_index(sb, &rn->ix, blk);
@@ -458,6 +617,7 @@ int hk_failure_recovery(struct super_block *sb)
 
                 sm_insert_hdr(sb, prev_hdr, hdr, next_hdr);
             }
+#endif
         } else {
             // No need check this pi again.
             hk_invalidate_data_blocks(sb, &rn->ix, rn->size, 0);
@@ -465,6 +625,9 @@ int hk_failure_recovery(struct super_block *sb)
         // Clean up recovery node
         rb_erase(&rn->rbnode, &recovery_table);
         linix_destroy(&rn->ix);
+#ifdef CONFIG_EXTENT_HDR
+        hk_range_free_all(&rn->runs);
+#endif
         hk_free_hk_recovery_node(rn);
     }
     hk_info("recovery table count %d\n", count);
@@ -498,6 +661,9 @@ static bool hk_try_normal_recovery(struct super_block *sb)
     u64 blk = 0, addr = 0;
     struct hk_header *hdr;
     int cpuid;
+#ifdef CONFIG_EXTENT_HDR
+    u64 cover_end = 0;
+#endif
 
     if (le32_to_cpu(super->s_valid_umount) == HK_VALID_UMOUNT) {
         hk_dbgv("normal recovery\n");
@@ -513,9 +679,21 @@ static bool hk_try_normal_recovery(struct super_block *sb)
             layout->ind.total_blks = le64_to_cpu(super->s_layout->s_ind.total_blks);
 
             /* Rebuilding Gap Tree */
+#ifdef CONFIG_EXTENT_HDR
+            cover_end = 0;
+#endif
             traverse_layout_blks(addr, layout)
             {
                 hdr = sm_get_hdr_by_addr(sb, addr);
+#ifdef CONFIG_EXTENT_HDR
+                /* followers of a run are in use whatever their own header says */
+                if (addr < cover_end) {
+                    continue;
+                }
+                if (hdr->valid == 1) {
+                    cover_end = addr + sm_hdr_run(hdr) * HK_PBLK_SZ;
+                }
+#endif
                 if (hdr->valid != 1) {
                     blk = hk_get_dblk_by_addr(sbi, addr);
                     hk_range_insert_range(&layout->gaps_tree, blk, blk);
@@ -11,6 +11,9 @@ struct hk_recovery_node {
     u64 size;
     u32 cmtime;
     struct linix ix;
+#ifdef CONFIG_EXTENT_HDR
+    struct rb_root_cached runs; /* runs whose heads were seen, by dblk */
+#endif
 };
 
 #endif
\ No newline at end of file
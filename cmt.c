@@ -24,14 +24,14 @@ int hk_request_cmt(struct super_block *sb, void *info, struct hk_inode_info_head
 
 /* ===== Sync ===== */
 wait_queue_head_t cmt_finish_wq, flush_finish_wq;
-int cmt_finished[HK_CMT_WORKER_NUM];
+int *cmt_finished;
 int *flush_finished;
 
-static void wait_to_finish_cmt(void)
+static void wait_to_finish_cmt(int num_workers)
 {
     int i;
 
-    for (i = 0; i < HK_CMT_WORKER_NUM; i++) {
+    for (i = 0; i < num_workers; i++) {
         while (cmt_finished[i] == 0) {
             wait_event_interruptible_timeout(cmt_finish_wq, false,
                                              msecs_to_jiffies(1));
@@ -68,34 +68,135 @@ void hk_checkpoint_inode_state(struct inode *inode, struct hk_cmt_icp *icp)
     icp->flags = inode->i_flags;
     icp->tstamp = sih->tstamp;
     icp->links_count = inode->i_nlink;
+    icp->seq = sih->cmt_node ? atomic64_inc_return(&sih->cmt_node->al_stage.seq) : 0;
+    icp->cmt_node = sih->cmt_node;
 }
 
-void *__hk_generic_info_init(enum hk_cmt_info_type type)
+/* ===== Slot pools ===== */
+static struct hk_cmt_info_slot *hk_cmt_pool_pop(struct hk_cmt_pool *pool)
 {
-    void *info = NULL;
+    struct hk_cmt_info_slot *slot = NULL;
 
-    switch (type) {
-    case CMT_VALID_DATA:
-    case CMT_INVALID_DATA:
-    case CMT_UPDATE_DATA:
-    case CMT_DELETE_DATA:
-        info = hk_alloc_hk_cmt_data_info();
-        break;
-    case CMT_NEW_INODE:
-        info = hk_alloc_hk_cmt_new_inode_info();
-        break;
-    case CMT_UNLINK_INODE:
-        info = hk_alloc_hk_cmt_unlink_inode_info();
-        break;
-    case CMT_DELETE_INODE:
-        info = hk_alloc_hk_cmt_delete_inode_info();
-        break;
-    case CMT_CLOSE_INODE:
-        info = hk_alloc_hk_cmt_close_info();
-        break;
-    default:
-        break;
+    spin_lock(&pool->lock);
+    if (pool->nr_free != 0) {
+        slot = pool->ring[pool->head];
+        pool->head = (pool->head + 1) % pool->nr_slots;
+        pool->nr_free--;
+    }
+    spin_unlock(&pool->lock);
+
+    return slot;
+}
+
+static void hk_cmt_pool_push(struct hk_cmt_pool *pool, struct hk_cmt_info_slot *slot)
+{
+    spin_lock(&pool->lock);
+    BUG_ON(pool->nr_free >= pool->nr_slots);
+    pool->ring[pool->tail] = slot;
+    pool->tail = (pool->tail + 1) % pool->nr_slots;
+    pool->nr_free++;
+    spin_unlock(&pool->lock);
+}
+
+static bool hk_cmt_has_free_slot(struct hk_cmt_queue *cq)
+{
+    int i;
+
+    for (i = 0; i < cq->nr_pools; i++) {
+        if (READ_ONCE(cq->pools[i].nr_free) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int hk_cmt_pool_init(struct hk_cmt_pool *pool, int pool_id, u32 nr_slots)
+{
+    u32 i;
+
+    pool->slots = kvcalloc(nr_slots, sizeof(struct hk_cmt_info_slot), GFP_KERNEL);
+    if (!pool->slots) {
+        return -ENOMEM;
+    }
+    pool->ring = kvcalloc(nr_slots, sizeof(struct hk_cmt_info_slot *), GFP_KERNEL);
+    if (!pool->ring) {
+        kvfree(pool->slots);
+        pool->slots = NULL;
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < nr_slots; i++) {
+        pool->slots[i].pool_id = pool_id;
+        pool->ring[i] = &pool->slots[i];
+    }
+
+    spin_lock_init(&pool->lock);
+    pool->head = 0;
+    pool->tail = 0;
+    pool->nr_free = nr_slots;
+    pool->nr_slots = nr_slots;
+
+    return 0;
+}
+
+static void hk_cmt_pool_free(struct hk_cmt_pool *pool)
+{
+    if (pool->ring) {
+        kvfree(pool->ring);
+    }
+    if (pool->slots) {
+        kvfree(pool->slots);
+    }
+}
+
+/* Wake workers before their next round, e.g., when slots run out */
+static void hk_cmt_kick_workers(struct hk_cmt_queue *cq)
+{
+    atomic_inc(&cq->kicks);
+    wake_up_interruptible_all(&cq->kick_wq);
+}
+
+static struct hk_cmt_info_slot *hk_cmt_alloc_slot(struct super_block *sb)
+{
+    struct hk_sb_info *sbi = HK_SB(sb);
+    struct hk_cmt_queue *cq = sbi->cq;
+    struct hk_cmt_info_slot *slot;
+    int cpuid = hk_get_cpuid(sb) % cq->nr_pools;
+    int i;
+
+    while (true) {
+        /* local pool first, then borrow from the others */
+        for (i = 0; i < cq->nr_pools; i++) {
+            slot = hk_cmt_pool_pop(&cq->pools[(cpuid + i) % cq->nr_pools]);
+            if (slot) {
+                /* keep the zeroed semantic of slab allocation */
+                memset(slot, 0, offsetof(struct hk_cmt_info_slot, pool_id));
+                return slot;
+            }
+        }
+
+        /* all slots are in flight, wait for workers to retire some */
+        HK_STATS_ADD(cmt_pool_waits, 1);
+        hk_cmt_kick_workers(cq);
+        wait_event_timeout(cq->pool_wq, hk_cmt_has_free_slot(cq), msecs_to_jiffies(1));
+    }
+}
+
+static void hk_cmt_free_slot(struct super_block *sb, struct hk_cmt_info_slot *slot)
+{
+    struct hk_sb_info *sbi = HK_SB(sb);
+    struct hk_cmt_queue *cq = sbi->cq;
+
+    hk_cmt_pool_push(&cq->pools[slot->pool_id], slot);
+    if (waitqueue_active(&cq->pool_wq)) {
+        wake_up(&cq->pool_wq);
     }
+}
+
+void *__hk_generic_info_init(struct super_block *sb, enum hk_cmt_info_type type)
+{
+    struct hk_cmt_info_slot *slot = hk_cmt_alloc_slot(sb);
+    void *info = &slot->info;
 
     ((struct hk_cmt_info *)info)->type = type;
     INIT_LIST_HEAD(&((struct hk_cmt_info *)info)->lnode);
@@ -117,7 +218,7 @@ int hk_delegate_data_async(struct super_block *sb, struct inode *inode, struct h
         hk_dbgv("invalid data for %llu\n", inode->i_ino);
     }
 
-    data_info = __hk_generic_info_init(type);
+    data_info = __hk_generic_info_init(sb, type);
 
     INIT_TIMING(time);
     switch (type)
@@ -170,31 +271,77 @@ int hk_delegate_data_async(struct super_block *sb, struct inode *inode, struct h
     return 0;
 }
 
-int hk_delegate_create_async(struct super_block *sb, struct inode *inode, struct inode *dir, struct hk_dentry *direntry)
+static int __hk_delegate_new_inode_async(struct super_block *sb, struct inode *inode, struct inode *dir,
+                                         struct hk_dentry *direntry, enum hk_cmt_info_type type, u64 sym_blk_addr)
 {
     struct hk_cmt_new_inode_info *new_inode_info;
-    struct hk_sb_info *sbi = HK_SB(sb);
     struct hk_inode_info_header *sih = HK_IH(inode);
 
-    new_inode_info = __hk_generic_info_init(CMT_NEW_INODE);
+    new_inode_info = __hk_generic_info_init(sb, type);
     hk_checkpoint_inode_state(inode, &new_inode_info->inode_cp);
     hk_checkpoint_inode_state(dir, &new_inode_info->dir_inode_cp);
     new_inode_info->direntry = direntry;
+    new_inode_info->dir_node = HK_IH(dir)->cmt_node;
+    atomic_inc(&new_inode_info->dir_node->ns_inflight);
+    new_inode_info->sym_blk_addr = sym_blk_addr;
 
     hk_request_cmt(sb, new_inode_info, sih);
 
     return 0;
 }
 
+int hk_delegate_create_async(struct super_block *sb, struct inode *inode, struct inode *dir, struct hk_dentry *direntry)
+{
+    return __hk_delegate_new_inode_async(sb, inode, dir, direntry, CMT_NEW_INODE, 0);
+}
+
+/* a hard link to inode, which is queued on the inode */
+int hk_delegate_link_async(struct super_block *sb, struct inode *inode, struct inode *dir, struct hk_dentry *direntry)
+{
+    return __hk_delegate_new_inode_async(sb, inode, dir, direntry, CMT_LINK_INODE, 0);
+}
+
+int hk_delegate_symlink_async(struct super_block *sb, struct inode *inode, struct inode *dir, struct hk_dentry *direntry,
+                              u64 sym_blk_addr)
+{
+    return __hk_delegate_new_inode_async(sb, inode, dir, direntry, CMT_SYMLINK_INODE, sym_blk_addr);
+}
+
+/* Queued on the renamed inode, so that it is ordered with the create and the
+   unlinks of the inode */
+int hk_delegate_rename_async(struct super_block *sb, struct inode *inode, struct inode *old_dir, struct inode *new_dir,
+                             struct hk_dentry *pd, struct hk_dentry *pd_new)
+{
+    struct hk_cmt_rename_info *rename_info;
+    struct hk_inode_info_header *sih = HK_IH(inode);
+
+    rename_info = __hk_generic_info_init(sb, CMT_RENAME_INODE);
+    hk_checkpoint_inode_state(inode, &rename_info->inode_cp);
+    hk_checkpoint_inode_state(old_dir, &rename_info->old_dir_cp);
+    hk_checkpoint_inode_state(new_dir, &rename_info->new_dir_cp);
+    rename_info->pd = pd;
+    rename_info->pd_new = pd_new;
+    rename_info->old_dir_node = HK_IH(old_dir)->cmt_node;
+    rename_info->new_dir_node = HK_IH(new_dir)->cmt_node;
+    atomic_inc(&rename_info->old_dir_node->ns_inflight);
+    atomic_inc(&rename_info->new_dir_node->ns_inflight);
+
+    hk_request_cmt(sb, rename_info, sih);
+
+    return 0;
+}
+
 int hk_delegate_unlink_async(struct super_block *sb, struct inode *inode, struct inode *dir, struct hk_dentry *direntry, bool invalidate)
 {
     struct hk_cmt_unlink_inode_info *unlink_info;
     struct hk_inode_info_header *sih = HK_IH(inode);
 
-    unlink_info = __hk_generic_info_init(CMT_UNLINK_INODE);
+    unlink_info = __hk_generic_info_init(sb, CMT_UNLINK_INODE);
     hk_checkpoint_inode_state(inode, &unlink_info->inode_cp);
     hk_checkpoint_inode_state(dir, &unlink_info->dir_inode_cp);
     unlink_info->direntry = direntry;
+    unlink_info->dir_node = HK_IH(dir)->cmt_node;
+    atomic_inc(&unlink_info->dir_node->ns_inflight);
     unlink_info->invalidate = invalidate;
 
     hk_request_cmt(sb, unlink_info, sih);
@@ -207,7 +354,7 @@ int hk_delegate_delete_async(struct super_block *sb, struct inode *inode)
     struct hk_cmt_delete_inode_info *delete_info;
     struct hk_inode_info_header *sih = HK_IH(inode);
 
-    delete_info = __hk_generic_info_init(CMT_DELETE_INODE);
+    delete_info = __hk_generic_info_init(sb, CMT_DELETE_INODE);
 
     hk_request_cmt(sb, delete_info, sih);
 }
@@ -218,7 +365,7 @@ int hk_delegate_close_async(struct super_block *sb, struct inode *inode)
     struct hk_cmt_close_info *close_info;
     struct hk_inode_info_header *sih = HK_IH(inode);
 
-    close_info = __hk_generic_info_init(CMT_CLOSE_INODE);
+    close_info = __hk_generic_info_init(sb, CMT_CLOSE_INODE);
     close_info->tail_addr = TRANS_OFS_TO_ADDR(sbi, linix_get(&sih->ix, 0));
 
     hk_request_cmt(sb, close_info, sih);
@@ -226,35 +373,27 @@ int hk_delegate_close_async(struct super_block *sb, struct inode *inode)
     return 0;
 }
 
-void hk_cmt_info_destroy(void *cmt_info)
+int hk_delegate_attr_async(struct super_block *sb, struct inode *inode)
+{
+    struct hk_cmt_attr_info *attr_info;
+    struct hk_inode_info_header *sih = HK_IH(inode);
+
+    attr_info = __hk_generic_info_init(sb, CMT_ATTR_INODE);
+
+    hk_request_cmt(sb, attr_info, sih);
+
+    return 0;
+}
+
+void hk_cmt_info_destroy(struct super_block *sb, void *cmt_info)
 {
     struct hk_cmt_info *info = cmt_info;
-    switch (info->type) {
-    case CMT_VALID_DATA:
-    case CMT_INVALID_DATA:
-    case CMT_UPDATE_DATA:
-    case CMT_DELETE_DATA:
-        hk_free_hk_cmt_data_info((struct hk_cmt_data_info *)info);
-        break;
-    case CMT_NEW_INODE:
-        hk_free_hk_cmt_new_inode_info((struct hk_cmt_new_inode_info *)info);
-        break;
-    case CMT_UNLINK_INODE:
-        hk_free_hk_cmt_unlink_inode_info((struct hk_cmt_unlink_inode_info *)info);
-        break;
-    case CMT_DELETE_INODE:
-        hk_free_hk_cmt_delete_inode_info((struct hk_cmt_delete_inode_info *)info);
-        break;
-    case CMT_CLOSE_INODE:
-        hk_free_hk_cmt_close_info((struct hk_cmt_close_info *)info);
-        break;
-    default:
-        break;
-    }
+
+    hk_cmt_free_slot(sb, container_of(info, struct hk_cmt_info_slot, info));
 }
 
 /* ===== Process ===== */
-int hk_process_data_info(struct super_block *sb, u64 ino, struct hk_cmt_data_info *data_info)
+int hk_process_data_info(struct super_block *sb, struct hk_cmt_node *cmt_node, struct hk_cmt_data_info *data_info)
 {
     struct hk_header *hdr;
     struct hk_layout_info *layout = NULL;
@@ -265,11 +404,45 @@ int hk_process_data_info(struct super_block *sb, u64 ino, struct hk_cmt_data_inf
     u64 size = data_info->size;
     u64 prev_addr = data_info->prev_addr;
     u64 next_addr = data_info->next_addr;
+    struct hk_xpline_wc wc;
 
     INIT_TIMING(time);
 
     HK_START_TIMING(process_data_info_t, time);
 
+    hk_wc_init(sb, &wc);
+
+#ifdef CONFIG_EXTENT_HDR
+    if (data_info->type == CMT_VALID_DATA) {
+        /* One head per layout covered by the batch */
+        for (addr = addr_start, blk = blk_start; addr < addr_end;) {
+            u64 run_end;
+            u32 run;
+
+            hdr = sm_get_hdr_by_addr(sb, addr);
+            layout = sm_get_layout_by_hdr(sb, hdr);
+            run_end = min(addr_end, layout->layout_end);
+            run = (run_end - addr) / HK_PBLK_SZ;
+
+            use_layout(layout);
+            __sm_valid_run_sync(sb, addr, run, cmt_node, blk, data_info->tstamp,
+                                size + (run - 1) * HK_PBLK_SZ, data_info->cmtime, &wc);
+            unuse_layout(layout);
+
+            size += run * HK_PBLK_SZ;
+            addr = run_end;
+            blk += run;
+        }
+        goto out;
+    }
+
+    if (data_info->type == CMT_DELETE_DATA) {
+        sm_uncover_range(sb, cmt_node, addr_start, addr_end);
+    }
+#endif
+
+    /* Group commit: headers of the batch are gathered by XPLine, written back
+       XPLine by XPLine, and fenced once before the next info of this node */
     for (addr = addr_start, blk = blk_start; addr < addr_end; addr += HK_PBLK_SZ, blk += 1) {
         hdr = sm_get_hdr_by_addr(sb, addr);
         layout = sm_get_layout_by_hdr(sb, hdr);
@@ -277,20 +450,28 @@ int hk_process_data_info(struct super_block *sb, u64 ino, struct hk_cmt_data_inf
         use_layout(layout);
         switch (data_info->type) {
         case CMT_VALID_DATA: {
-            sm_valid_data_sync(sb, prev_addr, addr, next_addr, ino, blk,
-                               data_info->tstamp, size, data_info->cmtime);
+            __sm_valid_data_sync(sb, prev_addr, addr, next_addr, cmt_node, blk,
+                                 data_info->tstamp, size, data_info->cmtime, &wc);
             break;
         }
         case CMT_INVALID_DATA: {
             if (hdr->tstamp <= data_info->tstamp) {
-                sm_invalid_data_sync(sb, prev_addr, addr, ino);
+                __sm_invalid_data_sync(sb, prev_addr, addr, cmt_node, &wc);
             } else {
                 BUG_ON(1);
             }
             break;
         }
         case CMT_UPDATE_DATA: {
-            sm_update_data_sync(sb, addr, size);
+#ifdef CONFIG_EXTENT_HDR
+            /* the head keeps the largest size seen by its run */
+            if (size < sm_get_hdr_by_addr(sb, sm_get_run_head_addr(sb, cmt_node, addr))->size) {
+                break;
+            }
+            __sm_update_data_sync(sb, sm_get_run_head_addr(sb, cmt_node, addr), size, &wc);
+#else
+            __sm_update_data_sync(sb, addr, size, &wc);
+#endif
             break;
         }
         case CMT_DELETE_DATA: {
@@ -304,12 +485,31 @@ int hk_process_data_info(struct super_block *sb, u64 ino, struct hk_cmt_data_inf
         next_addr = addr;
         unuse_layout(layout);
     }
+
+#ifdef CONFIG_EXTENT_HDR
+out:
+#endif
+    if (data_info->type != CMT_DELETE_DATA) {
+        hk_wc_drain(&wc);
+        PERSISTENT_BARRIER();
+        HK_STATS_ADD(sm_hdr_fences, 1);
+    }
     HK_END_TIMING(process_data_info_t, time);
 }
 
+/* A namespace tx pointing to a dentry of dir_node is finished, see hk_dir_settled */
+static inline void hk_cmt_ns_finished(struct hk_cmt_node *dir_node)
+{
+    smp_mb__before_atomic();
+    atomic_dec(&dir_node->ns_inflight);
+}
+
 extern int hk_start_tx_for_new_inode(struct super_block *sb, u64 ino, struct hk_dentry *direntry,
                                      u64 dir_ino, umode_t mode);
+extern int hk_start_tx_for_symlink(struct super_block *sb, u64 ino, struct hk_dentry *direntry,
+                                   u64 dir_ino, u64 sym_blk_addr);
 
+/* Handles CMT_NEW_INODE, CMT_LINK_INODE and CMT_SYMLINK_INODE */
 int hk_process_new_inode_info(struct super_block *sb, u64 ino, struct hk_cmt_new_inode_info *new_inode_info)
 {
     unsigned long irq_flags = 0;
@@ -321,15 +521,37 @@ int hk_process_new_inode_info(struct super_block *sb, u64 ino, struct hk_cmt_new
 
     HK_START_TIMING(process_new_inode_info_t, time);
 
-    hk_commit_icp(sb, &new_inode_info->inode_cp);
-
-    txid = hk_start_tx_for_new_inode(sb, ino, new_inode_info->direntry, pidir_ino, new_inode_info->inode_cp.mode);
+    switch (new_inode_info->type) {
+    case CMT_LINK_INODE:
+        /* S_IFLNK selects the LINK journal, see hk_get_new_inode_jtype */
+        txid = hk_start_tx_for_new_inode(sb, ino, new_inode_info->direntry, pidir_ino, S_IFLNK);
+        break;
+    case CMT_SYMLINK_INODE:
+        hk_commit_icp(sb, &new_inode_info->inode_cp);
+        txid = hk_start_tx_for_symlink(sb, ino, new_inode_info->direntry, pidir_ino,
+                                       new_inode_info->sym_blk_addr);
+        if (txid >= 0) {
+            hk_memunlock_pi(sb, pi, &irq_flags);
+            pi->valid = 1;
+            hk_memlock_pi(sb, pi, &irq_flags);
+        }
+        break;
+    default:
+        hk_commit_icp(sb, &new_inode_info->inode_cp);
+        txid = hk_start_tx_for_new_inode(sb, ino, new_inode_info->direntry, pidir_ino,
+                                         new_inode_info->inode_cp.mode);
+        break;
+    }
     if (txid < 0) {
-        hk_dbgv("hk_start_tx_for_new_inode failed\n");
+        hk_dbgv("%s: start tx failed\n", __func__);
         return txid;
     }
     hk_commit_icp_attrchange(sb, &new_inode_info->dir_inode_cp);
+    if (new_inode_info->type == CMT_LINK_INODE) {
+        hk_commit_icp_linkchange(sb, &new_inode_info->inode_cp);
+    }
     hk_finish_tx(sb, txid);
+    hk_cmt_ns_finished(new_inode_info->dir_node);
 
     HK_END_TIMING(process_new_inode_info_t, time);
 }
@@ -357,9 +579,41 @@ int hk_process_unlink_info(struct super_block *sb, u64 ino, struct hk_cmt_unlink
     hk_commit_icp_attrchange(sb, &unlink_info->inode_cp);
     hk_commit_icp_linkchange(sb, &unlink_info->dir_inode_cp);
     hk_finish_tx(sb, txid);
+    hk_reclaim_dentry(sb, unlink_info->direntry);
+    hk_cmt_ns_finished(unlink_info->dir_node);
     HK_END_TIMING(process_unlink_inode_info_t, time);
 }
 
+extern int hk_start_tx_for_rename(struct super_block *sb, struct hk_inode *pi,
+                                  struct hk_dentry *pd, struct hk_dentry *pd_new,
+                                  struct hk_inode *pi_par, struct hk_inode *pi_new);
+
+int hk_process_rename_info(struct super_block *sb, u64 ino, struct hk_cmt_rename_info *rename_info)
+{
+    struct hk_inode *pi = hk_get_pi_by_ino(sb, ino);
+    struct hk_inode *pi_par = hk_get_pi_by_ino(sb, rename_info->old_dir_cp.ino);
+    struct hk_inode *pi_new = hk_get_pi_by_ino(sb, rename_info->new_dir_cp.ino);
+    int txid = 0;
+    INIT_TIMING(time);
+
+    HK_START_TIMING(process_rename_info_t, time);
+    txid = hk_start_tx_for_rename(sb, pi, rename_info->pd, rename_info->pd_new, pi_par, pi_new);
+    if (txid < 0) {
+        hk_dbgv("hk_start_tx_for_rename failed\n");
+        return txid;
+    }
+    hk_commit_icp_linkchange(sb, &rename_info->inode_cp);
+    hk_commit_icp_attrchange(sb, &rename_info->old_dir_cp);
+    if (rename_info->new_dir_cp.ino != rename_info->old_dir_cp.ino) {
+        hk_commit_icp_attrchange(sb, &rename_info->new_dir_cp);
+    }
+    hk_finish_tx(sb, txid);
+    hk_reclaim_dentry(sb, rename_info->pd);
+    hk_cmt_ns_finished(rename_info->old_dir_node);
+    hk_cmt_ns_finished(rename_info->new_dir_node);
+    HK_END_TIMING(process_rename_info_t, time);
+}
+
 extern int hk_free_ino(struct super_block *sb, u64 ino);
 
 int hk_process_delete_info(struct super_block *sb, struct hk_cmt_node *cmt_node, struct hk_cmt_delete_inode_info *delete_info)
@@ -376,6 +630,11 @@ int hk_process_delete_info(struct super_block *sb, struct hk_cmt_node *cmt_node,
     (void)delete_info;
 
     HK_START_TIMING(process_delete_inode_info_t, time);
+    /* attrs staged for a deleted inode are never written */
+    spin_lock(&cmt_node->al_stage.lock);
+    cmt_node->al_stage.staged = 0;
+    spin_unlock(&cmt_node->al_stage.lock);
+
     hk_memunlock_pi(sb, pi, &irq_flags);
     pi->valid = 0;
     hk_flush_buffer(pi, CACHELINE_SIZE, true);
@@ -413,6 +672,10 @@ int hk_process_close_info(struct super_block *sb, struct hk_cmt_node *cmt_node,
     INIT_TIMING(time);
 
     HK_START_TIMING(process_close_inode_info_t, time);
+#ifdef CONFIG_EXTENT_HDR
+    /* heads are linked in commit order, the tail is tracked when linking */
+    tail_addr = cmt_node->tail ? sm_get_addr_by_hdr(sb, (u64)cmt_node->tail) : 0;
+#endif
     /* flush in-DRAM hdr address  */
     pi->root.ofs_next = cmt_node->root.ofs_next;
     if (tail_addr) {
@@ -424,32 +687,287 @@ int hk_process_close_info(struct super_block *sb, struct hk_cmt_node *cmt_node,
     return 0;
 }
 
-int hk_process_cmt_info(struct super_block *sb, struct hk_cmt_node *cmt_node, void *info, enum hk_cmt_info_type type)
+/* ===== Compound transactions ===== */
+extern enum hk_journal_type hk_get_new_inode_jtype(umode_t mode);
+
+static enum hk_journal_type hk_cmt_new_inode_jtype(struct hk_cmt_new_inode_info *new_inode_info)
+{
+    switch (new_inode_info->type) {
+    case CMT_LINK_INODE:
+        return LINK;
+    case CMT_SYMLINK_INODE:
+        return SYMLINK;
+    default:
+        return hk_get_new_inode_jtype(new_inode_info->inode_cp.mode);
+    }
+}
+
+/* If op commits an attr log entry of `kind` for ino */
+static bool hk_cmt_tx_op_commits(struct hk_cmt_tx_op *op, u8 kind, u64 ino)
+{
+    switch (op->info.type) {
+    case CMT_NEW_INODE:
+    case CMT_SYMLINK_INODE:
+        return kind == SET_ATTR && op->new_inode_info.dir_inode_cp.ino == ino;
+    case CMT_LINK_INODE:
+        if (kind == SET_ATTR) {
+            return op->new_inode_info.dir_inode_cp.ino == ino;
+        }
+        return kind == LINK_CHANGE && op->new_inode_info.inode_cp.ino == ino;
+    case CMT_RENAME_INODE:
+        if (kind == SET_ATTR) {
+            return op->rename_info.old_dir_cp.ino == ino || op->rename_info.new_dir_cp.ino == ino;
+        }
+        return kind == LINK_CHANGE && op->rename_info.inode_cp.ino == ino;
+    default:
+        if (kind == SET_ATTR) {
+            return op->unlink_info.inode_cp.ino == ino;
+        }
+        return kind == LINK_CHANGE && op->unlink_info.dir_inode_cp.ino == ino;
+    }
+}
+
+/* An attr log commit is absorbed if a later op of the batch commits the same
+   kind of entry for the same inode */
+static bool hk_cmt_tx_absorbed(struct hk_cmt_tx_batch *txb, int opid, u8 kind, u64 ino)
+{
+    int i;
+
+    for (i = opid + 1; i < txb->nr_ops; i++) {
+        if (hk_cmt_tx_op_commits(&txb->ops[i], kind, ino)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void hk_cmt_tx_commit_icp(struct super_block *sb, struct hk_cmt_tx_batch *txb, int opid,
+                                 u8 kind, struct hk_cmt_icp *icp)
+{
+    if (hk_cmt_tx_absorbed(txb, opid, kind, icp->ino)) {
+        return;
+    }
+    if (kind == SET_ATTR) {
+        hk_commit_icp_attrchange(sb, icp);
+    } else {
+        hk_commit_icp_linkchange(sb, icp);
+    }
+}
+
+static void __hk_cmt_tx_commit(struct super_block *sb, struct hk_cmt_tx_batch *txb)
+{
+    struct hk_cmt_tx_op *op;
+    struct hk_inode *pi;
+    unsigned long irq_flags = 0;
+    int txid;
+    int i;
+    INIT_TIMING(time);
+
+    if (txb->nr_ops == 0) {
+        return;
+    }
+
+    HK_START_TIMING(process_tx_batch_t, time);
+    txid = hk_start_compound_tx(sb, txb->infos, txb->nr_ops);
+    BUG_ON(txid < 0);
+
+    for (i = 0; i < txb->nr_ops; i++) {
+        op = &txb->ops[i];
+        pi = hk_get_pi_by_ino(sb, op->cmt_node->ino);
+        switch (op->info.type) {
+        case CMT_NEW_INODE:
+        case CMT_SYMLINK_INODE:
+            hk_memunlock_pi(sb, pi, &irq_flags);
+            pi->valid = 1;
+            hk_memlock_pi(sb, pi, &irq_flags);
+
+            hk_cmt_tx_commit_icp(sb, txb, i, SET_ATTR, &op->new_inode_info.dir_inode_cp);
+            break;
+        case CMT_LINK_INODE:
+            hk_cmt_tx_commit_icp(sb, txb, i, SET_ATTR, &op->new_inode_info.dir_inode_cp);
+            hk_cmt_tx_commit_icp(sb, txb, i, LINK_CHANGE, &op->new_inode_info.inode_cp);
+            break;
+        case CMT_RENAME_INODE:
+            hk_cmt_tx_commit_icp(sb, txb, i, SET_ATTR, &op->rename_info.old_dir_cp);
+            if (op->rename_info.new_dir_cp.ino != op->rename_info.old_dir_cp.ino) {
+                hk_cmt_tx_commit_icp(sb, txb, i, SET_ATTR, &op->rename_info.new_dir_cp);
+            }
+            hk_cmt_tx_commit_icp(sb, txb, i, LINK_CHANGE, &op->rename_info.inode_cp);
+            break;
+        default:
+            if (op->unlink_info.invalidate) {
+                hk_memunlock_pi(sb, pi, &irq_flags);
+                pi->valid = 0;
+                hk_memlock_pi(sb, pi, &irq_flags);
+            }
+
+            hk_cmt_tx_commit_icp(sb, txb, i, SET_ATTR, &op->unlink_info.inode_cp);
+            hk_cmt_tx_commit_icp(sb, txb, i, LINK_CHANGE, &op->unlink_info.dir_inode_cp);
+            break;
+        }
+    }
+
+    hk_finish_tx(sb, txid);
+
+    for (i = 0; i < txb->nr_ops; i++) {
+        op = &txb->ops[i];
+        cmpxchg(&op->cmt_node->tx_batch, txb, NULL);
+        switch (op->info.type) {
+        case CMT_NEW_INODE:
+        case CMT_LINK_INODE:
+        case CMT_SYMLINK_INODE:
+            hk_cmt_ns_finished(op->new_inode_info.dir_node);
+            break;
+        case CMT_RENAME_INODE:
+            hk_reclaim_dentry(sb, op->rename_info.pd);
+            hk_cmt_ns_finished(op->rename_info.old_dir_node);
+            hk_cmt_ns_finished(op->rename_info.new_dir_node);
+            break;
+        default:
+            hk_reclaim_dentry(sb, op->unlink_info.direntry);
+            hk_cmt_ns_finished(op->unlink_info.dir_node);
+            break;
+        }
+    }
+
+    HK_STATS_ADD(tx_batches, 1);
+    HK_STATS_ADD(tx_batched_ops, txb->nr_ops);
+    txb->nr_ops = 0;
+    HK_END_TIMING(process_tx_batch_t, time);
+}
+
+void hk_cmt_tx_commit(struct super_block *sb, struct hk_cmt_tx_batch *txb)
+{
+    mutex_lock(&txb->lock);
+    __hk_cmt_tx_commit(sb, txb);
+    mutex_unlock(&txb->lock);
+}
+
+/* Commit the batch holding namespace ops of cmt_node, if any */
+void hk_cmt_tx_commit_node(struct super_block *sb, struct hk_cmt_node *cmt_node)
+{
+    struct hk_cmt_tx_batch *txb = READ_ONCE(cmt_node->tx_batch);
+
+    if (txb) {
+        hk_cmt_tx_commit(sb, txb);
+    }
+}
+
+/* Defer a namespace info to txb. Caller holds cmt_node->processing */
+static void hk_cmt_tx_add(struct super_block *sb, struct hk_cmt_tx_batch *txb,
+                          struct hk_cmt_node *cmt_node, struct hk_cmt_info *info)
+{
+    struct hk_cmt_new_inode_info *new_inode_info;
+    struct hk_cmt_unlink_inode_info *unlink_info;
+    struct hk_cmt_rename_info *rename_info;
+    struct hk_cmt_tx_batch *prev = READ_ONCE(cmt_node->tx_batch);
+    struct hk_cmt_tx_op *op;
+    struct hk_inode *pi = hk_get_pi_by_ino(sb, cmt_node->ino);
+    struct hk_inode *pidir;
+
+    /* the node has been stolen from another worker, keep its ops in order */
+    if (prev && prev != txb) {
+        hk_cmt_tx_commit(sb, prev);
+    }
+
+    mutex_lock(&txb->lock);
+    if (txb->nr_ops == HK_TX_BATCH_OPS) {
+        __hk_cmt_tx_commit(sb, txb);
+    }
+
+    op = &txb->ops[txb->nr_ops];
+    op->cmt_node = cmt_node;
+    switch (info->type) {
+    case CMT_NEW_INODE:
+    case CMT_LINK_INODE:
+    case CMT_SYMLINK_INODE:
+        new_inode_info = (struct hk_cmt_new_inode_info *)info;
+        op->new_inode_info = *new_inode_info;
+        pidir = hk_get_pi_by_ino(sb, new_inode_info->dir_inode_cp.ino);
+
+        if (info->type != CMT_LINK_INODE) {
+            hk_commit_icp(sb, &new_inode_info->inode_cp);
+        }
+        /* the extra arg is only consumed by SYMLINK */
+        hk_prepare_tx(sb, &txb->infos[txb->nr_ops], hk_cmt_new_inode_jtype(new_inode_info),
+                      pi, new_inode_info->direntry, pidir, new_inode_info->sym_blk_addr);
+        break;
+    case CMT_RENAME_INODE:
+        rename_info = (struct hk_cmt_rename_info *)info;
+        op->rename_info = *rename_info;
+
+        hk_prepare_tx(sb, &txb->infos[txb->nr_ops], RENAME, pi, rename_info->pd, rename_info->pd_new,
+                      hk_get_pi_by_ino(sb, rename_info->old_dir_cp.ino),
+                      hk_get_pi_by_ino(sb, rename_info->new_dir_cp.ino));
+        break;
+    default:
+        unlink_info = (struct hk_cmt_unlink_inode_info *)info;
+        op->unlink_info = *unlink_info;
+        pidir = hk_get_pi_by_ino(sb, unlink_info->dir_inode_cp.ino);
+
+        hk_prepare_tx(sb, &txb->infos[txb->nr_ops], UNLINK, pi, unlink_info->direntry, pidir);
+        break;
+    }
+    txb->nr_ops++;
+    WRITE_ONCE(cmt_node->tx_batch, txb);
+    mutex_unlock(&txb->lock);
+}
+
+/* Infos of cmt workers pass their own txb, the others are processed at once */
+int hk_process_cmt_info(struct super_block *sb, struct hk_cmt_node *cmt_node, void *info,
+                        enum hk_cmt_info_type type, struct hk_cmt_tx_batch *txb)
 {
     switch (type) {
     case CMT_VALID_DATA:
     case CMT_INVALID_DATA:
     case CMT_UPDATE_DATA:
     case CMT_DELETE_DATA:
-        hk_process_data_info(sb, cmt_node->ino, (struct hk_cmt_data_info *)info);
+        hk_process_data_info(sb, cmt_node, (struct hk_cmt_data_info *)info);
         break;
     case CMT_UNLINK_INODE:
+        if (txb) {
+            hk_cmt_tx_add(sb, txb, cmt_node, (struct hk_cmt_info *)info);
+            break;
+        }
+        hk_cmt_tx_commit_node(sb, cmt_node);
         hk_process_unlink_info(sb, cmt_node->ino, (struct hk_cmt_unlink_inode_info *)info);
         break;
     case CMT_DELETE_INODE:
+        /* the ino is freed for reuse, the batched ops must land first */
+        hk_cmt_tx_commit_node(sb, cmt_node);
         hk_process_delete_info(sb, cmt_node, (struct hk_cmt_delete_inode_info *)info);
         break;
     case CMT_NEW_INODE:
+    case CMT_LINK_INODE:
+    case CMT_SYMLINK_INODE:
+        if (txb) {
+            hk_cmt_tx_add(sb, txb, cmt_node, (struct hk_cmt_info *)info);
+            break;
+        }
+        hk_cmt_tx_commit_node(sb, cmt_node);
         hk_process_new_inode_info(sb, cmt_node->ino, (struct hk_cmt_new_inode_info *)info);
         break;
+    case CMT_RENAME_INODE:
+        if (txb) {
+            hk_cmt_tx_add(sb, txb, cmt_node, (struct hk_cmt_info *)info);
+            break;
+        }
+        hk_cmt_tx_commit_node(sb, cmt_node);
+        hk_process_rename_info(sb, cmt_node->ino, (struct hk_cmt_rename_info *)info);
+        break;
     case CMT_CLOSE_INODE:
         hk_process_close_info(sb, cmt_node, (struct hk_cmt_close_info *)info);
         break;
+    case CMT_ATTR_INODE:
+        hk_flush_al_stage(sb, &cmt_node->al_stage, cmt_node->ino);
+        break;
     default:
         break;
     }
 
-    hk_cmt_info_destroy(info);
+    hk_cmt_info_destroy(sb, info);
+    atomic_long_dec(&HK_SB(sb)->cq->nr_pending);
 
     return 0;
 }
@@ -468,12 +986,28 @@ struct hk_cmt_node *hk_cmt_node_init(struct super_block *sb, u64 ino)
 
     mutex_init(&node->processing);
 
+    INIT_LIST_HEAD(&node->wnode);
+    atomic_set(&node->scheduled, 0);
+    node->tx_batch = NULL;
+    atomic_set(&node->ns_inflight, 0);
+    hk_al_stage_init(&node->al_stage);
+
+#ifdef CONFIG_EXTENT_HDR
+    node->runs = RB_ROOT_CACHED;
+    xa_init(&node->prevs);
+    node->tail = NULL;
+#endif
+
     return node;
 }
 
 void hk_cmt_node_destroy(struct hk_cmt_node *node)
 {
     if (node) {
+#ifdef CONFIG_EXTENT_HDR
+        hk_range_free_all(&node->runs);
+        xa_destroy(&node->prevs);
+#endif
         hk_free_hk_cmt_node(node);
     }
 }
@@ -483,8 +1017,8 @@ int hk_cmt_manage_node(struct super_block *sb, struct hk_cmt_node *cmt_node, str
     struct hk_sb_info *sbi = HK_SB(sb);
     struct hk_cmt_queue *cq = sbi->cq;
     u64 ino = cmt_node->ino;
-    struct rb_root *tree = &cq->cmt_forest[ino % HK_CMT_WORKER_NUM];
-    struct mutex *lock = &cq->locks[ino % HK_CMT_WORKER_NUM];
+    struct rb_root *tree = &cq->cmt_forest[ino % cq->nr_workers];
+    struct mutex *lock = &cq->locks[ino % cq->nr_workers];
     struct hk_cmt_node *curr;
     struct rb_node **temp, *parent;
     int compVal;
@@ -529,8 +1063,8 @@ struct hk_cmt_node *hk_cmt_search_node(struct super_block *sb, u64 ino)
 {
     struct hk_sb_info *sbi = HK_SB(sb);
     struct hk_cmt_queue *cq = sbi->cq;
-    struct rb_root *tree = &cq->cmt_forest[ino % HK_CMT_WORKER_NUM];
-    struct mutex *lock = &cq->locks[ino % HK_CMT_WORKER_NUM];
+    struct rb_root *tree = &cq->cmt_forest[ino % cq->nr_workers];
+    struct mutex *lock = &cq->locks[ino % cq->nr_workers];
     struct hk_cmt_node *curr;
     struct rb_node **temp, *parent;
     int compVal;
@@ -593,15 +1127,106 @@ void hk_cmt_destory_forest(struct super_block *sb)
     struct hk_cmt_queue *cq = sbi->cq;
     int i;
 
-    for (i = 0; i < HK_CMT_WORKER_NUM; i++) {
+    for (i = 0; i < cq->nr_workers; i++) {
         __hk_cmt_destroy_node_tree(sb, &cq->cmt_forest[i]);
+        /* nodes are all freed, just drop the references */
+        hk_inf_queue_init(&cq->work_qs[i]);
     }
 }
 
+/* Put the node into the work queue of `work_id` if it is not scheduled yet */
+static void hk_cmt_schedule_node(struct hk_cmt_queue *cq, struct hk_cmt_node *cmt_node, int work_id)
+{
+    if (atomic_cmpxchg(&cmt_node->scheduled, 0, 1) != 0) {
+        return;
+    }
+    hk_inf_queue_add_tail_locked(&cq->work_qs[work_id], &cmt_node->wnode);
+}
+
+/* Pop a node from own work queue, or steal one from the busiest queue */
+static struct hk_cmt_node *hk_cmt_pick_node(struct hk_cmt_queue *cq, int work_id)
+{
+    struct list_head *wnode;
+    int i, victim = -1, max_num = 0, num;
+
+    wnode = hk_inf_queue_try_pop_front_locked(&cq->work_qs[work_id]);
+    if (wnode) {
+        return list_entry(wnode, struct hk_cmt_node, wnode);
+    }
+
+    for (i = 0; i < cq->nr_workers; i++) {
+        if (i == work_id) {
+            continue;
+        }
+        /* racy read is fine, we only need a hint */
+        num = READ_ONCE(cq->work_qs[i].num);
+        if (num > max_num) {
+            max_num = num;
+            victim = i;
+        }
+    }
+
+    if (victim == -1) {
+        return NULL;
+    }
+
+    /* steal from the tail, the owner pops from the head */
+    wnode = hk_inf_queue_try_pop_back_locked(&cq->work_qs[victim]);
+    if (wnode) {
+        hk_dbgv("worker %d steals cmt node from worker %d\n", work_id, victim);
+        return list_entry(wnode, struct hk_cmt_node, wnode);
+    }
+
+    return NULL;
+}
+
+/* Activate one more worker once the active ones fall behind. A worker parks
+   itself again when the load is gone, see hk_cmt_worker_thread. */
+static void hk_cmt_scale_up(struct hk_cmt_queue *cq, long pending)
+{
+    int active = atomic_read(&cq->nr_active);
+
+    if (active >= cq->nr_workers || pending <= (long)active * HK_CMT_WORKER_LOAD)
+        return;
+
+    if (atomic_cmpxchg(&cq->nr_active, active, active + 1) == active) {
+        HK_STATS_ADD(cmt_workers_up, 1);
+        hk_cmt_kick_workers(cq);
+    }
+}
+
+/* The last active worker parks if it found nothing to do in a round and
+   the others are enough for the load */
+static bool hk_cmt_scale_down(struct hk_cmt_queue *cq, int work_id)
+{
+    int active = atomic_read(&cq->nr_active);
+    long pending = atomic_long_read(&cq->nr_pending);
+
+    if (active == 1 || work_id != active - 1)
+        return false;
+    if (pending * 2 > (long)(active - 1) * HK_CMT_WORKER_LOAD)
+        return false;
+
+    if (atomic_cmpxchg(&cq->nr_active, active, active - 1) == active) {
+        HK_STATS_ADD(cmt_workers_down, 1);
+        return true;
+    }
+    return false;
+}
+
 int hk_request_cmt(struct super_block *sb, void *info, struct hk_inode_info_header *sih)
 {
+    struct hk_sb_info *sbi = HK_SB(sb);
+    struct hk_cmt_queue *cq = sbi->cq;
     struct hk_cmt_data_info *cmt_data = (struct hk_cmt_data_info *)info;
+    long pending;
+
     hk_inf_queue_add_tail_locked(&sih->cmt_node->op_q, &cmt_data->lnode);
+    pending = atomic_long_inc_return(&cq->nr_pending);
+    hk_cmt_scale_up(cq, pending);
+    /* the node goes to the queue of the active worker local to this cpu.
+       Nodes left in the queue of a parked worker are stolen by the others. */
+    hk_cmt_schedule_node(cq, sih->cmt_node, hk_get_cpuid(sb) % atomic_read(&cq->nr_active));
     return 0;
 }
 
@@ -638,18 +1263,32 @@ static int hk_cmt_worker_thread(void *arg)
     allow_signal(SIGINT);
 
     struct hk_cmt_queue *cq = sbi->cq;
-    struct hk_cmt_node *cmt_node, *cmt_node_next;
+    struct hk_cmt_tx_batch *txb = &cq->tx_batches[work_id];
+    struct hk_cmt_node *cmt_node;
     struct hk_cmt_info *info, *info_next;
     struct list_head info_head;
     int batch = 0;
+    int kicks;
+    int picked;
 
     while (!kthread_should_stop()) {
-        ssleep_interruptible(HK_CMT_TIME_GAP);
+        if (work_id >= atomic_read(&cq->nr_active)) {
+            /* parked until the load needs this worker */
+            wait_event_interruptible(cq->kick_wq,
+                                     kthread_should_stop() || work_id < atomic_read(&cq->nr_active));
+            continue;
+        }
+
+        kicks = atomic_read(&cq->kicks);
+        wait_event_interruptible_timeout(cq->kick_wq,
+                                         kthread_should_stop() || atomic_read(&cq->kicks) != kicks,
+                                         HK_CMT_TIME_GAP * HZ);
 
         batch = HK_CMT_BATCH_NUM;
+        picked = 0;
 
-        rbtree_postorder_for_each_entry_safe(cmt_node, cmt_node_next, &cq->cmt_forest[work_id], rnode)
-        {
+        while ((cmt_node = hk_cmt_pick_node(cq, work_id)) != NULL) {
+            picked++;
             INIT_LIST_HEAD(&info_head);
 
             // fsync should hold this. Two situations:
@@ -658,6 +1297,9 @@ static int hk_cmt_worker_thread(void *arg)
 
             mutex_lock(&cmt_node->processing);
 
+            /* infos requested from now on reschedule this node */
+            atomic_set(&cmt_node->scheduled, 0);
+
             if (!cmt_node->valid) {
                 BUG_ON(1);
                 hk_dbgv("cmt node for inode %llu is invalid, delayed deletion of this node to umount\n", cmt_node->ino);
@@ -673,7 +1315,7 @@ static int hk_cmt_worker_thread(void *arg)
             list_for_each_entry_safe(info, info_next, &info_head, lnode)
             {
                 list_del(&info->lnode);
-                hk_process_cmt_info(sb, cmt_node, info, info->type);
+                hk_process_cmt_info(sb, cmt_node, info, info->type, txb);
                 batch--;
             }
 
@@ -681,13 +1323,25 @@ static int hk_cmt_worker_thread(void *arg)
 
             if (batch == 0) {
                 hk_info("%ld cmt info processed\n", HK_CMT_BATCH_NUM - batch);
+                /* leftovers wait for the next round */
+                if (hk_inf_queue_length(&cmt_node->op_q) != 0) {
+                    hk_cmt_schedule_node(cq, cmt_node, work_id);
+                }
                 break;
             }
             
             schedule();
         }
+
+        /* do not hold namespace ops across rounds */
+        hk_cmt_tx_commit(sb, txb);
+
+        if (!picked && hk_cmt_scale_down(cq, work_id))
+            hk_dbgv("cmt worker %d parked\n", work_id);
     }
 
+    hk_cmt_tx_commit(sb, txb);
+
     if (arg)
         kfree(arg);
 
@@ -703,12 +1357,17 @@ void hk_start_cmt_workers(struct super_block *sb)
 {
     struct hk_cmt_worker_param *param;
     struct hk_sb_info *sbi = HK_SB(sb);
+    int nr_workers = sbi->cq->nr_workers;
     int ret;
     int i;
 
     init_waitqueue_head(&cmt_finish_wq);
 
-    for (i = 0; i < HK_CMT_WORKER_NUM; i++) {
+    sbi->cmt_workers = kcalloc(nr_workers, sizeof(struct task_struct *), GFP_KERNEL);
+    cmt_finished = kcalloc(nr_workers, sizeof(int), GFP_KERNEL);
+    BUG_ON(!sbi->cmt_workers || !cmt_finished);
+
+    for (i = 0; i < nr_workers; i++) {
         param = kmalloc(sizeof(struct hk_cmt_worker_param), GFP_KERNEL);
 
         param->sb = sb;
@@ -728,18 +1387,24 @@ void hk_start_cmt_workers(struct super_block *sb)
 void hk_stop_cmt_workers(struct super_block *sb)
 {
     struct hk_sb_info *sbi = HK_SB(sb);
+    int nr_workers = sbi->cq->nr_workers;
     int i;
 
-    for (i = 0; i < HK_CMT_WORKER_NUM; i++) {
+    for (i = 0; i < nr_workers; i++) {
         send_sig(SIGINT, sbi->cmt_workers[i], 1);
         kthread_stop(sbi->cmt_workers[i]);
         sbi->cmt_workers[i] = NULL;
         hk_info("stop cmt worker %d (%s)\n", i, "FUSE");
     }
 
-    wait_to_finish_cmt();
+    wait_to_finish_cmt(nr_workers);
+
+    kfree(sbi->cmt_workers);
+    sbi->cmt_workers = NULL;
+    kfree(cmt_finished);
+    cmt_finished = NULL;
 
-    hk_info("stop %d cmt workers\n", HK_CMT_WORKER_NUM);
+    hk_info("stop %d cmt workers\n", nr_workers);
 }
 
 void hk_flush_cmt_node_fast(struct super_block *sb, struct hk_cmt_node *cmt_node)
@@ -761,12 +1426,49 @@ void hk_flush_cmt_node_fast(struct super_block *sb, struct hk_cmt_node *cmt_node
     list_for_each_entry_safe(info, info_next, &info_head, lnode)
     {
         list_del(&info->lnode);
-        hk_process_cmt_info(sb, cmt_node, info, info->type);
+        hk_process_cmt_info(sb, cmt_node, info, info->type, NULL);
     }
 
     return;
 }
 
+/* Bound the pending infos of both the sb and the inode, similar to
+   balance_dirty_pages(). Called by writers after delegating. */
+void hk_cmt_balance(struct super_block *sb, struct inode *inode)
+{
+    struct hk_sb_info *sbi = HK_SB(sb);
+    struct hk_cmt_queue *cq = sbi->cq;
+    struct hk_cmt_node *cmt_node = HK_IH(inode)->cmt_node;
+    long bg_thresh = (long)HK_CMT_BG_THRESH * cq->nr_pools;
+    long thresh = (long)HK_CMT_THRESH * cq->nr_pools;
+    long pending = atomic_long_read(&cq->nr_pending);
+    int inode_pending = hk_inf_queue_length(&cmt_node->op_q);
+
+    if (pending < bg_thresh && inode_pending < HK_CMT_INODE_THRESH) {
+        return;
+    }
+
+    /* start background commit before the interval ends */
+    hk_cmt_kick_workers(cq);
+
+    if (pending < thresh && inode_pending < HK_CMT_INODE_THRESH) {
+        return;
+    }
+
+    HK_STATS_ADD(cmt_throttles, 1);
+
+    /* help committing our own infos */
+    mutex_lock(&cmt_node->processing);
+    hk_flush_cmt_node_fast(sb, cmt_node);
+    mutex_unlock(&cmt_node->processing);
+
+    /* the rest belongs to other inodes, wait for workers to catch up */
+    while (atomic_long_read(&cq->nr_pending) >= thresh) {
+        wait_event_timeout(cq->pool_wq, atomic_long_read(&cq->nr_pending) < thresh,
+                           msecs_to_jiffies(1));
+    }
+}
+
 static int hk_flush_worker_thread(void *arg)
 {
     struct hk_flush_worker_param *param = (struct hk_flush_worker_param *)arg;
@@ -840,7 +1542,7 @@ void hk_flush_cmt_queue(struct super_block *sb, int num_cpus)
         }
 
         cnt = 0;
-        for (cmt_work_id = 0; cmt_work_id < HK_CMT_WORKER_NUM; cmt_work_id++) {
+        for (cmt_work_id = 0; cmt_work_id < cq->nr_workers; cmt_work_id++) {
             rbtree_postorder_for_each_entry_safe(cmt_node, cmt_node_next, &cq->cmt_forest[cmt_work_id], rnode)
             {
                 /* Pass the ownership to worker */
@@ -868,7 +1570,7 @@ void hk_flush_cmt_queue(struct super_block *sb, int num_cpus)
         kfree(flush_workers);
         kfree(flush_finished);
     } else {
-        for (cmt_work_id = 0; cmt_work_id < HK_CMT_WORKER_NUM; cmt_work_id++) {
+        for (cmt_work_id = 0; cmt_work_id < cq->nr_workers; cmt_work_id++) {
             // for each cmt node, we flush all the operation in the queue
             rbtree_postorder_for_each_entry_safe(cmt_node, cmt_node_next, &cq->cmt_forest[cmt_work_id], rnode)
             {
@@ -881,7 +1583,7 @@ void hk_flush_cmt_queue(struct super_block *sb, int num_cpus)
     hk_info("All cmts flushed\n");
 }
 
-struct hk_cmt_queue *hk_init_cmt_queue(int num_workers)
+struct hk_cmt_queue *hk_init_cmt_queue(int num_workers, int num_pools)
 {
     struct hk_cmt_queue *cq;
     int i;
@@ -910,21 +1612,80 @@ struct hk_cmt_queue *hk_init_cmt_queue(int num_workers)
         mutex_init(&cq->locks[i]);
     }
 
+    cq->work_qs = kmalloc_array(num_workers, sizeof(struct hk_inf_queue), GFP_KERNEL);
+    if (!cq->work_qs) {
+        hk_warn("%s: hk_init_cmt_queue: failed to allocate memory for work queues\n", __func__);
+        goto out3;
+    }
+    for (i = 0; i < num_workers; i++) {
+        hk_inf_queue_init(&cq->work_qs[i]);
+    }
+
+    cq->tx_batches = vzalloc(num_workers * sizeof(struct hk_cmt_tx_batch));
+    if (!cq->tx_batches) {
+        hk_warn("%s: hk_init_cmt_queue: failed to allocate memory for tx batches\n", __func__);
+        goto out4;
+    }
+    for (i = 0; i < num_workers; i++) {
+        mutex_init(&cq->tx_batches[i].lock);
+    }
+
+    cq->nr_workers = num_workers;
+    hk_info("%s: %d cmt workers\n", __func__, num_workers);
+
+    cq->pools = kcalloc(num_pools, sizeof(struct hk_cmt_pool), GFP_KERNEL);
+    if (!cq->pools) {
+        hk_warn("%s: hk_init_cmt_queue: failed to allocate memory for pools\n", __func__);
+        goto out5;
+    }
+    for (i = 0; i < num_pools; i++) {
+        if (hk_cmt_pool_init(&cq->pools[i], i, HK_CMT_POOL_SLOTS)) {
+            hk_warn("%s: hk_init_cmt_queue: failed to allocate memory for pool %d\n", __func__, i);
+            goto out6;
+        }
+    }
+    cq->nr_pools = num_pools;
+
+    init_waitqueue_head(&cq->pool_wq);
+    init_waitqueue_head(&cq->kick_wq);
+    atomic_set(&cq->kicks, 0);
+    atomic_long_set(&cq->nr_pending, 0);
+    atomic_set(&cq->nr_active, 1);
+
     return cq;
 
+out6:
+    while (i--) {
+        hk_cmt_pool_free(&cq->pools[i]);
+    }
+    kfree(cq->pools);
+out5:
+    vfree(cq->tx_batches);
+out4:
+    kfree(cq->work_qs);
+out3:
+    kfree(cq->locks);
 out2:
-    kfree(cq);
-out1:
     kfree(cq->cmt_forest);
+out1:
+    kfree(cq);
 out:
     return NULL;
 }
 
 void hk_free_cmt_queue(struct hk_cmt_queue *cq)
 {
+    int i;
+
     if (cq) {
+        for (i = 0; i < cq->nr_pools; i++) {
+            hk_cmt_pool_free(&cq->pools[i]);
+        }
+        kfree(cq->pools);
         kfree(cq->cmt_forest);
         kfree(cq->locks);
+        kfree(cq->work_qs);
+        vfree(cq->tx_batches);
         kfree(cq);
     }
 }
\ No newline at end of file
@@ -12,6 +12,10 @@ enum hk_cmt_info_type {
     CMT_DELETE_INODE,
     CMT_UNLINK_INODE,
     CMT_CLOSE_INODE,
+    CMT_ATTR_INODE,
+    CMT_LINK_INODE,
+    CMT_SYMLINK_INODE,
+    CMT_RENAME_INODE,
     MAX_CMT_TYPE
 };
 
@@ -39,6 +43,8 @@ struct hk_cmt_icp {
     u16 links_count;
     u32 flags;
     u32 generation;
+    u64 seq; /* order of this checkpoint, see hk_al_stage */
+    struct hk_cmt_node *cmt_node; /* node staging attr log entries of ino, NULL if none */
 };
 
 static inline void hk_init_cmt_dbatch(struct hk_cmt_dbatch *batch, u64 addr, u64 blk_cur, u64 dst_blks)
@@ -96,12 +102,15 @@ struct hk_cmt_data_info {
 };
 
 // TODO: Specific ICP for new inode, unlink inode
+/* also used by CMT_LINK_INODE and CMT_SYMLINK_INODE */
 struct hk_cmt_new_inode_info {
     struct list_head lnode;
     u8 type;
     struct hk_cmt_icp inode_cp;
     struct hk_cmt_icp dir_inode_cp;
     struct hk_dentry *direntry;
+    struct hk_cmt_node *dir_node;
+    u64 sym_blk_addr; /* symlink only */
 };
 
 struct hk_cmt_unlink_inode_info {
@@ -110,9 +119,22 @@ struct hk_cmt_unlink_inode_info {
     struct hk_cmt_icp inode_cp;
     struct hk_cmt_icp dir_inode_cp;
     struct hk_dentry *direntry;
+    struct hk_cmt_node *dir_node;
     bool invalidate;
 };
 
+struct hk_cmt_rename_info {
+    struct list_head lnode;
+    u8 type;
+    struct hk_cmt_icp inode_cp;
+    struct hk_cmt_icp old_dir_cp;
+    struct hk_cmt_icp new_dir_cp;
+    struct hk_dentry *pd;     /* removed from the old dir */
+    struct hk_dentry *pd_new; /* added to the new dir */
+    struct hk_cmt_node *old_dir_node;
+    struct hk_cmt_node *new_dir_node;
+};
+
 struct hk_cmt_delete_inode_info {
     struct list_head lnode;
     u8 type;
@@ -124,7 +146,64 @@ struct hk_cmt_close_info {
     u64 tail_addr;
 };
 
-/* Decouple from sih for async flush */
+/* flush the attr stage of the inode */
+struct hk_cmt_attr_info {
+    struct list_head lnode;
+    u8 type;
+};
+
+/* Fixed-size slot that holds any kind of cmt info. Slots are preallocated
+   in per-cpu pools so that delegating never goes to the slab allocator. */
+struct hk_cmt_info_slot {
+    union {
+        struct hk_cmt_info info;
+        struct hk_cmt_data_info data_info;
+        struct hk_cmt_new_inode_info new_inode_info;
+        struct hk_cmt_unlink_inode_info unlink_info;
+        struct hk_cmt_rename_info rename_info;
+        struct hk_cmt_delete_inode_info delete_info;
+        struct hk_cmt_close_info close_info;
+        struct hk_cmt_attr_info attr_info;
+    };
+    int pool_id; /* the pool this slot returns to */
+};
+
+/* A ring of free slots. Slots are consumed out of order by workers, so the
+   ring tracks free slots rather than in-flight ones: alloc pops the head,
+   free pushes the tail, and it never overflows since it holds all slots. */
+struct hk_cmt_pool {
+    spinlock_t lock;
+    u32 head;
+    u32 tail;
+    u32 nr_free;
+    u32 nr_slots;
+    struct hk_cmt_info_slot *slots;
+    struct hk_cmt_info_slot **ring;
+} ____cacheline_aligned_in_smp;
+
+/* Latest attr log entries of an inode absorbed in DRAM. States are ordered by
+   seq, since checkpoints taken by delegating may be committed out of order. */
+struct hk_al_stage {
+    spinlock_t lock;
+    struct mutex flushing;
+    atomic64_t seq;
+    u8 staged; /* bitmap of entry types not on PM yet */
+    u64 entry_seq[MAX_AL_ENTRY_TYPE];
+    struct hk_al_entry entries[MAX_AL_ENTRY_TYPE];
+};
+
+static inline void hk_al_stage_init(struct hk_al_stage *stage)
+{
+    spin_lock_init(&stage->lock);
+    mutex_init(&stage->flushing);
+    atomic64_set(&stage->seq, 0);
+    stage->staged = 0;
+    memset(stage->entry_seq, 0, sizeof(stage->entry_seq));
+}
+
+/* Decouple from sih for async flush. A node is never freed before umount,
+   so the pointers cached in sih and passed along with cmt infos stay valid
+   without looking up the forest again. */
 // TODO: using a special node as root. Since it might occupy too many RAM
 struct hk_cmt_node {
     struct hk_header_node root;
@@ -137,6 +216,40 @@ struct hk_cmt_node {
     struct mutex processing; /* if this node is being processed by worker */
 
     struct hk_inf_queue op_q; /* Data queue for this inode */
+
+    struct list_head wnode; /* link in a worker's work queue */
+    atomic_t scheduled; /* if this node is in some work queue */
+
+    struct hk_cmt_tx_batch *tx_batch; /* the batch holding this node's namespace ops */
+    atomic_t ns_inflight; /* unfinished txs pointing to dentries of this dir */
+
+    struct hk_al_stage al_stage;
+
+#ifdef CONFIG_EXTENT_HDR
+    struct rb_root_cached runs; /* multi-block runs committed by one head */
+    struct xarray prevs;        /* dblk of a linked head -> dblk + 1 of its predecessor, 0 for root */
+    struct hk_header *tail;     /* last linked head, NULL if none */
+#endif
+};
+
+/* A namespace op waiting in a tx batch, copied out of its slot */
+struct hk_cmt_tx_op {
+    struct hk_cmt_node *cmt_node;
+    union {
+        struct hk_cmt_info info;
+        struct hk_cmt_new_inode_info new_inode_info;
+        struct hk_cmt_unlink_inode_info unlink_info;
+        struct hk_cmt_rename_info rename_info;
+    };
+};
+
+/* Namespace ops of one worker, journaled as one COMPOUND transaction. Ops of
+   one inode always stay in one batch so that they are applied in order. */
+struct hk_cmt_tx_batch {
+    struct mutex lock;
+    int nr_ops;
+    struct hk_cmt_tx_op ops[HK_TX_BATCH_OPS];
+    struct hk_tx_info infos[HK_TX_BATCH_OPS];
 };
 
 struct hk_cmt_node_ref {
@@ -146,9 +259,26 @@ struct hk_cmt_node_ref {
 
 static_assert(sizeof(struct hk_cmt_node) >= sizeof(struct hk_header), "hk_cmt_node should be larger as hk_hedaer");
 
+/* The forest only indexes cmt nodes by ino. Scheduling is done by per-worker
+   work queues, each of which holds the nodes with pending infos. An idle worker
+   steals whole nodes from the busiest queue. Workers are spawned per online
+   cpu, but only the first nr_active take work, which follows nr_pending. */
 struct hk_cmt_queue {
     struct rb_root *cmt_forest;
     struct mutex *locks;
+    int nr_workers;
+    struct hk_inf_queue *work_qs;
+    struct hk_cmt_tx_batch *tx_batches; /* one per worker */
+
+    /* slot pools for cmt infos */
+    int nr_pools;
+    struct hk_cmt_pool *pools;
+    wait_queue_head_t pool_wq; /* writers waiting for a free slot */
+    wait_queue_head_t kick_wq; /* workers waiting for the next round */
+    atomic_t kicks;
+
+    atomic_long_t nr_pending; /* infos requested but not processed */
+    atomic_t nr_active; /* workers taking work, the others are parked */
 };
 
 #endif
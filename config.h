@@ -21,6 +21,8 @@
 #define HUNTER_MOUNT_HUGEIOREMAP  0x000100 /* Huge mappings with ioremap */
 #define HUNTER_MOUNT_FORMAT       0x000200 /* was FS formatted on mount? */
 #define HUNTER_MOUNT_DATA_COW     0x000400 /* Copy-on-write for data integrity */
+#define HUNTER_MOUNT_TAIL_BUF     0x000800 /* Coalesce small appends in DRAM */
+#define HUNTER_MOUNT_DIR_INDEX    0x001000 /* Checkpoint dir tables to PM */
 
 /*
  * Maximal count of links to a file
@@ -39,19 +41,37 @@
 #define HK_PBLK_SZ            PAGE_SIZE
 #define HK_LBLK_SZ            PAGE_SIZE /* logic block size */
 #define HK_NUM_INO            (2 * 1024 * 1024) /* extend to 2M files */
-#define HK_ATTRLOG_SLOTS      HK_NUM_INO /* one-to-one mapping */
+#define HK_ATTRLOG_SLOTS      HK_NUM_INO /* one-to-one mapping, unless set by alslots= at format */
+#define HK_MIN_ATTRLOG_SLOTS  (1024) /* fewer slots are allocated on demand */
 #define HK_ATTRLOG_ENTY_SLOTS (4)
 #define HK_LINIX_SLOTS        (1024 * 256) /* related to init size */
 #define HK_HISTORY_WINDOWS    (1)          /* for dynamic workloads */
 #define HK_NAME_LEN           99
-#define HK_HASH_BITS          6  /* for directory table */
+#define HK_DIR_TABLE_MIN_BITS 2  /* buckets of a new directory table */
+#define HK_DIR_TABLE_MAX_LOAD 2  /* entries per bucket before growing */
+#define HK_DIR_TABLE_MIGRATE  8  /* old buckets moved per dir op while resizing */
+#define HK_DIR_SLOT_PROBES    4  /* dir blocks probed for a free dentry slot */
+#define HK_DIR_COMPACT_LIVE   4  /* dir blocks with at most so many dentries are compacted */
+#define HK_DIR_BLOOM_SHIFT    4  /* log2 of negative lookup filter bits per bucket */
+#define HK_DIR_BLOOM_HASHES   3  /* filter bits set per name */
+#define HK_DIR_INDEX_MIN      256 /* dirs with fewer entries are scanned instead */
 #define HK_CMT_QUEUE_BITS     10 /* for commit queue */
-#define HK_CMT_WORKER_NUM     4  /* for commit worker */
+#define HK_CMT_MAX_WORKERS    64 /* upper bound of commit workers, one is spawned per online cpu */
+#define HK_CMT_WORKER_LOAD    (1024) /* pending infos per active worker before another one is activated */
 #define HK_JOURNAL_SIZE       (4 * 1024)
-#define HK_PERCORE_JSLOTS     (1) /* per core journal slots */
+#define HK_PERCORE_JSLOTS     (4) /* per core journal slots, unless set by jslots= at format */
+#define HK_MAX_PERCORE_JSLOTS (64)
+#define HK_TX_BATCH_OPS       (32) /* namespace ops in one compound transaction */
 #define HK_BLKS_SIZE(blks)    (((blks) << 12) + ((blks) << 6))
 #define HK_CMT_BATCH_NUM      (2 * 1024 * 1024)
+#define HK_CMT_POOL_SLOTS     (8 * 1024) /* per-cpu preallocated cmt info slots */
+#define HK_CMT_BG_THRESH      (HK_CMT_POOL_SLOTS / 4) /* per-cpu pending infos to kick workers */
+#define HK_CMT_THRESH         (HK_CMT_POOL_SLOTS / 2) /* per-cpu pending infos to throttle writers */
+#define HK_CMT_INODE_THRESH   (4 * 1024) /* pending infos of an inode to commit in place */
 #define HK_CHECKPOINT_TIME_INTERNAL 3 /* seconds */
+#define HK_NT_THRESH          256  /* copies shorter than this use cached stores + clwb */
+#define HK_SIMD_THRESH        4096 /* non-temporal copies at least this long use AVX */
+#define HK_TAIL_BUF_DELAY_MS  5    /* small appends stay in DRAM at most this long */
 
 /* ======================= Control by Makefile ======================= */
 /* enable background commit system */
@@ -71,6 +91,11 @@
 #define CONFIG_DYNAMIC_WORKLOAD 
 #endif
 
+/* one summary header per committed run of blocks */
+#if HK_ENABLE_EXTENT_HDR == 1
+#define CONFIG_EXTENT_HDR
+#endif
+
 /* enable pure log-structured file system */
 #if HK_ENABLE_LFS == 1 
 #define CONFIG_LAYOUT_TIGHT
@@ -89,8 +114,28 @@ static inline bool arch_has_clwb(void)
     return static_cpu_has(X86_FEATURE_CLWB);
 }
 
+static inline bool arch_has_clflushopt(void)
+{
+    return static_cpu_has(X86_FEATURE_CLFLUSHOPT);
+}
+
 extern int support_clwb;
 
+/* How a mounted instance makes its stores durable, see persist= */
+enum hk_persist_mode {
+    HK_PERSIST_AUTO = 0, /* probe the platform */
+    HK_PERSIST_EADR,     /* cpu caches are in the persistence domain, no flush */
+    HK_PERSIST_CLWB,
+    HK_PERSIST_CLFLUSHOPT,
+    HK_PERSIST_CLFLUSH,
+};
+
+/* Flush variants are patched in with static keys instead of being tested on
+   every flush. No-flush is only on while every mounted instance is eADR. */
+DECLARE_STATIC_KEY_FALSE(hk_persist_noflush);
+DECLARE_STATIC_KEY_FALSE(hk_persist_clwb);
+DECLARE_STATIC_KEY_FALSE(hk_persist_clflushopt);
+
 #define _mm_clflush(addr) \
     asm volatile("clflush %0" : "+m"(*(volatile char *)(addr)))
 #define _mm_clflushopt(addr) \
@@ -98,6 +143,7 @@ extern int support_clwb;
 #define _mm_clwb(addr) \
     asm volatile(".byte 0x66; xsaveopt %0" : "+m"(*(volatile char *)(addr)))
 
+/* Kept on eADR as well, since non-temporal stores are weakly ordered */
 static inline void PERSISTENT_BARRIER(void)
 {
     asm volatile("sfence\n" : :);
@@ -108,13 +154,29 @@ static inline void MFENCE(void)
     asm volatile("mfence\n" : :);
 }
 
-static inline void hk_flush_small_buffer(void *buf, uint32_t len, bool fence)
+static __always_inline void hk_flush_cachelines(void *buf, uint32_t len)
 {
     uint32_t i;
 
+    if (static_branch_likely(&hk_persist_noflush))
+        return;
+
+    if (static_branch_likely(&hk_persist_clwb)) {
+        for (i = 0; i < len; i += CACHELINE_SIZE)
+            _mm_clwb(buf + i);
+    } else if (static_branch_likely(&hk_persist_clflushopt)) {
+        for (i = 0; i < len; i += CACHELINE_SIZE)
+            _mm_clflushopt(buf + i);
+    } else {
+        for (i = 0; i < len; i += CACHELINE_SIZE)
+            _mm_clflush(buf + i);
+    }
+}
+
+static inline void hk_flush_small_buffer(void *buf, uint32_t len, bool fence)
+{
     len = len + ((unsigned long)(buf) & (CACHELINE_SIZE - 1));
-    for (i = 0; i < len; i += CACHELINE_SIZE)
-        _mm_clflushopt(buf + i);
+    hk_flush_cachelines(buf, len);
     /* Do a fence only if asked. We often don't need to do a fence
      * immediately after clflush because even if we get context switched
      * between clflush and subsequent fence, the context switch operation
@@ -126,8 +188,6 @@ static inline void hk_flush_small_buffer(void *buf, uint32_t len, bool fence)
 
 static inline void hk_flush_buffer(void *buf, uint32_t len, bool fence)
 {
-    uint32_t i;
-
     len = len + ((unsigned long)(buf) & (CACHELINE_SIZE - 1));
 
     HK_ASSERT(((unsigned long)(buf) & (CACHELINE_SIZE - 1)) == 0);
@@ -136,13 +196,7 @@ static inline void hk_flush_buffer(void *buf, uint32_t len, bool fence)
         ssleep(1);
     }
 
-    if (support_clwb) {
-        for (i = 0; i < len; i += CACHELINE_SIZE)
-            _mm_clwb(buf + i);
-    } else {
-        for (i = 0; i < len; i += CACHELINE_SIZE)
-            _mm_clflush(buf + i);
-    }
+    hk_flush_cachelines(buf, len);
     /* Do a fence only if asked. We often don't need to do a fence
      * immediately after clflush because even if we get context switched
      * between clflush and subsequent fence, the context switch operation
@@ -22,6 +22,18 @@
 #define DT2IF(dt)  (((dt) << 12) & S_IFMT)
 #define IF2DT(sif) (((sif) & S_IFMT) >> 12)
 
+/* The file was in the middle of a listing */
+static int hk_dir_release(struct inode *inode, struct file *file)
+{
+    struct hk_dir_table *dt = file->private_data;
+
+    if (dt) {
+        file->private_data = NULL;
+        atomic_dec(&dt->nr_listing);
+    }
+    return 0;
+}
+
 static int hk_readdir(struct file *file, struct dir_context *ctx)
 {
     struct inode *inode = file_inode(file);
@@ -31,8 +43,14 @@ static int hk_readdir(struct file *file, struct dir_context *ctx)
     struct hk_inode_info *si = HK_I(inode);
     struct hk_inode_info_header *sih = &si->header;
 
-    unsigned bkt;
-    struct hk_dentry_info *cur;
+    struct hk_dir_table *dt = sih->dirs;
+    struct hk_dentry *direntry;
+    unsigned long blk, start;
+    void *entry;
+    u64 blk_addr = 0;
+    unsigned long live;
+    u16 ix;
+    u8 d_type;
     u64 pi_addr;
     unsigned long pos = 0;
     ino_t ino;
@@ -52,18 +70,48 @@ static int hk_readdir(struct file *file, struct dir_context *ctx)
     if (!dir_emit_dots(file, ctx))
         return 0;
 
-    hash_for_each_bits(sih->dirs, HK_HASH_BITS, bkt, cur, node)
-    {
-        child_pi = hk_get_pi_by_ino(sb, cur->direntry->ino);
-        if (!dir_emit(ctx, cur->direntry->name, cur->direntry->name_len,
-                      cur->direntry->ino,
-                      IF2DT(le16_to_cpu(child_pi->i_mode)))) {
-            hk_dbg("%s: dir_emit failed\n", __func__);
-            return -EIO;
+    /* After the dots, a position is the (dir block, slot) of a dentry, which
+       stays put across inserts and deletes. So the next call resumes there.
+       The dir lock is shared: the table and the slots are only changed by
+       create, unlink and rename, which hold it exclusively. */
+    start = blk = (ctx->pos - 2) / MAX_DENTRY_PER_BLK;
+    ix = (ctx->pos - 2) % MAX_DENTRY_PER_BLK;
+
+    entry = xa_find(&dt->blks, &blk, ULONG_MAX, XA_PRESENT);
+    if (blk != start)
+        ix = 0;
+    while (entry) {
+        live = xa_to_value(entry);
+        if (live)
+            blk_addr = TRANS_OFS_TO_ADDR(HK_SB(sb), linix_get(&sih->ix, blk));
+        for (; ix < HK_DENTRY_SLOTS; ix++) {
+            if (!(live & (1UL << ix)))
+                continue;
+            direntry = hk_dentry_by_ix_from_blk(blk_addr, ix);
+            ctx->pos = 2 + blk * MAX_DENTRY_PER_BLK + ix;
+            /* the byte held garbage in images formatted before the type
+               was recorded */
+            d_type = hk_has_feature(sb, HK_FEATURE_DENTRY_TYPE) ? direntry->file_type : DT_UNKNOWN;
+            if (d_type == DT_UNKNOWN) {
+                child_pi = hk_get_pi_by_ino(sb, direntry->ino);
+                d_type = IF2DT(le16_to_cpu(child_pi->i_mode));
+            }
+            if (!dir_emit(ctx, direntry->name, direntry->name_len,
+                          direntry->ino, d_type)) {
+                /* the buffer is full, dentries are not moved until we are back */
+                if (!file->private_data) {
+                    file->private_data = dt;
+                    atomic_inc(&dt->nr_listing);
+                }
+                goto out;
+            }
         }
+        ix = 0;
+        entry = xa_find_after(&dt->blks, &blk, ULONG_MAX, XA_PRESENT);
     }
 
     ctx->pos = READDIR_END;
+    hk_dir_release(inode, file);
 out:
     HK_END_TIMING(readdir_t, readdir_time);
     hk_dbgv("%s return\n", __func__);
@@ -73,7 +121,8 @@ out:
 const struct file_operations hk_dir_operations = {
     .llseek = generic_file_llseek,
     .read = generic_read_dir,
-    .iterate = hk_readdir,
+    .iterate_shared = hk_readdir,
+    .release = hk_dir_release,
     .fsync = noop_fsync,
     .unlocked_ioctl = hk_ioctl,
 #ifdef CONFIG_COMPAT
@@ -25,6 +25,138 @@
 
 #include "hunter.h"
 
+/* ======================= ANCHOR tail buffer ========================= */
+/* The tail buffer is only touched with the inode lock held, exclusively
+   except for reads */
+void hk_tail_buf_flush(struct inode *inode)
+{
+    struct super_block *sb = inode->i_sb;
+    struct hk_inode_info_header *sih = HK_IH(inode);
+    struct hk_tail_buf *tb = sih->tbuf;
+    struct hk_cmt_dbatch batch;
+    unsigned long irq_flags = 0;
+    u64 blk_addr;
+
+    if (!tb || !tb->addr)
+        return;
+
+    /* bytes around the appended ones are rewritten as they are, so that
+       the media sees one aligned XPLine */
+    hk_memunlock_range(sb, (void *)tb->addr, PM_ACCESS_GRANU, &irq_flags);
+    hk_memcpy_to_pmem((void *)tb->addr, tb->data, PM_ACCESS_GRANU);
+    hk_memlock_range(sb, (void *)tb->addr, PM_ACCESS_GRANU, &irq_flags);
+    PERSISTENT_BARRIER();
+
+    blk_addr = tb->addr & PAGE_MASK;
+#ifdef CONFIG_CMT_BACKGROUND
+    hk_init_and_inc_cmt_dbatch(&batch, blk_addr, tb->pos >> PAGE_SHIFT, 1);
+    hk_delegate_data_async(sb, inode, &batch, tb->pos + tb->end, CMT_UPDATE_DATA);
+#else
+    sm_update_data_sync(sb, blk_addr, tb->pos + tb->end);
+#endif
+    HK_STATS_ADD(tail_buf_flushes, 1);
+
+    /* other writes may change the XPLine behind our back, reload it on the
+       next append */
+    tb->addr = 0;
+}
+
+static void hk_tail_buf_work(struct work_struct *work)
+{
+    struct hk_tail_buf *tb = container_of(to_delayed_work(work), struct hk_tail_buf, flush_work);
+    struct inode *inode = tb->inode;
+
+    inode_lock(inode);
+    hk_tail_buf_flush(inode);
+    inode_unlock(inode);
+}
+
+/* Called on evict. Appends of an unlinked inode are just dropped. */
+void hk_tail_buf_release(struct inode *inode)
+{
+    struct hk_inode_info_header *sih = HK_IH(inode);
+    struct hk_tail_buf *tb = sih->tbuf;
+
+    if (!tb)
+        return;
+
+    cancel_delayed_work_sync(&tb->flush_work);
+    if (inode->i_nlink)
+        hk_tail_buf_flush(inode);
+
+    kfree(tb);
+    sih->tbuf = NULL;
+}
+
+/* Copy the part of [pos, pos + len) still in the tail buffer to buf,
+   returns the bytes not copied */
+static unsigned long hk_tail_buf_read(struct hk_tail_buf *tb, char __user *buf, loff_t pos, size_t len)
+{
+    loff_t lo, hi;
+
+    if (!tb->addr)
+        return 0;
+
+    lo = max_t(loff_t, pos, tb->pos + tb->start);
+    hi = min_t(loff_t, pos + len, tb->pos + tb->end);
+    if (lo >= hi)
+        return 0;
+
+    return __copy_to_user(buf + (lo - pos), tb->data + (lo - tb->pos), hi - lo);
+}
+
+/* Absorb an append of len bytes at pos, which is backed by PM at addr and
+   stays within one block. Returns 0 if the append is buffered. */
+static int hk_tail_buf_append(struct inode *inode, u64 addr, loff_t pos, const char __user *content, size_t len)
+{
+    struct hk_inode_info_header *sih = HK_IH(inode);
+    struct hk_tail_buf *tb = sih->tbuf;
+    u8 src[PM_ACCESS_GRANU];
+    size_t ofs, n, done = 0;
+
+    if (len >= PM_ACCESS_GRANU || copy_from_user(src, content, len))
+        return -EFAULT;
+
+    if (!tb) {
+        tb = kzalloc(sizeof(struct hk_tail_buf), GFP_KERNEL);
+        if (!tb)
+            return -ENOMEM;
+        tb->inode = inode;
+        INIT_DELAYED_WORK(&tb->flush_work, hk_tail_buf_work);
+        sih->tbuf = tb;
+    }
+
+    /* only bytes right behind the buffered ones are absorbed */
+    if (tb->addr && pos != tb->pos + tb->end)
+        hk_tail_buf_flush(inode);
+
+    while (done < len) {
+        if (!tb->addr) {
+            ofs = (pos + done) & (PM_ACCESS_GRANU - 1);
+            tb->pos = pos + done - ofs;
+            tb->addr = addr + done - ofs;
+            tb->start = tb->end = ofs;
+            /* the whole XPLine is written back on flush, so bytes past the
+               append must be the ones on PM, not those of the last XPLine */
+            memcpy(tb->data, (void *)tb->addr, PM_ACCESS_GRANU);
+        }
+
+        n = min(len - done, (size_t)(PM_ACCESS_GRANU - tb->end));
+        memcpy(tb->data + tb->end, src + done, n);
+        tb->end += n;
+        done += n;
+
+        if (tb->end == PM_ACCESS_GRANU)
+            hk_tail_buf_flush(inode);
+    }
+    HK_STATS_ADD(tail_buf_appends, 1);
+
+    if (tb->addr)
+        schedule_delayed_work(&tb->flush_work, msecs_to_jiffies(HK_TAIL_BUF_DELAY_MS));
+
+    return 0;
+}
+
 static ssize_t do_dax_mapping_read(struct file *filp, char __user *buf,
                                    size_t len, loff_t *ppos)
 {
@@ -104,6 +236,9 @@ static ssize_t do_dax_mapping_read(struct file *filp, char __user *buf,
         else /* This will not happen now */
             left = __clear_user(buf + copied, nr);
 
+        if (!left && sih->tbuf)
+            left = hk_tail_buf_read(sih->tbuf, buf + copied, ((loff_t)index << PAGE_SHIFT) + offset, nr);
+
         HK_END_TIMING(memcpy_r_nvmm_t, memcpy_time);
 
         if (left) {
@@ -164,7 +299,7 @@ static bool hk_try_perform_cow(struct hk_inode_info *si, u64 cur_addr, u64 index
                 memcpy_mcsafe(tmp_content, hk_get_block(sb, blk_addr), HK_LBLK_SZ);
                 *each_size = min(HK_LBLK_SZ - *each_ofs, len);
                 hk_memunlock_range(sb, cur_addr, *each_ofs, &irq_flags);
-                memcpy_to_pmem_nocache(cur_addr, tmp_content, *each_ofs);
+                hk_memcpy_to_pmem(cur_addr, tmp_content, *each_ofs);
                 hk_memlock_range(sb, cur_addr, *each_ofs, &irq_flags);
             }
             if (index == end_index && len < HK_LBLK_SZ) {
@@ -172,8 +307,8 @@ static bool hk_try_perform_cow(struct hk_inode_info *si, u64 cur_addr, u64 index
                 memcpy_mcsafe(tmp_content, hk_get_block(sb, blk_addr), HK_LBLK_SZ);
                 *each_size = len;
                 hk_memunlock_range(sb, cur_addr + (len + *each_ofs), HK_LBLK_SZ - (len + *each_ofs), &irq_flags);
-                memcpy_to_pmem_nocache(cur_addr + (len + *each_ofs), tmp_content + (len + *each_ofs),
-                                       HK_LBLK_SZ - (len + *each_ofs));
+                hk_memcpy_to_pmem(cur_addr + (len + *each_ofs), tmp_content + (len + *each_ofs),
+                                  HK_LBLK_SZ - (len + *each_ofs));
                 hk_memlock_range(sb, cur_addr + (len + *each_ofs), HK_LBLK_SZ - (len + *each_ofs), &irq_flags);
             }
             HK_END_TIMING(partial_block_t, partial_time);
@@ -247,7 +382,7 @@ static int do_perform_write(struct inode *inode, struct hk_layout_prep *prep,
 #ifndef CONFIG_CMT_BACKGROUND
             use_layout_for_addr(sb, addr);
             sm_valid_data_sync(sb, sm_get_prev_addr_by_dbatch(sb, sih, &batch_tmp), addr, sm_get_next_addr_by_dbatch(sb, sih, &batch_tmp),
-                               sih->ino, index_cur, get_version(sbi), _size, inode->i_ctime.tv_sec);
+                               sih->cmt_node, index_cur, get_version(sbi), _size, inode->i_ctime.tv_sec);
             unuse_layout_for_addr(sb, addr);
 #else
             hk_delegate_data_async(sb, inode, &batch_tmp, _size, CMT_VALID_DATA);
@@ -263,7 +398,7 @@ static int do_perform_write(struct inode *inode, struct hk_layout_prep *prep,
                 /* invalid the old one */
                 use_layout_for_addr(sb, addr_overlayed);
                 hk_init_and_inc_cmt_dbatch(&batch_tmp, addr_overlayed, index_cur, 1);
-                sm_invalid_data_sync(sb, sm_get_prev_addr_by_dbatch(sb, sih, &batch_tmp), addr_overlayed, sih->ino); /* Then invalid the old */
+                sm_invalid_data_sync(sb, sm_get_prev_addr_by_dbatch(sb, sih, &batch_tmp), addr_overlayed, sih->cmt_node); /* Then invalid the old */
                 unuse_layout_for_addr(sb, addr_overlayed);
 
                 hk_dbgv("Invalid Blk %llu\n", hk_get_dblk_by_addr(sbi, addr_overlayed));
@@ -307,7 +442,7 @@ static int do_perform_write(struct inode *inode, struct hk_layout_prep *prep,
                 use_layout_for_addr(sb, addr);
                 hk_init_and_inc_cmt_dbatch(&batch_tmp, addr, index_cur, 1);
                 sm_valid_data_sync(sb, sm_get_prev_addr_by_dbatch(sb, sih, &batch_tmp), addr, sm_get_next_addr_by_dbatch(sb, sih, &batch_tmp),
-                                   sih->ino, index_cur, get_version(sbi), _size, inode->i_ctime.tv_sec);
+                                   sih->cmt_node, index_cur, get_version(sbi), _size, inode->i_ctime.tv_sec);
                 unuse_layout_for_addr(sb, addr);
 #endif
 
@@ -323,7 +458,7 @@ static int do_perform_write(struct inode *inode, struct hk_layout_prep *prep,
                     /* invalid the old one */
                     use_layout_for_addr(sb, addr_overlayed);
                     hk_init_and_inc_cmt_dbatch(&batch_tmp, addr_overlayed, index_cur, 1);
-                    sm_invalid_data_sync(sb, sm_get_prev_addr_by_dbatch(sb, sih, &batch_tmp), addr_overlayed, sih->ino); /* Then invalid the old */
+                    sm_invalid_data_sync(sb, sm_get_prev_addr_by_dbatch(sb, sih, &batch_tmp), addr_overlayed, sih->cmt_node); /* Then invalid the old */
                     unuse_layout_for_addr(sb, addr_overlayed);
 
                     hk_dbgv("Invalid Blk %llu\n", hk_get_dblk_by_addr(sbi, addr_overlayed));
@@ -368,7 +503,7 @@ static int do_perform_write(struct inode *inode, struct hk_layout_prep *prep,
 #ifndef CONFIG_CMT_BACKGROUND
         use_layout_for_addr(sb, addr);
         sm_valid_data_sync(sb, sm_get_prev_addr_by_dbatch(sb, sih, &batch_tmp), addr, sm_get_next_addr_by_dbatch(sb, sih, &batch_tmp),
-                           sih->ino, index_cur, get_version(sbi), _size, inode->i_ctime.tv_sec);
+                           sih->cmt_node, index_cur, get_version(sbi), _size, inode->i_ctime.tv_sec);
         unuse_layout_for_addr(sb, addr);
         /* flush header */
         hk_flush_buffer(addr + HK_LBLK_SZ, CACHELINE_SIZE, true);
@@ -386,7 +521,7 @@ static int do_perform_write(struct inode *inode, struct hk_layout_prep *prep,
             /* invalid the old one */
             use_layout_for_addr(sb, addr_overlayed);
             hk_init_and_inc_cmt_dbatch(&batch_tmp, addr_overlayed, index_cur, 1);
-            sm_invalid_data_sync(sb, sm_get_prev_addr_by_dbatch(sb, sih, &batch_tmp), addr_overlayed, sih->ino); /* Then invalid the old */
+            sm_invalid_data_sync(sb, sm_get_prev_addr_by_dbatch(sb, sih, &batch_tmp), addr_overlayed, sih->cmt_node); /* Then invalid the old */
             unuse_layout_for_addr(sb, addr_overlayed);
 
             hk_dbgv("Invalid Blk %llu\n", hk_get_dblk_by_addr(sbi, addr_overlayed));
@@ -456,6 +591,13 @@ static size_t hk_try_in_place_append_write(struct hk_inode_info *si, loff_t pos,
     if (in_place) {
         target_addr = TRANS_OFS_TO_ADDR(sbi, linix_get(&sih->ix, pos >> PAGE_SHIFT));
 
+        if (test_opt(sb, TAIL_BUF) && (pos >> PAGE_SHIFT) == ((pos + out_size - 1) >> PAGE_SHIFT) &&
+            hk_tail_buf_append(&si->vfs_inode, target_addr, pos, content, out_size) == 0) {
+            sih->i_size = sih->i_size + out_size;
+            return out_size;
+        }
+        hk_tail_buf_flush(&si->vfs_inode);
+
         HK_START_TIMING(memcpy_w_nvmm_t, memcpy_time);
         hk_memunlock_range(sb, target_addr, out_size, &irq_flags);
         memcpy_to_pmem_nocache(target_addr, content, out_size);
@@ -551,6 +693,9 @@ ssize_t do_hk_file_write(struct file *filp, const char __user *buf,
             __func__, inode->i_ino, pos, blks, len);
 
     if (len != 0) {
+        /* COW and the summary headers below work on what is on PM */
+        hk_tail_buf_flush(inode);
+
         hk_prepare_layouts(sb, blks, false, &preps);
 
         hk_trv_prepared_layouts_init(&preps);
@@ -656,6 +801,10 @@ static ssize_t hk_dax_file_write(struct file *filp, const char __user *buf,
 
     ret = do_hk_file_write(filp, buf, len, ppos);
 
+#ifdef CONFIG_CMT_BACKGROUND
+    hk_cmt_balance(inode->i_sb, inode);
+#endif
+
     inode_unlock(inode);
     sb_end_write(inode->i_sb);
 
@@ -683,9 +832,16 @@ static int hk_fsync(struct file *file, loff_t start, loff_t end, int datasync)
         PERSISTENT_BARRIER();
     }
 
+    if (HK_IH(inode)->tbuf) {
+        inode_lock(inode);
+        hk_tail_buf_flush(inode);
+        inode_unlock(inode);
+    }
+
     mutex_lock(&HK_IH(inode)->cmt_node->processing);
     hk_flush_cmt_node_fast(sb, HK_IH(inode)->cmt_node);
     mutex_unlock(&HK_IH(inode)->cmt_node->processing);
+    hk_cmt_tx_commit_node(sb, HK_IH(inode)->cmt_node);
 
 persist:
     HK_END_TIMING(fsync_t, fsync_time);
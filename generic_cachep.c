@@ -24,12 +24,6 @@ DEFINE_GENERIC_CACHEP(hk_range_node);
 DEFINE_GENERIC_CACHEP(hk_dentry_info);
 DEFINE_GENERIC_CACHEP(hk_inode_info_header);
 
-DEFINE_GENERIC_CACHEP(hk_cmt_data_info);
-DEFINE_GENERIC_CACHEP(hk_cmt_new_inode_info);
-DEFINE_GENERIC_CACHEP(hk_cmt_unlink_inode_info);
-DEFINE_GENERIC_CACHEP(hk_cmt_delete_inode_info);
-DEFINE_GENERIC_CACHEP(hk_cmt_close_info);
-
 DEFINE_GENERIC_CACHEP(hk_cmt_node);
 DEFINE_GENERIC_CACHEP(hk_cmt_node_ref);
 
@@ -67,12 +67,6 @@ DECLARE_GENERIC_CACHEP(hk_range_node, GFP_ATOMIC);
 DECLARE_GENERIC_CACHEP(hk_dentry_info, GFP_ATOMIC);
 DECLARE_GENERIC_CACHEP(hk_inode_info_header, GFP_ATOMIC);
 
-DECLARE_GENERIC_CACHEP(hk_cmt_data_info, GFP_ATOMIC);
-DECLARE_GENERIC_CACHEP(hk_cmt_new_inode_info, GFP_ATOMIC);
-DECLARE_GENERIC_CACHEP(hk_cmt_unlink_inode_info, GFP_ATOMIC);
-DECLARE_GENERIC_CACHEP(hk_cmt_delete_inode_info, GFP_ATOMIC);
-DECLARE_GENERIC_CACHEP(hk_cmt_close_info, GFP_ATOMIC);
-
 DECLARE_GENERIC_CACHEP(hk_cmt_node, GFP_ATOMIC);
 DECLARE_GENERIC_CACHEP(hk_cmt_node_ref, GFP_ATOMIC);
 
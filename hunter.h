@@ -36,7 +36,9 @@
 #include <asm/mman.h>
 #include <linux/compat.h>
 #include <linux/hashtable.h>
+#include <linux/stringhash.h>
 #include <linux/sched/signal.h>
+#include <linux/jump_label.h>
 
 #define TRANS_ADDR_TO_OFS(sbi, addr)  (addr == 0 ? 0 : ((u64)(addr) - (u64)(sbi)->virt_addr))   
 #define TRANS_OFS_TO_ADDR(sbi, ofs)   (ofs == 0 ? 0 : ((u64)(ofs) + (sbi)->virt_addr))
@@ -139,10 +141,10 @@ struct hk_range_node {
 #include "stats.h"
 #include "config.h"
 #include "dw.h"
-#include "namei.h"
 #include "linix.h"
 #include "bbuild.h"
 #include "super.h"
+#include "namei.h"
 #include "meta.h"
 #include "inode.h"
 #include "cmt.h"
@@ -204,15 +206,13 @@ static inline __le32 hk_mask_flags(umode_t mode, __le32 flags)
 }
 
 /* ======================= ANCHOR: pmem specific function ========================= */
-static inline int memcpy_to_pmem_nocache(void *dst, const void *src,
-	unsigned int size)
-{
-	int ret;
-
-	ret = __copy_from_user_inatomic_nocache(dst, src, size);
-
-	return ret;
-}
+/* pmem.c */
+extern unsigned int hk_nt_thresh;
+extern unsigned int hk_simd_thresh;
+void hk_pmem_copy_init(void);
+void hk_memcpy_to_pmem(void *dst, const void *src, size_t size);
+int memcpy_to_pmem_nocache(void *dst, const void *src, unsigned int size);
+int hk_copy_bench(struct file *filp);
 
 /* assumes the length to be 4-byte aligned */
 static inline void memset_nt(void *dest, uint32_t dword, size_t length)
@@ -300,6 +300,8 @@ static inline u64 _round_up(u64 value, u64 align)
 /* ======================= ANCHOR: mlist.c ========================= */
 int hk_range_insert_range(struct rb_root_cached *tree, unsigned long range_low, unsigned long range_high);
 int hk_range_delete_range_node(struct rb_root_cached *tree, struct hk_range_node *node);
+int hk_range_insert_range_node(struct rb_root_cached *tree, struct hk_range_node *new_node);
+struct hk_range_node *hk_range_find_cover(struct rb_root_cached *tree, unsigned long key);
 unsigned long hk_range_pop(struct rb_root_cached *tree, unsigned long *num);
 void hk_range_free_all(struct rb_root_cached *tree);
 
@@ -330,6 +332,8 @@ int hk_release_layout(struct super_block *sb, int cpuid, u64 blks, bool rls_all)
 /* ======================= ANCHOR: file.c ========================= */
 extern const struct inode_operations hk_file_inode_operations;
 extern const struct file_operations hk_dax_file_operations;
+void hk_tail_buf_flush(struct inode *inode);
+void hk_tail_buf_release(struct inode *inode);
 
 /* ======================= ANCHOR: dir.c ========================= */
 extern const struct file_operations hk_dir_operations;
@@ -341,6 +345,7 @@ int hk_block_symlink(struct super_block *sb, struct hk_inode *pi,
 					 void *out_blk_addr);
 
 /* ======================= ANCHOR: ioctl.c ========================= */
+#define HK_IOC_COPY_BENCH _IO('h', 1) /* sweep PM copy variants over a scratch file */
 long hk_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
 long hk_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
 
@@ -367,10 +372,19 @@ extern const struct inode_operations hk_dir_inode_operations;
 extern const struct inode_operations hk_special_inode_operations;
 struct hk_dentry *hk_dentry_by_ix_from_blk(u64 blk_addr, u16 ix);
 struct dentry *hk_get_parent(struct dentry *child);
+struct hk_dir_table *hk_alloc_dir_table(void);
 int hk_insert_dir_table(struct super_block *sb, struct hk_inode_info_header *sih, const char *name, 
-				  	    int namelen, struct hk_dentry *direntry);
+				  	    int namelen, struct hk_dentry *direntry, u64 blk);
 int hk_update_dir_table(struct super_block *sb, struct hk_inode_info_header *sih, const char *name, 
-				  		int namelen, struct hk_dentry *direntry);
+				  		int namelen, struct hk_dentry *direntry, u64 blk);
+void hk_dir_set_blk(struct hk_inode_info_header *sih, u64 blk, unsigned long live);
+void hk_dir_fill_holes(struct hk_inode_info_header *sih);
+void hk_dir_register_blk(struct super_block *sb, struct hk_inode_info_header *sih, u64 f_blk);
+void hk_dir_index_checkpoint(struct super_block *sb, struct inode *dir);
+bool hk_dir_index_load(struct super_block *sb, struct hk_inode *pi, struct hk_inode_info_header *sih,
+					   u64 *nr_entries);
+bool hk_dir_settled(struct hk_inode_info_header *sih);
+void hk_reclaim_dentry(struct super_block *sb, struct hk_dentry *direntry);
 void hk_remove_dir_table(struct super_block *sb, struct hk_inode_info_header *sih, 
 						 const char *name, int namelen);
 void hk_destory_dir_table(struct super_block *sb, struct hk_inode_info_header *sih);
@@ -379,6 +393,9 @@ void hk_destory_dir_table(struct super_block *sb, struct hk_inode_info_header *s
 int hk_format_meta(struct super_block *sb);
 struct hk_attr_log *hk_get_attr_log_by_alid(struct super_block *sb, int alid);
 struct hk_attr_log *hk_get_attr_log_by_ino(struct super_block *sb, u64 ino);
+struct hk_attr_log *hk_alloc_attr_log(struct super_block *sb, u64 ino);
+void hk_put_attr_log(struct super_block *sb, u64 ino);
+int hk_build_attr_log_map(struct super_block *sb);
 void hk_create_al_snapshot(struct super_block *sb, struct hk_inode *pi);
 int hk_reset_attr_log(struct super_block *sb, struct hk_attr_log *al);
 int hk_evicting_attr_log(struct super_block *sb, struct hk_attr_log *al);
@@ -389,6 +406,9 @@ int hk_commit_icp_attrchange(struct super_block *sb, struct hk_cmt_icp *icp);
 int hk_commit_icp_linkchange(struct super_block *sb, struct hk_cmt_icp *icp);
 
 int hk_commit_attrchange(struct super_block *sb, struct inode *inode);
+int hk_stage_attrchange(struct super_block *sb, struct inode *inode);
+bool hk_stage_al_entry(struct hk_al_stage *stage, struct hk_al_entry *entry, u64 seq);
+void hk_flush_al_stage(struct super_block *sb, struct hk_al_stage *stage, u64 ino);
 int hk_commit_linkchange(struct super_block *sb, struct inode *inode);
 int hk_commit_sizechange(struct super_block *sb, struct inode *inode, loff_t ia_size);
 
@@ -401,16 +421,37 @@ int sm_insert_hdr(struct super_block *sb, struct hk_header *prev_hdr, struct hk_
 u64 sm_get_next_addr_by_dbatch(struct super_block *sb, struct hk_inode_info_header *sih, struct hk_cmt_dbatch *batch);
 u64 sm_get_prev_addr_by_dbatch(struct super_block *sb, struct hk_inode_info_header *sih, struct hk_cmt_dbatch *batch);
 
+void hk_wc_init(struct super_block *sb, struct hk_xpline_wc *wc);
+void hk_wc_add(struct hk_xpline_wc *wc, void *addr, u64 len);
+void hk_wc_drain(struct hk_xpline_wc *wc);
+
 int sm_delete_data_sync(struct super_block *sb, u64 blk_addr);
-int sm_invalid_data_sync(struct super_block *sb, u64 prev_addr, u64 blk_addr, u64 ino);
+int __sm_invalid_data_sync(struct super_block *sb, u64 prev_addr, u64 blk_addr, struct hk_cmt_node *cmt_node,
+                           struct hk_xpline_wc *wc);
+int sm_invalid_data_sync(struct super_block *sb, u64 prev_addr, u64 blk_addr, struct hk_cmt_node *cmt_node);
+int __sm_valid_data_sync(struct super_block *sb, u64 prev_addr, u64 blk_addr, u64 next_addr,
+                         struct hk_cmt_node *cmt_node, u64 f_blk, u64 tstamp, u64 size, u32 cmtime,
+                         struct hk_xpline_wc *wc);
 int sm_valid_data_sync(struct super_block *sb, u64 prev_addr, u64 blk_addr, u64 next_addr,
-                       u64 ino, u64 f_blk, u64 tstamp, u64 size, u32 cmtime);
+                       struct hk_cmt_node *cmt_node, u64 f_blk, u64 tstamp, u64 size, u32 cmtime);
+int __sm_update_data_sync(struct super_block *sb, u64 blk_addr, u64 size, struct hk_xpline_wc *wc);
 int sm_update_data_sync(struct super_block *sb, u64 blk_addr, u64 size);
+#ifdef CONFIG_EXTENT_HDR
+struct hk_header *sm_get_hdr_by_blk(struct super_block *sb, u64 blk);
+u64 sm_get_run_head_addr(struct super_block *sb, struct hk_cmt_node *cmt_node, u64 blk_addr);
+int sm_track_run(struct super_block *sb, struct hk_cmt_node *cmt_node, u64 head_addr, u32 run);
+void sm_uncover_range(struct super_block *sb, struct hk_cmt_node *cmt_node, u64 addr_start, u64 addr_end);
+int __sm_valid_run_sync(struct super_block *sb, u64 blk_addr, u32 run, struct hk_cmt_node *cmt_node,
+                        u64 f_blk, u64 tstamp, u64 size, u32 cmtime, struct hk_xpline_wc *wc);
+#endif
 
 struct hk_journal* hk_get_journal_by_txid(struct super_block *sb, int txid);
 struct hk_jentry* hk_get_jentry_by_slotid(struct super_block *sb, int txid, int slotid);
 int hk_start_tx(struct super_block *sb, enum hk_journal_type jtype, ...);
+int hk_prepare_tx(struct super_block *sb, struct hk_tx_info *info, enum hk_journal_type jtype, ...);
+int hk_start_compound_tx(struct super_block *sb, struct hk_tx_info *infos, int nr);
 int hk_finish_tx(struct super_block *sb, int txid);
+int hk_discard_tx(struct super_block *sb, int txid);
 
 /* ======================= ANCHOR: cmt.c ========================= */
 #ifdef CONFIG_CMT_BACKGROUND
@@ -423,15 +464,24 @@ int hk_cmt_unmanage_node(struct super_block *sb, struct hk_cmt_node *cmt_node);
 
 int hk_delegate_create_async(struct super_block *sb, struct inode *inode, struct inode *dir, struct hk_dentry *direntry);
 int hk_delegate_unlink_async(struct super_block *sb, struct inode *inode, struct inode *dir, struct hk_dentry *direntry, bool invalidate);
+int hk_delegate_link_async(struct super_block *sb, struct inode *inode, struct inode *dir, struct hk_dentry *direntry);
+int hk_delegate_symlink_async(struct super_block *sb, struct inode *inode, struct inode *dir, struct hk_dentry *direntry,
+                              u64 sym_blk_addr);
+int hk_delegate_rename_async(struct super_block *sb, struct inode *inode, struct inode *old_dir, struct inode *new_dir,
+                             struct hk_dentry *pd, struct hk_dentry *pd_new);
 int hk_delegate_data_async(struct super_block *sb, struct inode *inode, struct hk_cmt_dbatch *batch, u64 size, enum hk_cmt_info_type type);
 int hk_delegate_close_async(struct super_block *sb, struct inode *inode);
 int hk_delegate_delete_async(struct super_block *sb, struct inode *inode);
+int hk_delegate_attr_async(struct super_block *sb, struct inode *inode);
 
-struct hk_cmt_queue *hk_init_cmt_queue(int num_workers);
+struct hk_cmt_queue *hk_init_cmt_queue(int num_workers, int num_pools);
 void hk_free_cmt_queue(struct hk_cmt_queue *cq);
 void hk_start_cmt_workers(struct super_block *sb);
 void hk_stop_cmt_workers(struct super_block *sb);
 void hk_flush_cmt_node_fast(struct super_block *sb, struct hk_cmt_node *cmt_node);
+void hk_cmt_tx_commit(struct super_block *sb, struct hk_cmt_tx_batch *txb);
+void hk_cmt_tx_commit_node(struct super_block *sb, struct hk_cmt_node *cmt_node);
+void hk_cmt_balance(struct super_block *sb, struct inode *inode);
 void hk_flush_cmt_queue(struct super_block *sb, int num_cpus);
 void hk_cmt_destory_forest(struct super_block *sb);
 #endif
@@ -473,17 +523,11 @@ static inline int hk_get_cpuid(struct super_block *sb)
 	return smp_processor_id() % sbi->cpus;
 }
 
-// BKDR String Hash Function
-static inline unsigned long BKDRHash(const char *str, int length)
+/* Word-at-a-time name hash of the VFS. It is only kept in DRAM, so changing
+   it does not affect the layout on PM. */
+static inline u32 hk_name_hash(const char *name, int length)
 {
-	unsigned int seed = 131; // 31 131 1313 13131 131313 etc..
-	unsigned long hash = 0;
-	int i;
-
-	for (i = 0; i < length; i++)
-		hash = hash * seed + (*str++);
-
-	return hash;
+	return full_name_hash(NULL, name, length);
 }
 
 static inline void use_layout(struct hk_layout_info* layout)
@@ -542,18 +586,6 @@ static inline void unuse_layout_for_hdr(struct super_block *sb, u64 hdr)
 	unuse_layout(layout);
 }
 
-static inline void use_journal(struct super_block *sb, int txid)
-{
-	struct hk_sb_info *sbi = HK_SB(sb);
-	mutex_lock(&sbi->j_locks[txid]);
-}
-
-static inline void unuse_journal(struct super_block *sb, int txid)
-{
-	struct hk_sb_info *sbi = HK_SB(sb);
-	mutex_unlock(&sbi->j_locks[txid]);
-}
-
 static inline void hk_sync_super(struct super_block *sb)
 {
 	struct hk_sb_info 	  *sbi = HK_SB(sb);
@@ -88,3 +88,33 @@ static inline int hk_inf_queue_try_pop_front_batch_locked(struct hk_inf_queue *q
 
     return pop_num;
 }
+
+static inline struct list_head *hk_inf_queue_try_pop_front_locked(struct hk_inf_queue *queue)
+{
+    struct list_head *node = NULL;
+
+    spin_lock(&queue->lock);
+    if (queue->num != 0) {
+        node = queue->queue.next;
+        list_del_init(node);
+        queue->num--;
+    }
+    spin_unlock(&queue->lock);
+
+    return node;
+}
+
+static inline struct list_head *hk_inf_queue_try_pop_back_locked(struct hk_inf_queue *queue)
+{
+    struct list_head *node = NULL;
+
+    spin_lock(&queue->lock);
+    if (queue->num != 0) {
+        node = queue->queue.prev;
+        list_del_init(node);
+        queue->num--;
+    }
+    spin_unlock(&queue->lock);
+
+    return node;
+}
@@ -198,6 +198,8 @@ void hk_evict_inode(struct inode *inode)
 
     hk_dbgv("%s: %lu\n", __func__, inode->i_ino);
 
+    hk_tail_buf_release(inode);
+
     if (!inode->i_nlink && !is_bad_inode(inode)) {
         if (IS_APPEND(inode) || IS_IMMUTABLE(inode))
             goto out;
@@ -223,6 +225,8 @@ void hk_evict_inode(struct inode *inode)
 
 out:
     if (destroy == 0) {
+        if (S_ISDIR(inode->i_mode) && sih->dirs)
+            hk_dir_index_checkpoint(sb, inode);
 #ifdef CONFIG_CMT_BACKGROUND
         hk_delegate_close_async(sb, inode);
 #endif
@@ -323,6 +327,7 @@ void hk_init_pi(struct super_block *sb, struct inode *inode, umode_t mode, u32 i
     pi->i_generation = cpu_to_le32(inode->i_generation);
 
     pi->root.ofs_next = TRANS_ADDR_TO_OFS(sbi, &pi->root);
+    pi->i_dindex = 0;
     pi->tstamp = cpu_to_le64(get_version(HK_SB(inode->i_sb)));
 
     if (S_ISCHR(inode->i_mode) || S_ISBLK(inode->i_mode))
@@ -545,6 +550,17 @@ static int hk_handle_setattr_operation(struct super_block *sb, struct inode *ino
     if (ia_valid & ATTR_MODE)
         sih->i_mode = inode->i_mode;
 
+    /* Only a truncation has to be on PM before it returns */
+    if (!(ia_valid & ATTR_SIZE)) {
+#ifdef CONFIG_CMT_BACKGROUND
+        ret = hk_stage_attrchange(sb, inode);
+        hk_cmt_balance(sb, inode);
+#else
+        ret = hk_commit_attrchange(sb, inode);
+#endif
+        return ret;
+    }
+
     ret = hk_commit_sizechange(sb, inode, attr->ia_size);
 
     return ret;
@@ -617,7 +633,7 @@ static void hk_truncate_file_blocks(struct inode *inode, loff_t start, loff_t en
         hk_delegate_data_async(sb, inode, &dbatch, 0, CMT_INVALID_DATA);
 #else
         use_layout_for_addr(sb, addr);
-        sm_invalid_data_sync(sb, sm_get_prev_addr_by_dbatch(sb, sih, &batch), addr, sih->ino);
+        sm_invalid_data_sync(sb, sm_get_prev_addr_by_dbatch(sb, sih, &batch), addr, sih->cmt_node);
         unuse_layout_for_addr(sb, addr);
 #endif
         freed++;
@@ -699,6 +715,10 @@ int hk_notify_change(struct dentry *dentry, struct iattr *attr)
     if (ia_valid == 0)
         goto out;
 
+    /* Truncate works on what is on PM */
+    if (ia_valid & ATTR_SIZE)
+        hk_tail_buf_flush(inode);
+
     ret = hk_handle_setattr_operation(sb, inode, pi, ia_valid, attr);
     if (ret)
         goto out;
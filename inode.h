@@ -44,13 +44,30 @@ struct hk_inode {
     __le64 tx_attr_entry; /* Used attr entry slot for transcation */
     __le64 tx_link_change_entry; /* Used linkchanged entry slot for transcation */
 
+    __le64 i_dindex; /* f_blk + 1 of the dir index head, 0 if none, see hk_dir_index_checkpoint */
+
     //! We don't need this for now
     __le32 csum; /* CRC32 checksum */
-    u8 padding[27]; /* Padding to 128 bytes */
+    u8 padding[19]; /* Padding to 128 bytes */
 } __attribute((__packed__));
 
 static_assert(sizeof(struct hk_inode) == 128, "hk_inode size mismatch");
 
+/*
+ * DRAM copy of the XPLine holding the file tail (mount option tailbuf).
+ * Appends shorter than an XPLine are absorbed here, and reach PM as a
+ * whole XPLine once it fills, on fsync, or when flush_work fires.
+ */
+struct hk_tail_buf {
+    u64 addr; /* PM address of the XPLine, 0 if nothing is buffered */
+    u64 pos;  /* file offset of the XPLine */
+    u32 start; /* data before start is already on PM */
+    u32 end;   /* data after end is beyond EOF */
+    u8 data[PM_ACCESS_GRANU];
+    struct inode *inode;
+    struct delayed_work flush_work;
+};
+
 /*
  * hk-specific inode icp kept in DRAM
  */
@@ -59,8 +76,8 @@ struct hk_inode_info_header {
 
     struct hk_cmt_node *cmt_node; /* Commit node for this inode */
 
-    struct hlist_head *dirs; /* Hash table for dirs */
-    u64 i_num_dentrys;       /* Dentrys tail */
+    struct hk_dir_table *dirs; /* Hash table for dirs */
+    u64 i_num_dentrys;       /* Valid dentrys */
 
     unsigned short i_mode; /* Dir or file? */
     unsigned int i_flags;
@@ -74,6 +91,8 @@ struct hk_inode_info_header {
     u64 last_dentry;      /* Last updated dentry */
 
     u64 tstamp; /* Time stamp for Version Control */
+
+    struct hk_tail_buf *tbuf; /* Small appends not yet on PM */
 };
 
 // TODO: This could be jentry
@@ -3,8 +3,13 @@
 
 long hk_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-    // TODO: io control
-    return 0;
+    switch (cmd) {
+    case HK_IOC_COPY_BENCH:
+        return hk_copy_bench(filp);
+    default:
+        // TODO: io control
+        return 0;
+    }
 }
 
 #ifdef CONFIG_COMPAT
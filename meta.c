@@ -97,6 +97,125 @@ int sm_remove_hdr(struct super_block *sb, struct hk_header *prev_hdr, struct hk_
     return 0;
 }
 
+/* ======================= ANCHOR: XPLine write combining ========================= */
+#define HK_XPLINE_LINES (PM_ACCESS_GRANU / CACHELINE_SIZE)
+#define HK_XPLINE_FULL  ((1 << HK_XPLINE_LINES) - 1)
+
+void hk_wc_init(struct super_block *sb, struct hk_xpline_wc *wc)
+{
+    wc->sb = sb;
+    wc->base = 0;
+    wc->dirty = 0;
+    wc->nr_unsealed = 0;
+}
+
+/* Checksum the unsealed headers together */
+static void hk_wc_seal(struct hk_xpline_wc *wc)
+{
+    struct hk_header *hdr;
+    const u8 *data[HK_CRC_LANES];
+    u32 crc[HK_CRC_LANES];
+    unsigned long irq_flags = 0;
+    int i;
+
+    if (wc->nr_unsealed < HK_CRC_LANES) {
+        for (i = 0; i < wc->nr_unsealed; i++) {
+            hdr = wc->unsealed[i];
+            hk_memunlock_hdr(wc->sb, hdr, &irq_flags);
+            hdr->crc32 = hk_crc32c(~0, (const u8 *)hdr, sizeof(struct hk_header));
+            hk_memlock_hdr(wc->sb, hdr, &irq_flags);
+        }
+        wc->nr_unsealed = 0;
+        return;
+    }
+
+    for (i = 0; i < HK_CRC_LANES; i++) {
+        data[i] = (const u8 *)wc->unsealed[i];
+    }
+    hk_crc32c_multi(~0, data, sizeof(struct hk_header), crc);
+    for (i = 0; i < HK_CRC_LANES; i++) {
+        hdr = wc->unsealed[i];
+        hk_memunlock_hdr(wc->sb, hdr, &irq_flags);
+        hdr->crc32 = crc[i];
+        hk_memlock_hdr(wc->sb, hdr, &irq_flags);
+    }
+    wc->nr_unsealed = 0;
+}
+
+/* Write back the gathered XPLine without fence */
+void hk_wc_drain(struct hk_xpline_wc *wc)
+{
+    int i;
+
+    /* a header must not reach PM before its crc32 */
+    if (wc->nr_unsealed) {
+        hk_wc_seal(wc);
+    }
+
+    if (!wc->dirty) {
+        return;
+    }
+
+    if (wc->dirty == HK_XPLINE_FULL) {
+        hk_flush_buffer((void *)wc->base, PM_ACCESS_GRANU, false);
+        HK_STATS_ADD(xpline_full_flushes, 1);
+    } else {
+        for (i = 0; i < HK_XPLINE_LINES; i++) {
+            if (wc->dirty & (1 << i)) {
+                hk_flush_buffer((void *)(wc->base + i * CACHELINE_SIZE), CACHELINE_SIZE, false);
+            }
+        }
+        HK_STATS_ADD(xpline_partial_flushes, 1);
+    }
+
+    wc->base = 0;
+    wc->dirty = 0;
+}
+
+/* Mark [addr, addr + len) dirty. The gathered XPLine is written back once a
+   write leaves it, so callers should write in address order. */
+void hk_wc_add(struct hk_xpline_wc *wc, void *addr, u64 len)
+{
+    u64 line = (u64)addr & CACHELINE_MASK;
+    u64 end = (u64)addr + len;
+    u64 base;
+
+    for (; line < end; line += CACHELINE_SIZE) {
+        base = line & ~((u64)PM_ACCESS_GRANU - 1);
+        if (base != wc->base) {
+            hk_wc_drain(wc);
+            wc->base = base;
+        }
+        wc->dirty |= 1 << ((line - base) / CACHELINE_SIZE);
+    }
+}
+
+/* Fill in hdr->crc32 right away, or once HK_CRC_LANES headers of the batch
+   gathered in wc are ready. hdr must not be written after this. */
+static void sm_seal_hdr(struct hk_xpline_wc *wc, struct hk_header *hdr)
+{
+    if (!wc) {
+        hdr->crc32 = hk_crc32c(~0, (const u8 *)hdr, sizeof(struct hk_header));
+        return;
+    }
+    wc->unsealed[wc->nr_unsealed++] = hdr;
+    if (wc->nr_unsealed == HK_CRC_LANES) {
+        hk_wc_seal(wc);
+    }
+}
+
+/* Persist hdr right away, or leave it to the batch gathered in wc */
+static void sm_persist_hdr(struct hk_xpline_wc *wc, struct hk_header *hdr)
+{
+    if (wc) {
+        hk_wc_add(wc, hdr, sizeof(struct hk_header));
+        return;
+    }
+    hk_flush_buffer(hdr, sizeof(struct hk_header), true);
+    HK_STATS_ADD(xpline_partial_flushes, 1);
+    HK_STATS_ADD(sm_hdr_fences, 1);
+}
+
 // Hybrid link: Providing a consistent view in PM as DRAM
 int sm_insert_hdr(struct super_block *sb, struct hk_header *prev_hdr,
                   struct hk_header *hdr, struct hk_header *next_hdr)
@@ -111,6 +230,195 @@ int sm_insert_hdr(struct super_block *sb, struct hk_header *prev_hdr,
     return 0;
 }
 
+#ifdef CONFIG_EXTENT_HDR
+/* Runs of more than one block are tracked in cmt_node->runs as [head, last]
+   dblks. They are only touched with cmt_node->processing held, or before the
+   inode is visible. */
+static struct hk_range_node *sm_find_run(struct super_block *sb, struct hk_cmt_node *cmt_node, u64 blk_addr)
+{
+    return hk_range_find_cover(&cmt_node->runs, hk_get_dblk_by_addr(HK_SB(sb), blk_addr));
+}
+
+/* Address of the header that describes blk_addr */
+u64 sm_get_run_head_addr(struct super_block *sb, struct hk_cmt_node *cmt_node, u64 blk_addr)
+{
+    struct hk_range_node *run;
+
+    if (blk_addr == 0) {
+        return 0;
+    }
+
+    run = sm_find_run(sb, cmt_node, blk_addr);
+    return run ? hk_get_addr_by_dblk(HK_SB(sb), run->range_low) : blk_addr;
+}
+
+int sm_track_run(struct super_block *sb, struct hk_cmt_node *cmt_node, u64 head_addr, u32 run)
+{
+    struct hk_range_node *node;
+    u64 blk = hk_get_dblk_by_addr(HK_SB(sb), head_addr);
+    int ret;
+
+    if (run <= 1) {
+        return 0;
+    }
+
+    node = hk_alloc_hk_range_node();
+    if (!node) {
+        return -ENOMEM;
+    }
+    node->range_low = blk;
+    node->range_high = blk + run - 1;
+
+    ret = hk_range_insert_range_node(&cmt_node->runs, node);
+    if (ret) {
+        hk_free_hk_range_node(node);
+    }
+    return ret;
+}
+
+/* The list may end at either the DRAM root or the PM root after close */
+static inline bool sm_is_root(struct super_block *sb, struct hk_cmt_node *cmt_node, struct hk_header *hdr)
+{
+    return (void *)hdr == &cmt_node->root || (void *)hdr == &hk_get_pi_by_ino(sb, cmt_node->ino)->root;
+}
+
+static inline u64 sm_hdr_blk(struct super_block *sb, struct hk_header *hdr)
+{
+    return hk_get_dblk_by_addr(HK_SB(sb), sm_get_addr_by_hdr(sb, (u64)hdr));
+}
+
+/* Value of hdr in cmt_node->prevs: dblk + 1 of a head, 0 for root */
+static inline unsigned long sm_hdr_link(struct super_block *sb, struct hk_cmt_node *cmt_node, struct hk_header *hdr)
+{
+    return sm_is_root(sb, cmt_node, hdr) ? 0 : sm_hdr_blk(sb, hdr) + 1;
+}
+
+/* Heads are linked in commit order rather than f_blk order, so their
+   predecessors are tracked in DRAM instead of walking the list. NULL if hdr
+   is not linked since the node was created, e.g., a follower of a run. */
+static struct hk_header *sm_find_prev_hdr(struct super_block *sb, struct hk_cmt_node *cmt_node,
+                                          struct hk_header *hdr)
+{
+    void *entry = xa_load(&cmt_node->prevs, sm_hdr_blk(sb, hdr));
+    unsigned long prev;
+
+    if (!entry) {
+        return NULL;
+    }
+    prev = xa_to_value(entry);
+    return prev ? sm_get_hdr_by_blk(sb, prev - 1) : (struct hk_header *)&cmt_node->root;
+}
+
+/* Link hdr right after prev_hdr, and track the predecessors it changes */
+static void sm_link_hdr(struct super_block *sb, struct hk_cmt_node *cmt_node, struct hk_header *prev_hdr,
+                        struct hk_header *hdr)
+{
+    struct hk_header *next_hdr = (struct hk_header *)TRANS_OFS_TO_ADDR(HK_SB(sb), prev_hdr->node.ofs_next);
+
+    sm_insert_hdr(sb, prev_hdr, hdr, next_hdr);
+
+    xa_store(&cmt_node->prevs, sm_hdr_blk(sb, hdr), xa_mk_value(sm_hdr_link(sb, cmt_node, prev_hdr)), GFP_KERNEL);
+    if (sm_is_root(sb, cmt_node, next_hdr)) {
+        cmt_node->tail = hdr;
+    } else {
+        xa_store(&cmt_node->prevs, sm_hdr_blk(sb, next_hdr), xa_mk_value(sm_hdr_blk(sb, hdr) + 1), GFP_KERNEL);
+    }
+}
+
+static void sm_unlink_hdr(struct super_block *sb, struct hk_cmt_node *cmt_node, struct hk_header *prev_hdr,
+                          struct hk_header *hdr)
+{
+    struct hk_header *next_hdr = (struct hk_header *)TRANS_OFS_TO_ADDR(HK_SB(sb), hdr->node.ofs_next);
+
+    sm_remove_hdr(sb, prev_hdr, hdr);
+
+    xa_erase(&cmt_node->prevs, sm_hdr_blk(sb, hdr));
+    if (sm_is_root(sb, cmt_node, next_hdr)) {
+        cmt_node->tail = sm_is_root(sb, cmt_node, prev_hdr) ? NULL : prev_hdr;
+    } else {
+        xa_store(&cmt_node->prevs, sm_hdr_blk(sb, next_hdr), xa_mk_value(sm_hdr_link(sb, cmt_node, prev_hdr)), GFP_KERNEL);
+    }
+}
+
+/* Write a head for the blocks of `head` starting `ofs` blocks in, and link it
+   right after `head`. */
+static struct hk_header *sm_split_run_head(struct super_block *sb, struct hk_cmt_node *cmt_node,
+                                           struct hk_header *head, u64 ofs, u32 run)
+{
+    u64 head_addr = sm_get_addr_by_hdr(sb, (u64)head);
+    struct hk_header *hdr = sm_get_hdr_by_addr(sb, head_addr + ofs * HK_PBLK_SZ);
+    unsigned long irq_flags = 0;
+
+    hk_memunlock_hdr(sb, (void *)hdr, &irq_flags);
+    hdr->ino = head->ino;
+    hdr->tstamp = head->tstamp;
+    hdr->f_blk = head->f_blk + ofs;
+    hdr->cmtime = head->cmtime;
+    hdr->size = head->size;
+    hdr->run = run;
+    sm_link_hdr(sb, cmt_node, head, hdr);
+    hdr->valid = 1;
+    hdr->crc32 = hk_crc32c(~0, (const u8 *)hdr, sizeof(struct hk_header));
+    sm_persist_hdr(NULL, hdr);
+    hk_memlock_hdr(sb, hdr, &irq_flags);
+    HK_STATS_ADD(sm_hdrs_committed, 1);
+
+    return hdr;
+}
+
+/* Take [addr_start, addr_end) out of the runs covering it. The part of a run
+   behind the range gets its own head before the old head is shrunk, so a crash
+   in between only leaves two heads mapping the same blocks. A head that is cut
+   itself is left to the caller, which invalidates or deletes it. */
+void sm_uncover_range(struct super_block *sb, struct hk_cmt_node *cmt_node, u64 addr_start, u64 addr_end)
+{
+    struct hk_sb_info *sbi = HK_SB(sb);
+    struct hk_range_node *run;
+    struct hk_header *head;
+    unsigned long irq_flags = 0;
+    u64 blk = hk_get_dblk_by_addr(sbi, addr_start);
+    u64 last = hk_get_dblk_by_addr(sbi, addr_end - HK_PBLK_SZ);
+    u64 lo, hi, cut_end;
+
+    while (blk <= last) {
+        run = hk_range_find_cover(&cmt_node->runs, blk);
+        if (!run) {
+            blk++;
+            continue;
+        }
+
+        lo = run->range_low;
+        hi = run->range_high;
+        cut_end = min(hi, last);
+        head = sm_get_hdr_by_blk(sb, lo);
+
+        if (cut_end < hi) {
+            sm_split_run_head(sb, cmt_node, head, cut_end + 1 - lo, hi - cut_end);
+            sm_track_run(sb, cmt_node, hk_get_addr_by_dblk(sbi, cut_end + 1), hi - cut_end);
+        }
+
+        if (blk > lo) {
+            hk_memunlock_hdr(sb, (void *)head, &irq_flags);
+            head->run = blk - lo;
+            head->crc32 = hk_crc32c(~0, (const u8 *)head, sizeof(struct hk_header));
+            sm_persist_hdr(NULL, head);
+            hk_memlock_hdr(sb, head, &irq_flags);
+            HK_STATS_ADD(sm_hdrs_committed, 1);
+
+            if (blk - lo > 1) {
+                run->range_high = blk - 1;
+            } else {
+                hk_range_delete_range_node(&cmt_node->runs, run);
+            }
+        } else {
+            hk_range_delete_range_node(&cmt_node->runs, run);
+        }
+
+        blk = cut_end + 1;
+    }
+}
+#endif
+
 // invalid data without linking. This means, we do not intefere with inode.
 // Note the consistency of hdr is delayed to allocation and remount.
 int sm_delete_data_sync(struct super_block *sb, u64 blk_addr)
@@ -149,31 +457,46 @@ int sm_delete_data_sync(struct super_block *sb, u64 blk_addr)
     return 0;
 }
 
-int sm_invalid_data_sync(struct super_block *sb, u64 prev_addr, u64 blk_addr, u64 ino)
+/* `cmt_node` is the one cached in sih or carried by the cmt info, it lives until umount.
+   With `wc`, the header is only gathered: the caller must drain wc and issue one
+   PERSISTENT_BARRIER for the whole batch. */
+int __sm_invalid_data_sync(struct super_block *sb, u64 prev_addr, u64 blk_addr, struct hk_cmt_node *cmt_node,
+                           struct hk_xpline_wc *wc)
 {
     /*! Note: Do not update tstamp in invalid process, since version control */
     struct hk_header *hdr, *prev_hdr = NULL;
     struct hk_layout_info *layout;
     struct hk_sb_info *sbi = HK_SB(sb);
-    struct hk_cmt_node *cmt_node;
     unsigned long irq_flags = 0;
     u64 blk;
     INIT_TIMING(invalid_time);
 
     HK_START_TIMING(sm_invalid_t, invalid_time);
-    cmt_node = hk_cmt_search_node(sb, ino);
     hdr = sm_get_hdr_by_addr(sb, blk_addr);
 
+#ifdef CONFIG_EXTENT_HDR
+    sm_uncover_range(sb, cmt_node, blk_addr, blk_addr + HK_PBLK_SZ);
+    /* followers of a run are not linked */
+    prev_hdr = sm_find_prev_hdr(sb, cmt_node, hdr);
+    if (prev_hdr) {
+        sm_unlink_hdr(sb, cmt_node, prev_hdr, hdr);
+    }
+#else
     prev_hdr = prev_addr == 0 ? &cmt_node->root : sm_get_hdr_by_addr(sb, prev_addr);
 
     sm_remove_hdr(sb, prev_hdr, hdr);
+#endif
 
     hk_memunlock_hdr(sb, hdr, &irq_flags);
 
-    PERSISTENT_BARRIER();
+    if (!wc) {
+        PERSISTENT_BARRIER();
+        HK_STATS_ADD(sm_hdr_fences, 1);
+    }
     hdr->valid = 0;
-    hk_flush_buffer(hdr, sizeof(struct hk_header), true);
+    sm_persist_hdr(wc, hdr);
     hk_memlock_hdr(sb, hdr, &irq_flags);
+    HK_STATS_ADD(sm_hdrs_committed, 1);
 
     layout = sm_get_layout_by_hdr(sb, (u64)hdr);
 
@@ -187,7 +510,24 @@ int sm_invalid_data_sync(struct super_block *sb, u64 prev_addr, u64 blk_addr, u6
     return 0;
 }
 
-int sm_update_data_sync(struct super_block *sb, u64 blk_addr, u64 size)
+/* The sync entries edit the header list of cmt_node like the cmt workers do,
+   so they take the node from the workers meanwhile */
+int sm_invalid_data_sync(struct super_block *sb, u64 prev_addr, u64 blk_addr, struct hk_cmt_node *cmt_node)
+{
+    int ret;
+
+    if (cmt_node) {
+        mutex_lock(&cmt_node->processing);
+    }
+    ret = __sm_invalid_data_sync(sb, prev_addr, blk_addr, cmt_node, NULL);
+    if (cmt_node) {
+        mutex_unlock(&cmt_node->processing);
+    }
+
+    return ret;
+}
+
+int __sm_update_data_sync(struct super_block *sb, u64 blk_addr, u64 size, struct hk_xpline_wc *wc)
 {
     struct hk_header *hdr;
     struct hk_sb_info *sbi = HK_SB(sb);
@@ -201,30 +541,37 @@ int sm_update_data_sync(struct super_block *sb, u64 blk_addr, u64 size)
 
     hk_memunlock_hdr(sb, (void *)hdr, &irq_flags);
     hdr->size = size;
-    hk_flush_buffer(hdr, sizeof(struct hk_header), true);
+    sm_persist_hdr(wc, hdr);
     hk_memlock_hdr(sb, hdr, &irq_flags);
+    HK_STATS_ADD(sm_hdrs_committed, 1);
 
     HK_END_TIMING(sm_update_t, time);
     return 0;
 }
 
-int sm_valid_data_sync(struct super_block *sb, u64 prev_addr, u64 blk_addr, u64 next_addr,
-                       u64 ino, u64 f_blk, u64 tstamp, u64 size, u32 cmtime)
+int sm_update_data_sync(struct super_block *sb, u64 blk_addr, u64 size)
+{
+    return __sm_update_data_sync(sb, blk_addr, size, NULL);
+}
+
+int __sm_valid_data_sync(struct super_block *sb, u64 prev_addr, u64 blk_addr, u64 next_addr,
+                         struct hk_cmt_node *cmt_node, u64 f_blk, u64 tstamp, u64 size, u32 cmtime,
+                         struct hk_xpline_wc *wc)
 {
     struct hk_header *hdr = NULL, *prev_hdr = NULL, *next_hdr = NULL;
     struct hk_layout_info *layout;
-    struct hk_cmt_node *cmt_node;
+    u64 ino = cmt_node->ino;
     unsigned long irq_flags = 0;
     INIT_TIMING(valid_time);
 
     HK_START_TIMING(sm_valid_t, valid_time);
 
-    cmt_node = hk_cmt_search_node(sb, ino);
-
     hdr = sm_get_hdr_by_addr(sb, blk_addr);
 
+#ifndef CONFIG_EXTENT_HDR
     prev_hdr = prev_addr == 0 ? &cmt_node->root : sm_get_hdr_by_addr(sb, prev_addr);
     next_hdr = next_addr == 0 ? &cmt_node->root : sm_get_hdr_by_addr(sb, next_addr);
+#endif
 
     /* Write Hdr, then persist it */
     hk_memunlock_hdr(sb, (void *)hdr, &irq_flags);
@@ -233,15 +580,22 @@ int sm_valid_data_sync(struct super_block *sb, u64 prev_addr, u64 blk_addr, u64
     hdr->f_blk = f_blk;
     hdr->cmtime = cmtime;
     hdr->size = size;
+    hdr->run = 1;
 
+#ifdef CONFIG_EXTENT_HDR
+    /* heads are linked in commit order */
+    sm_link_hdr(sb, cmt_node, (struct hk_header *)&cmt_node->root, hdr);
+#else
     sm_insert_hdr(sb, prev_hdr, hdr, next_hdr);
+#endif
 
     // Let's try fence once with crc32
     hdr->valid = 1;
-    hdr->crc32 = hk_crc32c(~0, (const u8 *)hdr, sizeof(struct hk_header));
+    sm_seal_hdr(wc, hdr);
     /* this might be relatively slow */
-    hk_flush_buffer(hdr, sizeof(struct hk_header), true);
+    sm_persist_hdr(wc, hdr);
     hk_memlock_hdr(sb, hdr, &irq_flags);
+    HK_STATS_ADD(sm_hdrs_committed, 1);
 
     layout = sm_get_layout_by_hdr(sb, (u64)hdr);
 
@@ -251,6 +605,64 @@ int sm_valid_data_sync(struct super_block *sb, u64 prev_addr, u64 blk_addr, u64
     return 0;
 }
 
+int sm_valid_data_sync(struct super_block *sb, u64 prev_addr, u64 blk_addr, u64 next_addr,
+                       struct hk_cmt_node *cmt_node, u64 f_blk, u64 tstamp, u64 size, u32 cmtime)
+{
+    int ret;
+
+    if (cmt_node) {
+        mutex_lock(&cmt_node->processing);
+    }
+    ret = __sm_valid_data_sync(sb, prev_addr, blk_addr, next_addr, cmt_node, f_blk, tstamp, size, cmtime, NULL);
+    if (cmt_node) {
+        mutex_unlock(&cmt_node->processing);
+    }
+
+    return ret;
+}
+
+#ifdef CONFIG_EXTENT_HDR
+/* Commit `run` contiguous blocks of one layout with a single head. The head is
+   linked right after root, and the followers' headers are left untouched. */
+int __sm_valid_run_sync(struct super_block *sb, u64 blk_addr, u32 run, struct hk_cmt_node *cmt_node,
+                        u64 f_blk, u64 tstamp, u64 size, u32 cmtime, struct hk_xpline_wc *wc)
+{
+    struct hk_header *hdr;
+    struct hk_layout_info *layout;
+    unsigned long irq_flags = 0;
+    INIT_TIMING(valid_time);
+
+    HK_START_TIMING(sm_valid_t, valid_time);
+
+    hdr = sm_get_hdr_by_addr(sb, blk_addr);
+
+    hk_memunlock_hdr(sb, (void *)hdr, &irq_flags);
+    hdr->ino = cmt_node->ino;
+    hdr->tstamp = tstamp;
+    hdr->f_blk = f_blk;
+    hdr->cmtime = cmtime;
+    hdr->size = size;
+    hdr->run = run;
+
+    sm_link_hdr(sb, cmt_node, (struct hk_header *)&cmt_node->root, hdr);
+
+    hdr->valid = 1;
+    sm_seal_hdr(wc, hdr);
+    sm_persist_hdr(wc, hdr);
+    hk_memlock_hdr(sb, hdr, &irq_flags);
+    HK_STATS_ADD(sm_hdrs_committed, 1);
+
+    sm_track_run(sb, cmt_node, blk_addr, run);
+
+    layout = sm_get_layout_by_hdr(sb, (u64)hdr);
+
+    ind_update(&layout->ind, VALIDATE_BLK, run);
+
+    HK_END_TIMING(sm_valid_t, valid_time);
+    return 0;
+}
+#endif
+
 /* ======================= ANCHOR: Attr Logs ========================= */
 
 struct hk_attr_log *hk_get_attr_log_by_alid(struct super_block *sb, int alid)
@@ -259,14 +671,182 @@ struct hk_attr_log *hk_get_attr_log_by_alid(struct super_block *sb, int alid)
     return (struct hk_attr_log *)(sbi->al_addr + alid * sizeof(struct hk_attr_log));
 }
 
+/* A region with fewer slots than inodes is compact: slots are taken by the
+   first commit of an ino and given back when evicted. */
+static inline bool hk_al_is_compact(struct hk_sb_info *sbi)
+{
+    return sbi->al_slots < HK_NUM_INO;
+}
+
+/* NULL if ino has no attr log in a compact region */
 struct hk_attr_log *hk_get_attr_log_by_ino(struct super_block *sb, u64 ino)
 {
     struct hk_sb_info *sbi = HK_SB(sb);
+    void *entry;
+
+    if (!hk_al_is_compact(sbi)) {
+        return hk_get_attr_log_by_alid(sb, ino % sbi->al_slots);
+    }
+
+    entry = xa_load(&sbi->al_map, ino);
+    return entry ? hk_get_attr_log_by_alid(sb, xa_to_value(entry)) : NULL;
+}
+
+static int hk_map_attr_log(struct super_block *sb, u64 ino, int alid)
+{
+    struct hk_sb_info *sbi = HK_SB(sb);
+
+    set_bit(alid, sbi->al_busy);
+    return xa_err(xa_store(&sbi->al_map, ino, xa_mk_value(alid), GFP_KERNEL));
+}
+
+static inline int hk_get_alid(struct hk_sb_info *sbi, struct hk_attr_log *al)
+{
+    return ((u64)al - sbi->al_addr) / sizeof(struct hk_attr_log);
+}
+
+static void hk_unmap_attr_log(struct super_block *sb, u64 ino, struct hk_attr_log *al)
+{
+    struct hk_sb_info *sbi = HK_SB(sb);
+    int alid = hk_get_alid(sbi, al);
+
+    if (!hk_al_is_compact(sbi)) {
+        return;
+    }
+
+    /* the ino may have been given another slot meanwhile */
+    xa_cmpxchg(&sbi->al_map, ino, xa_mk_value(alid), NULL, GFP_KERNEL);
+    clear_bit(alid, sbi->al_busy);
+}
+
+/* Next slot in clock order that nobody holds, -1 if all of them are held.
+   Caller holds al_lock. */
+static int hk_clock_attr_log(struct hk_sb_info *sbi)
+{
+    u64 i;
     int alid;
 
-    alid = ino % sbi->al_slots;
+    for (i = 0; i < sbi->al_slots; i++) {
+        alid = sbi->al_hand;
+        sbi->al_hand = (alid + 1) % sbi->al_slots;
+        if (!sbi->al_holds[alid]) {
+            return alid;
+        }
+    }
 
-    return hk_get_attr_log_by_alid(sb, alid);
+    return -1;
+}
+
+/* Attr log to commit ino's entries in, held until hk_put_attr_log(). A full
+   compact region evicts its slots in clock order, but never a held one: its
+   owner is committing to it or has a tx snapshot of it open. */
+struct hk_attr_log *hk_alloc_attr_log(struct super_block *sb, u64 ino)
+{
+    struct hk_sb_info *sbi = HK_SB(sb);
+    struct hk_attr_log *al;
+    unsigned long irq_flags = 0;
+    int alid;
+
+    if (!hk_al_is_compact(sbi)) {
+        return hk_get_attr_log_by_alid(sb, ino % sbi->al_slots);
+    }
+
+    mutex_lock(&sbi->al_lock);
+retry:
+    al = hk_get_attr_log_by_ino(sb, ino);
+    if (al) {
+        alid = hk_get_alid(sbi, al);
+        goto out;
+    }
+
+    alid = find_first_zero_bit(sbi->al_busy, sbi->al_slots);
+    if (alid >= sbi->al_slots) {
+        alid = hk_clock_attr_log(sbi);
+        if (alid < 0) {
+            mutex_unlock(&sbi->al_lock);
+            HK_STATS_ADD(al_slot_waits, 1);
+            wait_event(sbi->al_wq, READ_ONCE(sbi->al_nr_held) < sbi->al_slots);
+            mutex_lock(&sbi->al_lock);
+            goto retry;
+        }
+        al = hk_get_attr_log_by_alid(sb, alid);
+        if (le64_to_cpu(al->ino) != (u64)-1) {
+            hk_evicting_attr_log(sb, al);
+        }
+        HK_STATS_ADD(al_slot_evictions, 1);
+    }
+
+    al = hk_get_attr_log_by_alid(sb, alid);
+    if (hk_map_attr_log(sb, ino, alid)) {
+        /* no memory for the map, take the slot of ino in a full region */
+        alid = ino % sbi->al_slots;
+        al = hk_get_attr_log_by_alid(sb, alid);
+    } else {
+        /* a held slot may not see a commit, the owner must be known to
+           evict it later */
+        hk_memunlock_attr_log(sb, al, &irq_flags);
+        al->ino = cpu_to_le64(ino);
+        hk_memlock_attr_log(sb, al, &irq_flags);
+        hk_flush_buffer(&al->ino, sizeof(al->ino), true);
+    }
+out:
+    if (sbi->al_holds[alid]++ == 0) {
+        WRITE_ONCE(sbi->al_nr_held, sbi->al_nr_held + 1);
+    }
+    mutex_unlock(&sbi->al_lock);
+    return al;
+}
+
+/* Drop a hold of ino's attr log taken by hk_alloc_attr_log() */
+void hk_put_attr_log(struct super_block *sb, u64 ino)
+{
+    struct hk_sb_info *sbi = HK_SB(sb);
+    struct hk_attr_log *al;
+    bool wake = false;
+    int alid;
+
+    if (!hk_al_is_compact(sbi)) {
+        return;
+    }
+
+    mutex_lock(&sbi->al_lock);
+    /* a held slot is never unmapped, unless the map ran out of memory */
+    al = hk_get_attr_log_by_ino(sb, ino);
+    alid = al ? hk_get_alid(sbi, al) : ino % sbi->al_slots;
+    if (!WARN_ON_ONCE(!sbi->al_holds[alid]) && --sbi->al_holds[alid] == 0) {
+        WRITE_ONCE(sbi->al_nr_held, sbi->al_nr_held - 1);
+        wake = true;
+    }
+    mutex_unlock(&sbi->al_lock);
+
+    if (wake && waitqueue_active(&sbi->al_wq)) {
+        wake_up(&sbi->al_wq);
+    }
+}
+
+/* Map the attr logs left by a crash, before the journals are undone */
+int hk_build_attr_log_map(struct super_block *sb)
+{
+    struct hk_sb_info *sbi = HK_SB(sb);
+    struct hk_attr_log *al;
+    int alid;
+    int ret;
+
+    if (!hk_al_is_compact(sbi)) {
+        return 0;
+    }
+
+    for (alid = 0; alid < sbi->al_slots; alid++) {
+        al = hk_get_attr_log_by_alid(sb, alid);
+        if (le64_to_cpu(al->ino) != (u64)-1) {
+            ret = hk_map_attr_log(sb, le64_to_cpu(al->ino), alid);
+            if (ret) {
+                return ret;
+            }
+        }
+    }
+
+    return 0;
 }
 
 /* Make sure region is memunlocked */
@@ -336,6 +916,9 @@ int hk_evicting_attr_log(struct super_block *sb, struct hk_attr_log *al)
     unsigned long irq_flags = 0;
 
     if (!pi->valid) {
+        /* nothing to apply, but the entries must not pass to the next owner */
+        hk_reset_attr_log(sb, al);
+        hk_unmap_attr_log(sb, ino, al);
         return -1;
     }
 
@@ -360,6 +943,7 @@ int hk_evicting_attr_log(struct super_block *sb, struct hk_attr_log *al)
 
     /* Invalidate the region */
     hk_reset_attr_log(sb, al);
+    hk_unmap_attr_log(sb, ino, al);
 
     return 0;
 }
@@ -370,8 +954,9 @@ bool hk_get_cur_commit_al_entry(struct super_block *sb, struct hk_inode *pi, enu
     bool commit_found = false;
     struct hk_attr_log *al;
 
+    *entry = NULL;
     al = hk_get_attr_log_by_ino(sb, pi->ino);
-    if (al->ino == pi->ino) /* Cur Commit */
+    if (al && al->ino == pi->ino) /* Cur Commit */
     {
         switch (type) {
         case SET_ATTR:
@@ -390,7 +975,6 @@ bool hk_get_cur_commit_al_entry(struct super_block *sb, struct hk_inode *pi, enu
             break;
         }
     }
-    *entry = NULL;
     return commit_found;
 }
 
@@ -416,10 +1000,12 @@ int hk_evicting_attr_log_to_inode(struct super_block *sb, struct hk_inode *pi)
 int hk_do_commit_al_entry(struct super_block *sb, u64 ino, struct hk_al_entry *entry)
 {
     struct hk_attr_log *al;
+    struct hk_xpline_wc wc;
     unsigned long irq_flags = 0;
     int slotid;
 
-    al = hk_get_attr_log_by_ino(sb, ino);
+    hk_wc_init(sb, &wc);
+    al = hk_alloc_attr_log(sb, ino);
     /* Evict Attr Log */
     if (al->ino != ino && al->ino != (u64)-1) {
         hk_evicting_attr_log(sb, al);
@@ -430,8 +1016,12 @@ int hk_do_commit_al_entry(struct super_block *sb, u64 ino, struct hk_al_entry *e
 
     for (slotid = 0; slotid < HK_ATTRLOG_ENTY_SLOTS; slotid++) {
         if (slotid != al->last_valid_linkchange && slotid != al->last_valid_setattr) {
-            /* This Function Has Fence Inside */
-            memcpy_to_pmem_nocache(&al->entries[slotid], entry, sizeof(struct hk_al_entry));
+            /* An attr log is one XPLine: ino and the entry are written back together */
+            hk_wc_add(&wc, &al->ino, sizeof(al->ino));
+            memcpy(&al->entries[slotid], entry, sizeof(struct hk_al_entry));
+            hk_wc_add(&wc, &al->entries[slotid], sizeof(struct hk_al_entry));
+            hk_wc_drain(&wc);
+            PERSISTENT_BARRIER();
 
             /* Commit The Write */
             switch (entry->type) {
@@ -444,11 +1034,14 @@ int hk_do_commit_al_entry(struct super_block *sb, u64 ino, struct hk_al_entry *e
             default:
                 break;
             }
-            hk_flush_buffer(al, sizeof(struct hk_al_entry), true);
+            hk_wc_add(&wc, al, CACHELINE_SIZE);
+            hk_wc_drain(&wc);
+            PERSISTENT_BARRIER();
             break;
         }
     }
     hk_memlock_attr_log(sb, al, &irq_flags);
+    hk_put_attr_log(sb, ino);
 
     return 0;
 }
@@ -465,14 +1058,90 @@ void hk_create_al_snapshot(struct super_block *sb, struct hk_inode *pi)
     pi->tx_attr_entry = TRANS_ADDR_TO_OFS(sbi, attr_entry);
 }
 
+/* ======================= ANCHOR: attr stage ========================= */
+/* Absorb entry into the stage, which keeps the latest state of each entry type.
+   Returns true if the stage was clean, i.e., the caller has to get it flushed. */
+bool hk_stage_al_entry(struct hk_al_stage *stage, struct hk_al_entry *entry, u64 seq)
+{
+    bool was_clean;
+
+    spin_lock(&stage->lock);
+    /* an older checkpoint committed late by a cmt worker */
+    if (seq < stage->entry_seq[entry->type]) {
+        spin_unlock(&stage->lock);
+        HK_STATS_ADD(al_entries_absorbed, 1);
+        return false;
+    }
+    if (stage->staged & (1 << entry->type)) {
+        HK_STATS_ADD(al_entries_absorbed, 1);
+    }
+    was_clean = stage->staged == 0;
+    memcpy(&stage->entries[entry->type], entry, sizeof(struct hk_al_entry));
+    stage->entry_seq[entry->type] = seq;
+    stage->staged |= 1 << entry->type;
+    spin_unlock(&stage->lock);
+
+    return was_clean;
+}
+
+void hk_flush_al_stage(struct super_block *sb, struct hk_al_stage *stage, u64 ino)
+{
+    struct hk_al_entry entries[MAX_AL_ENTRY_TYPE];
+    u8 staged;
+    int type;
+
+    /* flushers write in the order they take entries from the stage */
+    mutex_lock(&stage->flushing);
+    spin_lock(&stage->lock);
+    staged = stage->staged;
+    memcpy(entries, stage->entries, sizeof(entries));
+    stage->staged = 0;
+    spin_unlock(&stage->lock);
+
+    for (type = 0; type < MAX_AL_ENTRY_TYPE; type++) {
+        if (staged & (1 << type)) {
+            hk_do_commit_al_entry(sb, ino, &entries[type]);
+        }
+    }
+    mutex_unlock(&stage->flushing);
+}
+
+/* Commit entry now, without overwriting a newer state staged for ino */
+static int hk_commit_staged_al_entry(struct super_block *sb, struct hk_cmt_node *cmt_node,
+                                     u64 ino, struct hk_al_entry *entry, u64 seq)
+{
+    if (!cmt_node) {
+        return hk_do_commit_al_entry(sb, ino, entry);
+    }
+
+    hk_stage_al_entry(&cmt_node->al_stage, entry, seq);
+    hk_flush_al_stage(sb, &cmt_node->al_stage, ino);
+
+    return 0;
+}
+
+static inline struct hk_cmt_node *hk_al_stage_node(struct inode *inode)
+{
+#ifdef CONFIG_CMT_BACKGROUND
+    return HK_IH(inode)->cmt_node;
+#else
+    return NULL;
+#endif
+}
+
+static inline u64 hk_al_next_seq(struct hk_cmt_node *cmt_node)
+{
+    return cmt_node ? atomic64_inc_return(&cmt_node->al_stage.seq) : 0;
+}
+
 /* ======================= ANCHOR: commit newattr ========================= */
-int hk_commit_attrchange(struct super_block *sb, struct inode *inode)
+static void hk_build_setattr_entry(struct super_block *sb, struct inode *inode, loff_t size,
+                                   struct hk_al_entry *entry)
 {
-    struct hk_al_entry entry;
     struct hk_setattr_entry *setattr;
     struct hk_sb_info *sbi = HK_SB(sb);
 
-    setattr = &entry.entry.setattr;
+    setattr = &entry->entry.setattr;
 
     setattr->mode = cpu_to_le16(inode->i_mode);
     setattr->gid = cpu_to_le32(i_gid_read(inode));
@@ -480,12 +1149,39 @@ int hk_commit_attrchange(struct super_block *sb, struct inode *inode)
     setattr->mtime = cpu_to_le32(inode->i_mtime.tv_sec);
     setattr->atime = cpu_to_le32(inode->i_atime.tv_sec);
     setattr->ctime = cpu_to_le32(inode->i_ctime.tv_sec);
-    setattr->size = cpu_to_le64(inode->i_size);
+    setattr->size = cpu_to_le64(size);
 
-    entry.type = SET_ATTR;
+    entry->type = SET_ATTR;
     setattr->tstamp = get_version(sbi);
+}
+
+int hk_commit_attrchange(struct super_block *sb, struct inode *inode)
+{
+    struct hk_cmt_node *cmt_node = hk_al_stage_node(inode);
+    struct hk_al_entry entry;
+
+    hk_build_setattr_entry(sb, inode, inode->i_size, &entry);
+
+    return hk_commit_staged_al_entry(sb, cmt_node, inode->i_ino, &entry, hk_al_next_seq(cmt_node));
+}
+
+/* Stage the attrs of inode in DRAM. Successive changes are absorbed until a
+   cmt worker or fsync writes the latest one to the attr log. */
+int hk_stage_attrchange(struct super_block *sb, struct inode *inode)
+{
+    struct hk_cmt_node *cmt_node = hk_al_stage_node(inode);
+    struct hk_al_entry entry;
 
-    hk_do_commit_al_entry(sb, inode->i_ino, &entry);
+    if (!cmt_node) {
+        return hk_commit_attrchange(sb, inode);
+    }
+
+    hk_build_setattr_entry(sb, inode, inode->i_size, &entry);
+    if (hk_stage_al_entry(&cmt_node->al_stage, &entry, hk_al_next_seq(cmt_node))) {
+        hk_delegate_attr_async(sb, inode);
+    }
+
+    return 0;
 }
 
 int hk_commit_icp_attrchange(struct super_block *sb, struct hk_cmt_icp *icp)
@@ -507,38 +1203,25 @@ int hk_commit_icp_attrchange(struct super_block *sb, struct hk_cmt_icp *icp)
     entry.type = SET_ATTR;
     setattr->tstamp = get_version(sbi);
 
-    hk_do_commit_al_entry(sb, icp->ino, &entry);
+    return hk_commit_staged_al_entry(sb, icp->cmt_node, icp->ino, &entry, icp->seq);
 }
 
 /* ======================= ANCHOR: commit sizechange ========================= */
 /* used only for hk_setsize(), inode must be opened */
 int hk_commit_sizechange(struct super_block *sb, struct inode *inode, loff_t ia_size)
 {
+    struct hk_cmt_node *cmt_node = hk_al_stage_node(inode);
     struct hk_al_entry entry;
-    struct hk_setattr_entry *setattr;
-    struct hk_sb_info *sbi = HK_SB(sb);
-    struct hk_inode_info_header *sih = HK_IH(inode);
 
-    setattr = &entry.entry.setattr;
-    entry.type = SET_ATTR;
+    hk_build_setattr_entry(sb, inode, ia_size, &entry);
 
-    setattr->mode = cpu_to_le16(inode->i_mode);
-    setattr->gid = cpu_to_le32(i_gid_read(inode));
-    setattr->uid = cpu_to_le32(i_uid_read(inode));
-    setattr->mtime = cpu_to_le32(inode->i_mtime.tv_sec);
-    setattr->atime = cpu_to_le32(inode->i_atime.tv_sec);
-    setattr->ctime = cpu_to_le32(inode->i_ctime.tv_sec);
-    setattr->size = cpu_to_le64(ia_size);
-    setattr->tstamp = get_version(sbi);
-
-    hk_do_commit_al_entry(sb, inode->i_ino, &entry);
-
-    return 0;
+    return hk_commit_staged_al_entry(sb, cmt_node, inode->i_ino, &entry, hk_al_next_seq(cmt_node));
 }
 
 /* ======================= ANCHOR: commit linkchange ========================= */
 int hk_commit_linkchange(struct super_block *sb, struct inode *inode)
 {
+    struct hk_cmt_node *cmt_node = hk_al_stage_node(inode);
     struct hk_al_entry entry;
     struct hk_linkchange_entry *linkchange;
     struct hk_sb_info *sbi = HK_SB(sb);
@@ -546,12 +1229,10 @@ int hk_commit_linkchange(struct super_block *sb, struct inode *inode)
     entry.type = LINK_CHANGE;
     linkchange = &entry.entry.linkchange;
     linkchange->tstamp = get_version(sbi);
-    linkchange->links = cpu_to_le16(inode->i_link);
+    linkchange->links = cpu_to_le16(inode->i_nlink);
     linkchange->ctime = cpu_to_le32(inode->i_ctime.tv_sec);
 
-    hk_do_commit_al_entry(sb, inode->i_ino, &entry);
-
-    return 0;
+    return hk_commit_staged_al_entry(sb, cmt_node, inode->i_ino, &entry, hk_al_next_seq(cmt_node));
 }
 
 int hk_commit_icp_linkchange(struct super_block *sb, struct hk_cmt_icp *icp)
@@ -566,9 +1247,7 @@ int hk_commit_icp_linkchange(struct super_block *sb, struct hk_cmt_icp *icp)
     linkchange->links = cpu_to_le16(icp->links_count);
     linkchange->ctime = cpu_to_le32(icp->ctime);
 
-    hk_do_commit_al_entry(sb, icp->ino, &entry);
-
-    return 0;
+    return hk_commit_staged_al_entry(sb, icp->cmt_node, icp->ino, &entry, icp->seq);
 }
 
 /* ======================= ANCHOR: commit icp ========================= */
@@ -590,6 +1269,7 @@ int hk_commit_icp(struct super_block *sb, struct hk_cmt_icp *icp)
     pi->i_mtime = cpu_to_le32(icp->mtime);
     pi->i_links_count = cpu_to_le16(icp->links_count);
     pi->root.ofs_next = TRANS_ADDR_TO_OFS(HK_SB(sb), &pi->root);
+    pi->i_dindex = 0;
     pi->i_generation = cpu_to_le32(icp->generation);
     pi->tstamp = icp->tstamp;
     pi->i_flags = cpu_to_le32(icp->flags);
@@ -698,20 +1378,34 @@ int hk_tx_assign_dentry_to_ji(struct super_block *sb, struct hk_jentry_info *ji,
     return 0;
 }
 
-int do_start_tx(struct super_block *sb, int txid, struct hk_tx_info *info)
+/* jcur always points to room for one jentry, the same as traverse_journal_entry */
+static u64 hk_tx_append_jentry(u64 jcur, u64 jstart, u64 jend, struct hk_jentry *je)
+{
+    hk_memcpy_to_pmem((void *)jcur, je, sizeof(struct hk_jentry));
+    jcur += sizeof(struct hk_jentry);
+    if (jcur + sizeof(struct hk_jentry) > jend) {
+        jcur = jstart;
+    }
+    return jcur;
+}
+
+/* Journal `nr` ops. A single op keeps its own jtype, while several ops
+   become one COMPOUND record, each op led by a J_OP entry with its jtype. */
+int do_start_tx(struct super_block *sb, int txid, struct hk_tx_info *infos, int nr)
 {
     struct hk_sb_info *sbi = HK_SB(sb);
     struct hk_journal *jnl;
+    struct hk_tx_info *info;
     struct hk_jentry_info *ji;
-    struct hk_jentry *je;
+    struct hk_jentry op_je;
     u64 jhead, jtail, jend, jstart, jcur;
     unsigned long irq_flags = 0;
-    int slotid;
+    int slotid, i;
 
     jnl = hk_get_journal_by_txid(sb, txid);
     hk_memunlock_journal(sb, jnl, &irq_flags);
     /* write type */
-    jnl->jhdr.jtype = info->jtype;
+    jnl->jhdr.jtype = nr > 1 ? COMPOUND : infos[0].jtype;
 
     /* write jentries */
     jhead = TRANS_OFS_TO_ADDR(sbi, jnl->jhdr.jofs_head);
@@ -725,15 +1419,18 @@ int do_start_tx(struct super_block *sb, int txid, struct hk_tx_info *info)
 
     jcur = jhead;
 
-    traverse_tx_info(ji, slotid, info)
-    {
-        if (ji->valid) {
-            je = &ji->jentry;
-            if (jcur + sizeof(struct hk_jentry) > jend) {
-                jcur = jstart;
+    for (i = 0; i < nr; i++) {
+        info = &infos[i];
+        if (nr > 1) {
+            op_je.type = J_OP;
+            op_je.data = cpu_to_le64(info->jtype);
+            jcur = hk_tx_append_jentry(jcur, jstart, jend, &op_je);
+        }
+        traverse_tx_info(ji, slotid, info)
+        {
+            if (ji->valid) {
+                jcur = hk_tx_append_jentry(jcur, jstart, jend, &ji->jentry);
             }
-            memcpy_to_pmem_nocache((void *)jcur, je, sizeof(struct hk_jentry));
-            jcur += sizeof(struct hk_jentry);
         }
     }
 
@@ -774,39 +1471,57 @@ static int hk_tx_cnt_args(enum hk_journal_type jtype)
     return cnt;
 }
 
-int hk_start_tx(struct super_block *sb, enum hk_journal_type jtype, ...)
+/* Claim an idle journal, the ones of this cpu first. Returns -1 if all of
+   them are taken. */
+static int hk_claim_journal(struct super_block *sb)
 {
-    va_list valist;
     struct hk_sb_info *sbi = HK_SB(sb);
-    struct hk_tx_info info;
+    int start = hk_get_cpuid(sb) * sbi->percore_jslots;
+    int i, txid;
+
+    for (i = 0; i < sbi->j_slots; i++) {
+        txid = (start + i) % sbi->j_slots;
+        if (!test_bit(txid, sbi->j_busy) && !test_and_set_bit_lock(txid, sbi->j_busy)) {
+            return txid;
+        }
+    }
+
+    return -1;
+}
+
+static void hk_release_journal(struct super_block *sb, int txid)
+{
+    struct hk_sb_info *sbi = HK_SB(sb);
+
+    clear_bit_unlock(txid, sbi->j_busy);
+    smp_mb__after_atomic();
+    if (waitqueue_active(&sbi->j_wq)) {
+        wake_up(&sbi->j_wq);
+    }
+}
+
+static void hk_build_tx_info(struct super_block *sb, struct hk_tx_info *info,
+                             enum hk_journal_type jtype, va_list valist)
+{
     struct hk_jentry_info *ji;
     enum hk_ji_obj_type ji_obj_type;
     struct hk_inode *pi;
     struct hk_dentry *pd;
-    struct hk_journal *jnl;
-    bool journal_started = false;
-    int txid_cmt = -1;
-    int i, txid, start_txid;
+    int i;
     int objs_cnt;
 
-    if (jtype == IDLE) {
-        return -1;
-    }
-
-    /* Build tx info*/
     objs_cnt = hk_tx_cnt_args(jtype);
-    va_start(valist, objs_cnt);
 
     /* invalid all entry */
     for (i = 0; i < HK_MAX_OBJ_INVOVED; i++) {
-        ji = hk_tx_get_ji_from_tx_info(&info, (enum hk_ji_obj_type)i);
+        ji = hk_tx_get_ji_from_tx_info(info, (enum hk_ji_obj_type)i);
         ji->valid = false;
     }
 
     /* valid specific entry */
     for (i = 0; i < objs_cnt; i++) {
         ji_obj_type = hk_tx_args_map[jtype][i];
-        ji = hk_tx_get_ji_from_tx_info(&info, ji_obj_type);
+        ji = hk_tx_get_ji_from_tx_info(info, ji_obj_type);
         ji->valid = true;
         if (hk_tx_obj_is_inode(ji_obj_type)) {
             pi = va_arg(valist, struct hk_inode *);
@@ -820,50 +1535,146 @@ int hk_start_tx(struct super_block *sb, enum hk_journal_type jtype, ...)
     }
 
     /* assign journal type */
-    info.jtype = jtype;
-
-    /* find a journal to append txinfo */
-    while (!journal_started) {
-        txid = hk_get_cpuid(sb) * HK_PERCORE_JSLOTS;
-        start_txid = txid;
-        do {
-            jnl = hk_get_journal_by_txid(sb, txid);
-            use_journal(sb, txid);
-            if (jnl->jhdr.jtype == IDLE) {
-                do_start_tx(sb, txid, &info);
-                txid_cmt = txid;
-                journal_started = true;
-                unuse_journal(sb, txid);
-                break;
+    info->jtype = jtype;
+}
+
+/* Build the tx info of one op without journaling it, see hk_start_compound_tx */
+int hk_prepare_tx(struct super_block *sb, struct hk_tx_info *info, enum hk_journal_type jtype, ...)
+{
+    va_list valist;
+
+    if (jtype == IDLE || jtype == COMPOUND) {
+        return -1;
+    }
+
+    va_start(valist, jtype);
+    hk_build_tx_info(sb, info, jtype, valist);
+    va_end(valist);
+
+    return 0;
+}
+
+/* If the inode of ji is journaled by an op of infos in front of it */
+static bool hk_tx_inode_seen(struct hk_tx_info *infos, int opid, struct hk_jentry_info *ji)
+{
+    struct hk_jentry_info *prev;
+    int i, slotid;
+
+    for (i = 0; i <= opid; i++) {
+        traverse_tx_info(prev, slotid, &infos[i])
+        {
+            if (prev == ji) {
+                return false;
             }
-            unuse_journal(sb, txid);
-            txid = (txid + 1) % sbi->j_slots;
-        } while (txid != start_txid);
+            if (prev->valid && prev->jentry.type == J_INODE && prev->jentry.data == ji->jentry.data) {
+                return true;
+            }
+        }
     }
 
-out:
+    return false;
+}
+
+/* Hold the attr logs of the inodes in infos until hk_finish_tx, so that none
+   is evicted under an open snapshot, and snapshot each inode once to revert
+   to the state before all the ops */
+static void hk_tx_hold_attr_logs(struct super_block *sb, struct hk_tx_info *infos, int nr)
+{
+    struct hk_sb_info *sbi = HK_SB(sb);
+    struct hk_jentry_info *ji;
+    struct hk_inode *pi;
+    int i, slotid;
+
+    for (i = 0; i < nr; i++) {
+        traverse_tx_info(ji, slotid, &infos[i])
+        {
+            if (!ji->valid || ji->jentry.type != J_INODE) {
+                continue;
+            }
+            pi = TRANS_OFS_TO_ADDR(sbi, ji->jentry.data);
+            hk_alloc_attr_log(sb, le64_to_cpu(pi->ino));
+            if (!hk_tx_inode_seen(infos, i, ji)) {
+                hk_create_al_snapshot(sb, pi);
+            }
+        }
+    }
+}
+
+/* Journal `nr` prepared ops as one transaction, finished by one hk_finish_tx */
+int hk_start_compound_tx(struct super_block *sb, struct hk_tx_info *infos, int nr)
+{
+    struct hk_sb_info *sbi = HK_SB(sb);
+    int txid;
+
+    if (nr <= 0 || nr > HK_TX_BATCH_OPS) {
+        return -1;
+    }
+
+    /* the ops commit to the inodes they journal, whose attr logs are held
+       then, so a tx never waits for a slot while it holds a journal */
+    hk_tx_hold_attr_logs(sb, infos, nr);
+
+    /* find a journal to append txinfo, sleep if all of them are taken */
+    wait_event(sbi->j_wq, (txid = hk_claim_journal(sb)) >= 0);
+    do_start_tx(sb, txid, infos, nr);
+
+    return txid;
+}
+
+int hk_start_tx(struct super_block *sb, enum hk_journal_type jtype, ...)
+{
+    va_list valist;
+    struct hk_tx_info info;
+
+    if (jtype == IDLE || jtype == COMPOUND) {
+        return -1;
+    }
+
+    /* Build tx info*/
+    va_start(valist, jtype);
+    hk_build_tx_info(sb, &info, jtype, valist);
     va_end(valist);
-    return txid_cmt;
+
+    return hk_start_compound_tx(sb, &info, 1);
 }
 
-int hk_finish_tx(struct super_block *sb, int txid)
+/* Drop a journal undone by recovery, whose attr logs nobody holds */
+int hk_discard_tx(struct super_block *sb, int txid)
 {
     struct hk_sb_info *sbi = HK_SB(sb);
     struct hk_journal *jnl;
     unsigned long irq_flags = 0;
 
     jnl = hk_get_journal_by_txid(sb, txid);
-    use_journal(sb, txid);
     hk_memunlock_journal(sb, jnl, &irq_flags);
     jnl->jhdr.jtype = IDLE;
     jnl->jhdr.jofs_head = jnl->jhdr.jofs_tail;
     hk_flush_buffer(jnl, sizeof(struct hk_jheader), true);
     hk_memlock_journal(sb, jnl, &irq_flags);
-    unuse_journal(sb, txid);
+    hk_release_journal(sb, txid);
 
     return 0;
 }
 
+int hk_finish_tx(struct super_block *sb, int txid)
+{
+    struct hk_sb_info *sbi = HK_SB(sb);
+    struct hk_journal *jnl = hk_get_journal_by_txid(sb, txid);
+    struct hk_jentry *jcur;
+    struct hk_inode *pi;
+
+    /* drop the holds of hk_tx_hold_attr_logs, one per journaled inode */
+    traverse_journal_entry(sbi, jcur, jnl)
+    {
+        if (jcur->type == J_INODE) {
+            pi = TRANS_OFS_TO_ADDR(sbi, jcur->data);
+            hk_put_attr_log(sb, le64_to_cpu(pi->ino));
+        }
+    }
+
+    return hk_discard_tx(sb, txid);
+}
+
 int hk_reinit_journal(struct super_block *sb, struct hk_journal *jnl)
 {
     struct hk_sb_info *sbi = HK_SB(sb);
@@ -16,11 +16,33 @@ struct hk_header {
     u32 cmtime;
     u32 crc32;
     u8 valid;        // 8B atomic persistence
-    u8 paddings[15]; // Padding to make it 64B
+    u32 run;         // Blocks covered from this one (CONFIG_EXTENT_HDR)
+    u8 paddings[11]; // Padding to make it 64B
 } __attribute((__packed__));
 
 static_assert(sizeof(struct hk_header) == 64, "hk_header size mismatch");
 
+/* Gathers PM metadata writes by XPLine (PM_ACCESS_GRANU, the media write unit),
+   so that the cachelines of one XPLine are written back together */
+struct hk_xpline_wc {
+    struct super_block *sb;
+    u64 base; /* XPLine being gathered, 0 if none */
+    u8 dirty; /* bitmap of its dirty cachelines */
+    /* headers waiting for their crc32, checksummed HK_CRC_LANES at a time */
+    struct hk_header *unsealed[HK_CRC_LANES];
+    int nr_unsealed;
+};
+
+/* Number of contiguous blocks described by hdr, starting from its own block */
+static inline u32 sm_hdr_run(struct hk_header *hdr)
+{
+#ifdef CONFIG_EXTENT_HDR
+    return hdr->run > 1 ? hdr->run : 1;
+#else
+    return 1;
+#endif
+}
+
 struct hk_setattr_entry {
     __le16 mode;
     __le32 uid;
@@ -41,6 +63,7 @@ struct hk_linkchange_entry {
 enum hk_entry_type {
     SET_ATTR,
     LINK_CHANGE,
+    MAX_AL_ENTRY_TYPE
 };
 
 struct hk_al_entry {
@@ -137,6 +160,7 @@ struct hk_jinode {
 enum hk_jentry_type {
     J_INODE,
     J_DENTRY,
+    J_OP, /* starts an op of a COMPOUND record, data is its jtype */
 };
 
 struct hk_jentry {
@@ -151,7 +175,8 @@ enum hk_journal_type {
     LINK,
     SYMLINK,
     UNLINK,
-    RENAME
+    RENAME,
+    COMPOUND /* several of the above, see do_start_tx */
 };
 
 struct hk_jheader {
@@ -192,7 +217,7 @@ struct hk_tx_info {
 
 #define traverse_tx_info(ji, slotid, info) for (ji = &info->ji_pi, slotid = 0; slotid < HK_MAX_OBJ_INVOVED; slotid++, ji = hk_tx_get_ji_from_tx_info(info, slotid))
 
-#define traverse_journal_entry(sbi, jcur, jnl) for (jcur = TRANS_OFS_TO_ADDR(sbi, jnl->jhdr.jofs_head); jcur != TRANS_OFS_TO_ADDR(sbi, jnl->jhdr.jofs_tail); jcur = jcur + sizeof(struct hk_jentry) > TRANS_OFS_TO_ADDR(sbi, jnl->jhdr.jofs_end) ? TRANS_OFS_TO_ADDR(sbi, jnl->jhdr.jofs_start) + sizeof(struct hk_jentry) : jcur + sizeof(struct hk_jentry))
+#define traverse_journal_entry(sbi, jcur, jnl) for (jcur = TRANS_OFS_TO_ADDR(sbi, jnl->jhdr.jofs_head); jcur != TRANS_OFS_TO_ADDR(sbi, jnl->jhdr.jofs_tail); jcur = jcur + 2 * sizeof(struct hk_jentry) > TRANS_OFS_TO_ADDR(sbi, jnl->jhdr.jofs_end) ? TRANS_OFS_TO_ADDR(sbi, jnl->jhdr.jofs_start) : jcur + sizeof(struct hk_jentry))
 
 static void hk_dump_jentry(struct super_block *sb, struct hk_jentry *je)
 {
@@ -203,6 +228,9 @@ static void hk_dump_jentry(struct super_block *sb, struct hk_jentry *je)
     case J_DENTRY:
         hk_info("J_DENTRY: data @ %llx\n", le64_to_cpu(je->data));
         break;
+    case J_OP:
+        hk_info("J_OP: jtype %llu\n", le64_to_cpu(je->data));
+        break;
     }
 }
 
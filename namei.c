@@ -19,63 +19,299 @@
 
 struct hk_dentry *hk_dentry_by_ix_from_blk(u64 blk_addr, u16 ix)
 {
-    return (struct hk_dentry *)(blk_addr + ix * sizeof(struct hk_dentry));
+    return (struct hk_dentry *)(blk_addr + ix * HK_DENTRY_UNIT);
+}
+
+static struct hlist_head *hk_alloc_dir_buckets(u32 bits)
+{
+    struct hlist_head *buckets;
+    u32 i;
+
+    buckets = kvmalloc_array(1U << bits, sizeof(struct hlist_head), GFP_KERNEL);
+    if (!buckets)
+        return NULL;
+    for (i = 0; i < (1U << bits); i++)
+        INIT_HLIST_HEAD(&buckets[i]);
+    return buckets;
+}
+
+static inline u32 hk_dir_bloom_bit(u32 hash, int i, u32 bits)
+{
+    /* double hashing, the second hash must be odd */
+    return hash_32(hash + i * (ror32(hash, 16) | 1), bits);
+}
+
+static void __hk_dir_bloom_add(unsigned long *bloom, u32 bits, u32 hash)
+{
+    int i;
+
+    if (!bloom)
+        return;
+    for (i = 0; i < HK_DIR_BLOOM_HASHES; i++)
+        __set_bit(hk_dir_bloom_bit(hash, i, bits), bloom);
+}
+
+/* a filter being refilled gets the name as well */
+static void hk_dir_bloom_add(struct hk_dir_table *dt, u32 hash)
+{
+    __hk_dir_bloom_add(dt->bloom, dt->bloom_bits, hash);
+    __hk_dir_bloom_add(dt->next_bloom, dt->next_bloom_bits, hash);
+}
+
+/* false if the name is surely not in the directory */
+static bool hk_dir_bloom_test(struct hk_dir_table *dt, u32 hash)
+{
+    int i;
+
+    if (!dt->bloom)
+        return true;
+    for (i = 0; i < HK_DIR_BLOOM_HASHES; i++) {
+        if (!test_bit(hk_dir_bloom_bit(hash, i, dt->bloom_bits), dt->bloom))
+            return false;
+    }
+    return true;
+}
+
+/* Start refilling a filter sized to the table. Names are set in it as old
+   buckets are migrated, or as buckets are walked if not resizing, and the
+   current filter answers until it is complete. On failure the current one,
+   which does not depend on the table size, is kept. */
+static void hk_dir_bloom_start(struct hk_dir_table *dt)
+{
+    kvfree(dt->next_bloom);
+    dt->next_bloom_bits = dt->bits + HK_DIR_BLOOM_SHIFT;
+    dt->next_bloom = kvcalloc(BITS_TO_LONGS(1UL << dt->next_bloom_bits), sizeof(unsigned long), GFP_KERNEL);
+    dt->bloom_refilled = 0;
+}
+
+static void hk_dir_bloom_finish(struct hk_dir_table *dt)
+{
+    if (!dt->next_bloom)
+        return;
+    kvfree(dt->bloom);
+    dt->bloom = dt->next_bloom;
+    dt->bloom_bits = dt->next_bloom_bits;
+    dt->next_bloom = NULL;
+    dt->bloom_stale = 0;
+}
+
+/* Walk a few buckets into a filter refilled without resizing */
+static void hk_dir_bloom_refill(struct hk_dir_table *dt)
+{
+    struct hk_dentry_info *di;
+    u32 n;
+
+    for (n = 0; n < HK_DIR_TABLE_MIGRATE && dt->bloom_refilled < (1U << dt->bits); n++) {
+        hlist_for_each_entry(di, &dt->buckets[dt->bloom_refilled], node)
+            __hk_dir_bloom_add(dt->next_bloom, dt->next_bloom_bits, di->hash);
+        dt->bloom_refilled++;
+    }
+
+    if (dt->bloom_refilled == (1U << dt->bits))
+        hk_dir_bloom_finish(dt);
+}
+
+struct hk_dir_table *hk_alloc_dir_table(void)
+{
+    struct hk_dir_table *dt;
+
+    dt = kzalloc(sizeof(struct hk_dir_table), GFP_KERNEL);
+    if (!dt)
+        return NULL;
+    dt->bits = HK_DIR_TABLE_MIN_BITS;
+    dt->buckets = hk_alloc_dir_buckets(dt->bits);
+    if (!dt->buckets) {
+        kfree(dt);
+        return NULL;
+    }
+    xa_init(&dt->blks);
+    xa_init(&dt->index_blks);
+    /* nothing to refill yet */
+    hk_dir_bloom_start(dt);
+    hk_dir_bloom_finish(dt);
+    return dt;
+}
+
+/* buckets of the old table are used until they are migrated */
+static struct hlist_head *hk_dir_table_bucket(struct hk_dir_table *dt, unsigned long hash)
+{
+    u32 bkt;
+
+    if (dt->old_buckets) {
+        bkt = hash_long(hash, dt->old_bits);
+        if (bkt >= dt->migrated)
+            return &dt->old_buckets[bkt];
+    }
+    return &dt->buckets[hash_long(hash, dt->bits)];
+}
+
+/* Start a resize if the load is out of range, and move a few old buckets if
+   resizing. The filter is refilled the same way. Called under the dir lock
+   after each insert and remove. */
+static void hk_dir_table_rehash(struct hk_dir_table *dt)
+{
+    struct hk_dentry_info *di;
+    struct hlist_node *tmp;
+    struct hlist_head *buckets;
+    u32 bits, n;
+
+    if (!dt->old_buckets) {
+        if (dt->nr_entries > ((u64)HK_DIR_TABLE_MAX_LOAD << dt->bits))
+            bits = dt->bits + 1;
+        else if (dt->bits > HK_DIR_TABLE_MIN_BITS && (dt->nr_entries << 2) < (1ULL << dt->bits))
+            bits = dt->bits - 1;
+        else
+            goto refill;
+
+        /* keep the current size on failure, and retry at the next op */
+        buckets = hk_alloc_dir_buckets(bits);
+        if (!buckets)
+            return;
+
+        dt->old_buckets = dt->buckets;
+        dt->old_bits = dt->bits;
+        dt->migrated = 0;
+        dt->buckets = buckets;
+        dt->bits = bits;
+        /* the new table is empty, all names come through the migration */
+        hk_dir_bloom_start(dt);
+        HK_STATS_ADD(dir_table_resizes, 1);
+    }
+
+    for (n = 0; n < HK_DIR_TABLE_MIGRATE && dt->migrated < (1U << dt->old_bits); n++) {
+        hlist_for_each_entry_safe(di, tmp, &dt->old_buckets[dt->migrated], node)
+        {
+            hlist_del(&di->node);
+            hlist_add_head(&di->node, &dt->buckets[hash_long(di->hash, dt->bits)]);
+            __hk_dir_bloom_add(dt->next_bloom, dt->next_bloom_bits, di->hash);
+        }
+        dt->migrated++;
+    }
+
+    if (dt->migrated == (1U << dt->old_bits)) {
+        kvfree(dt->old_buckets);
+        dt->old_buckets = NULL;
+        hk_dir_bloom_finish(dt);
+    }
+    return;
+
+refill:
+    if (dt->next_bloom)
+        hk_dir_bloom_refill(dt);
+}
+
+/* Compare in DRAM first. Names no longer than the prefix never touch PM. */
+static inline bool hk_dentry_info_match(struct hk_dentry_info *di, u32 hash, const char *name, int namelen)
+{
+    if (di->hash != hash || di->name_len != namelen)
+        return false;
+    if (memcmp(di->prefix, name, min(namelen, HK_DENTRY_PREFIX_LEN)) != 0)
+        return false;
+    if (namelen <= HK_DENTRY_PREFIX_LEN)
+        return true;
+    return memcmp(di->direntry->name + HK_DENTRY_PREFIX_LEN, name + HK_DENTRY_PREFIX_LEN,
+                  namelen - HK_DENTRY_PREFIX_LEN) == 0;
 }
 
 struct hk_dentry_info *hk_search_dir_table(struct super_block *sb, struct hk_inode_info_header *sih, const char *name, int namelen)
 {
     struct hk_dentry_info *cur = NULL;
-    unsigned long hash;
+    u32 hash;
+
+    hash = hk_name_hash(name, namelen);
 
-    hash = BKDRHash(name, namelen);
+    if (!hk_dir_bloom_test(sih->dirs, hash)) {
+        HK_STATS_ADD(dir_bloom_negatives, 1);
+        return NULL;
+    }
 
-    hash_for_each_possible_bits(sih->dirs, HK_HASH_BITS, cur, node, hash)
+    hlist_for_each_entry(cur, hk_dir_table_bucket(sih->dirs, hash), node)
     {
-        if (strcmp(cur->direntry->name, name) == 0) {
+        if (hk_dentry_info_match(cur, hash, name, namelen)) {
             break;
         }
     }
 
+    if (!cur && sih->dirs->bloom) {
+        HK_STATS_ADD(dir_bloom_false_pos, 1);
+    }
+
     return cur;
 }
 
-int hk_insert_dir_table(struct super_block *sb, struct hk_inode_info_header *sih, const char *name,
-                        int namelen, struct hk_dentry *direntry)
+/* `prefix` holds the first HK_DENTRY_PREFIX_LEN bytes of the name at most */
+static int __hk_insert_dir_table(struct hk_inode_info_header *sih, u32 hash, const char *prefix,
+                                 int namelen, struct hk_dentry *direntry, u64 blk)
 {
     struct hk_dentry_info *di;
-    /* Insert into hash table */
+
     di = hk_alloc_hk_dentry_info();
     if (!di)
         return -ENOMEM;
-    di->hash = BKDRHash(name, namelen);
+    di->hash = hash;
+    di->name_len = namelen;
+    memcpy(di->prefix, prefix, min(namelen, HK_DENTRY_PREFIX_LEN));
     di->direntry = direntry;
-    hk_dbgv("%s: insert %s hash %lu\n", __func__, name, di->hash);
-    hash_add_bits(sih->dirs, HK_HASH_BITS, &di->node, di->hash);
+    di->blk = blk;
+    hlist_add_head(&di->node, hk_dir_table_bucket(sih->dirs, di->hash));
+    sih->dirs->nr_entries++;
+    hk_dir_bloom_add(sih->dirs, di->hash);
+    hk_dir_table_rehash(sih->dirs);
+    return 0;
+}
+
+int hk_insert_dir_table(struct super_block *sb, struct hk_inode_info_header *sih, const char *name,
+                        int namelen, struct hk_dentry *direntry, u64 blk)
+{
+    u32 hash = hk_name_hash(name, namelen);
+
+    /* Insert into hash table */
+    hk_dbgv("%s: insert %s hash %u\n", __func__, name, hash);
+    return __hk_insert_dir_table(sih, hash, name, namelen, direntry, blk);
 }
 
 int hk_update_dir_table(struct super_block *sb, struct hk_inode_info_header *sih, const char *name,
-                        int namelen, struct hk_dentry *direntry)
+                        int namelen, struct hk_dentry *direntry, u64 blk)
 {
     struct hk_dentry_info *di;
     di = hk_search_dir_table(sb, sih, name, namelen);
     if (!di)
         return -ENOENT;
     di->direntry = direntry;
-    hk_dbgv("%s: update %s hash %lu\n", __func__, name, di->hash);
+    di->blk = blk;
+    hk_dbgv("%s: update %s hash %u\n", __func__, name, di->hash);
     return 0;
 }
 
 void hk_destory_dir_table(struct super_block *sb, struct hk_inode_info_header *sih)
 {
+    struct hk_dir_table *dt = sih->dirs;
     struct hk_dentry_info *di;
     struct hlist_node *tmp;
-    int bkt;
-
-    hash_for_each_safe_bits(sih->dirs, HK_HASH_BITS, bkt, tmp, di, node)
-    {
-        hash_del(&di->node);
-        hk_free_hk_dentry_info(di);
+    int old;
+    u32 bkt;
+
+    if (!dt)
+        return;
+
+    for (old = 1; old >= 0; old--) {
+        for (bkt = 0; bkt < hk_dir_table_size(dt, old); bkt++) {
+            hlist_for_each_entry_safe(di, tmp, &hk_dir_table_buckets(dt, old)[bkt], node)
+            {
+                hlist_del(&di->node);
+                hk_free_hk_dentry_info(di);
+            }
+        }
     }
+
+    kvfree(dt->bloom);
+    kvfree(dt->next_bloom);
+    kvfree(dt->old_buckets);
+    kvfree(dt->buckets);
+    xa_destroy(&dt->blks);
+    xa_destroy(&dt->index_blks);
+    kfree(dt);
+    sih->dirs = NULL;
 }
 
 void hk_remove_dir_table(struct super_block *sb, struct hk_inode_info_header *sih,
@@ -83,15 +319,20 @@ void hk_remove_dir_table(struct super_block *sb, struct hk_inode_info_header *si
 {
     struct hk_dentry_info *di;
     struct hlist_node *tmp;
-    unsigned long hash;
+    u32 hash;
 
-    hash = BKDRHash(name, namelen);
+    hash = hk_name_hash(name, namelen);
 
-    hash_for_each_possible_safe_bits(sih->dirs, HK_HASH_BITS, di, tmp, node, hash)
+    hlist_for_each_entry_safe(di, tmp, hk_dir_table_bucket(sih->dirs, hash), node)
     {
-        if (strcmp(di->direntry->name, name) == 0) {
-            hash_del(&di->node);
+        if (hk_dentry_info_match(di, hash, name, namelen)) {
+            hlist_del(&di->node);
             hk_free_hk_dentry_info(di);
+            sih->dirs->nr_entries--;
+            /* a resize refills the filter anyway */
+            if (++sih->dirs->bloom_stale > (1ULL << sih->dirs->bits) && !sih->dirs->next_bloom)
+                hk_dir_bloom_start(sih->dirs);
+            hk_dir_table_rehash(sih->dirs);
             break;
         }
     }
@@ -122,25 +363,562 @@ static ino_t hk_inode_by_name(struct inode *dir, struct qstr *entry,
     return di->direntry->ino;
 }
 
+/* ======== Dentry slots ======== */
+/* The FREE mark is cleared by hk_dir_find_slot once the block is found full */
+void hk_dir_set_blk(struct hk_inode_info_header *sih, u64 blk, unsigned long live)
+{
+    struct hk_dir_table *dt = sih->dirs;
+
+    xa_store(&dt->blks, blk, xa_mk_value(live), GFP_KERNEL);
+    xa_clear_mark(&dt->blks, blk, HK_DIR_BLK_HOLE);
+    xa_set_mark(&dt->blks, blk, HK_DIR_BLK_FREE);
+    if (hweight_long(live) <= HK_DIR_COMPACT_LIVE)
+        xa_set_mark(&dt->blks, blk, HK_DIR_BLK_SPARSE);
+    else
+        xa_clear_mark(&dt->blks, blk, HK_DIR_BLK_SPARSE);
+
+    if (blk >= dt->nr_blks)
+        dt->nr_blks = blk + 1;
+}
+
+static inline unsigned long hk_dir_get_blk(struct hk_inode_info_header *sih, u64 blk)
+{
+    return xa_to_value(xa_load(&sih->dirs->blks, blk));
+}
+
+/* Blocks are rebuilt in any order, record the indexes left unused */
+void hk_dir_fill_holes(struct hk_inode_info_header *sih)
+{
+    struct hk_dir_table *dt = sih->dirs;
+    u64 blk;
+
+    for (blk = 0; blk < dt->nr_blks; blk++) {
+        if (!xa_load(&dt->blks, blk) && !xa_load(&dt->index_blks, blk)) {
+            xa_store(&dt->blks, blk, xa_mk_value(0), GFP_KERNEL);
+            xa_set_mark(&dt->blks, blk, HK_DIR_BLK_HOLE);
+            dt->nr_holes++;
+        }
+    }
+}
+
+/* No unfinished tx points to a dentry of the dir */
+bool hk_dir_settled(struct hk_inode_info_header *sih)
+{
+#ifdef CONFIG_CMT_BACKGROUND
+    return atomic_read(&sih->cmt_node->ns_inflight) == 0;
+#else
+    return true;
+#endif
+}
+
+/* The tx removing the dentry is finished, so that its slot can be reused */
+void hk_reclaim_dentry(struct super_block *sb, struct hk_dentry *direntry)
+{
+    unsigned long irq_flags = 0;
+
+    hk_memunlock_dentry(sb, direntry, &irq_flags);
+    direntry->name_len = 0;
+    hk_memlock_dentry(sb, direntry, &irq_flags);
+    hk_flush_buffer(direntry, CACHELINE_SIZE, false);
+}
+
+/* If a dentry of `units` fits at unit ix. A two-unit dentry or a free pair
+   is taken or freed as a whole, and a pair is split for one-unit dentries.
+   Units keep their name_len until the tx removing them is finished. */
+static bool hk_dir_slot_free(struct super_block *sb, u64 blk_addr, unsigned long live, u16 ix, int units)
+{
+    struct hk_dentry *head = hk_dentry_by_ix_from_blk(blk_addr, ix & ~1);
+    struct hk_dentry *tail = hk_dentry_by_ix_from_blk(blk_addr, ix | 1);
+    bool pair = hk_dentry_units(sb, head) == 2;
+
+    /* reclaimed by cmt workers without the dir lock */
+    if (units == 2 || pair) {
+        return !(live & (3UL << (ix & ~1))) && READ_ONCE(head->name_len) == 0 &&
+               (pair || READ_ONCE(tail->name_len) == 0);
+    }
+    return ix < HK_DENTRY_SLOTS && !(live & (1UL << ix)) &&
+           READ_ONCE(hk_dentry_by_ix_from_blk(blk_addr, ix)->name_len) == 0;
+}
+
+/* Find a free slot of `units` in blocks other than `skip`. Blocks whose free
+   slots still wait for their txs are probed at most HK_DIR_SLOT_PROBES times. */
+static bool hk_dir_find_slot(struct super_block *sb, struct hk_inode_info_header *sih,
+                             u64 skip, int units, u64 *blk, u16 *ix)
+{
+    struct hk_sb_info *sbi = HK_SB(sb);
+    struct hk_dir_table *dt = sih->dirs;
+    unsigned long idx = dt->hint;
+    struct hk_dentry *direntry;
+    bool wrapped = false;
+    bool pending;
+    u64 blk_addr;
+    void *entry;
+    unsigned long live;
+    int probes = 0;
+    u16 i;
+
+    while (probes < HK_DIR_SLOT_PROBES) {
+        entry = xa_find(&dt->blks, &idx, ULONG_MAX, HK_DIR_BLK_FREE);
+        if (!entry) {
+            if (wrapped)
+                break;
+            wrapped = true;
+            idx = 0;
+            continue;
+        }
+        if (wrapped && idx >= dt->hint)
+            break;
+        if (idx == skip) {
+            idx++;
+            continue;
+        }
+
+        probes++;
+        live = xa_to_value(entry);
+        blk_addr = TRANS_OFS_TO_ADDR(sbi, linix_get(&sih->ix, idx));
+        pending = false;
+        for (i = 0; i < HK_DENTRY_SLOTS; i += units) {
+            if (hk_dir_slot_free(sb, blk_addr, live, i, units)) {
+                dt->hint = idx;
+                *blk = idx;
+                *ix = i;
+                return true;
+            }
+            direntry = hk_dentry_by_ix_from_blk(blk_addr, i);
+            if (!(live & (1UL << i)) && READ_ONCE(direntry->name_len))
+                pending = true;
+        }
+        /* nothing to wait for, until a dentry of the block is removed */
+        if (!pending && units == 1)
+            xa_clear_mark(&dt->blks, idx, HK_DIR_BLK_FREE);
+        idx++;
+    }
+
+    return false;
+}
+
+/* Write a dentry at unit ix of a dir block, splitting a free pair for a
+   one-unit dentry or merging two free units for a two-unit one first. The
+   caller flushes the dentry. */
+static struct hk_dentry *hk_dir_fill_slot(struct super_block *sb, u64 blk_addr, u16 ix, u64 ino,
+                                          const char *name, int namelen, __le32 mtime,
+                                          __le16 links_count, u8 file_type)
+{
+    struct hk_sb_info *sbi = HK_SB(sb);
+    struct hk_dentry *direntry = hk_dentry_by_ix_from_blk(blk_addr, ix);
+    struct hk_dentry *half;
+    unsigned long irq_flags = 0;
+    int units = hk_dentry_units_for(sb, namelen);
+    int i;
+
+    if (units == 1 && hk_dentry_units(sb, hk_dentry_by_ix_from_blk(blk_addr, ix & ~1)) == 2) {
+        /* the tail of the pair holds stale name bytes, make it a free unit
+           before the head stops covering it, so that a crash in between
+           never exposes those bytes as a dentry */
+        for (i = ix | 1; i >= (ix & ~1); i--) {
+            half = hk_dentry_by_ix_from_blk(blk_addr, i);
+            hk_memunlock_dentry(sb, half, &irq_flags);
+            half->valid = 0;
+            half->name_len = 0;
+            half->units = 1;
+            hk_memlock_dentry(sb, half, &irq_flags);
+            hk_flush_buffer(half, CACHELINE_SIZE, true);
+        }
+    } else if (units == 2 && hk_dentry_units(sb, direntry) == 1) {
+        /* the name runs over the header of the tail, which must not be
+           walked into before the head covers it */
+        hk_memunlock_dentry(sb, direntry, &irq_flags);
+        direntry->valid = 0;
+        direntry->name_len = 0;
+        direntry->units = 2;
+        hk_memlock_dentry(sb, direntry, &irq_flags);
+        hk_flush_buffer(direntry, CACHELINE_SIZE, true);
+    }
+
+    hk_memunlock_dentry(sb, direntry, &irq_flags);
+    direntry->ino = cpu_to_le64(ino);
+    direntry->name_len = namelen;
+    hk_memcpy_to_pmem(direntry->name, name, namelen);
+    direntry->name[namelen] = '\0';
+    direntry->mtime = mtime;
+    direntry->links_count = links_count;
+    direntry->file_type = file_type;
+    direntry->units = units;
+    direntry->tstamp = get_version(sbi);
+    direntry->valid = 1;
+    hk_memlock_dentry(sb, direntry, &irq_flags);
+
+    return direntry;
+}
+
+/* Index for a new dir block, reusing the hole left by compaction if any */
+static u64 hk_dir_new_blk(struct hk_inode_info_header *sih)
+{
+    struct hk_dir_table *dt = sih->dirs;
+    unsigned long idx = 0;
+
+    if (xa_find(&dt->blks, &idx, ULONG_MAX, HK_DIR_BLK_HOLE)) {
+        dt->nr_holes--;
+        return idx;
+    }
+    return dt->nr_blks;
+}
+
+/* PM block for a new dir block, which is made a block of the dir by
+   hk_dir_commit_blk once written */
+static u64 hk_dir_prepare_blk(struct super_block *sb)
+{
+    struct hk_layout_preps preps;
+    struct hk_layout_prep *prep = NULL;
+    struct hk_layout_prep tmp_prep;
+
+    hk_prepare_layouts(sb, 1, true, &preps);
+    hk_trv_prepared_layouts_init(&preps);
+    prep = hk_trv_prepared_layouts(sb, &preps);
+    if (!prep) {
+        hk_dbg("%s: ERROR: No prep found\n", __func__);
+        hk_prepare_gap(sb, true, &tmp_prep);
+        if (tmp_prep.target_addr == 0) {
+            hk_dbgv("%s: prepare layout failed\n", __func__);
+            BUG_ON(1);
+            return 0;
+        }
+        return tmp_prep.target_addr;
+    }
+    return prep->target_addr;
+}
+
+static void hk_dir_commit_blk(struct super_block *sb, struct inode *dir, u64 blk, u64 blk_addr)
+{
+    struct hk_sb_info *sbi = HK_SB(sb);
+    struct hk_inode_info_header *sih = HK_IH(dir);
+    struct hk_cmt_dbatch dbatch;
+
+    hk_init_and_inc_cmt_dbatch(&dbatch, blk_addr, blk, 1);
+    use_layout_for_addr(sb, blk_addr);
+    sm_valid_data_sync(sb, sm_get_prev_addr_by_dbatch(sb, sih, &dbatch), blk_addr, sm_get_next_addr_by_dbatch(sb, sih, &dbatch),
+                       sih->cmt_node, blk, get_version(sbi), 1, dir->i_ctime.tv_sec);
+    unuse_layout_for_addr(sb, blk_addr);
+
+    linix_insert(&sih->ix, blk, blk_addr, true);
+}
+
+static void hk_dir_free_blk(struct super_block *sb, struct inode *dir, u64 blk)
+{
+    struct hk_sb_info *sbi = HK_SB(sb);
+    struct hk_inode_info_header *sih = HK_IH(dir);
+    struct hk_dir_table *dt = sih->dirs;
+    struct hk_cmt_dbatch dbatch;
+    u64 addr;
+
+    addr = TRANS_OFS_TO_ADDR(sbi, linix_get(&sih->ix, blk));
+    linix_delete(&sih->ix, blk, blk, false);
+    if (xa_erase(&dt->index_blks, blk))
+        dt->nr_index_blks--;
+
+    hk_init_and_inc_cmt_dbatch(&dbatch, addr, blk, 1);
+#ifdef CONFIG_CMT_BACKGROUND
+    hk_delegate_data_async(sb, dir, &dbatch, 0, CMT_INVALID_DATA);
+#else
+    use_layout_for_addr(sb, addr);
+    sm_invalid_data_sync(sb, sm_get_prev_addr_by_dbatch(sb, sih, &dbatch), addr, sih->cmt_node);
+    unuse_layout_for_addr(sb, addr);
+#endif
+
+    xa_store(&dt->blks, blk, xa_mk_value(0), GFP_KERNEL);
+    xa_clear_mark(&dt->blks, blk, HK_DIR_BLK_FREE);
+    xa_clear_mark(&dt->blks, blk, HK_DIR_BLK_SPARSE);
+    xa_set_mark(&dt->blks, blk, HK_DIR_BLK_HOLE);
+    dt->nr_holes++;
+    HK_STATS_ADD(dir_blks_freed, 1);
+}
+
+/* Move the dentries of one sparse block to free slots of the others, and
+   free it. Dentries are moved only if no unfinished tx points to them. A
+   crash in the middle leaves two valid copies, and rebuild keeps the newer. */
+static void hk_compact_dir(struct super_block *sb, struct inode *dir)
+{
+    struct hk_sb_info *sbi = HK_SB(sb);
+    struct hk_inode_info_header *sih = HK_IH(dir);
+    struct hk_dir_table *dt = sih->dirs;
+    struct hk_dentry *src, *dst;
+    unsigned long idx = 0;
+    unsigned long irq_flags = 0;
+    u64 src_addr, nr_live_blks;
+    u64 blk;
+    unsigned long live;
+    u16 i, ix;
+
+    if (!hk_dir_settled(sih) || atomic_read(&dt->nr_listing))
+        return;
+
+    if (!xa_find(&dt->blks, &idx, ULONG_MAX, HK_DIR_BLK_SPARSE))
+        return;
+    live = hk_dir_get_blk(sih, idx);
+
+    /* keep a block of free slots, so that the next creates do not refill it */
+    nr_live_blks = dt->nr_blks - dt->nr_holes - dt->nr_index_blks;
+    if (live && (nr_live_blks - 1) * MAX_DENTRY_PER_BLK < dt->nr_entries + MAX_DENTRY_PER_BLK)
+        return;
+
+    src_addr = TRANS_OFS_TO_ADDR(sbi, linix_get(&sih->ix, idx));
+    for (i = 0; i < HK_DENTRY_SLOTS; i++) {
+        if (!(live & (1UL << i)))
+            continue;
+        src = hk_dentry_by_ix_from_blk(src_addr, i);
+        /* dentries written before packing are packed on the way */
+        if (!hk_dir_find_slot(sb, sih, idx, hk_dentry_units_for(sb, src->name_len), &blk, &ix))
+            break;
+
+        dst = hk_dir_fill_slot(sb, TRANS_OFS_TO_ADDR(sbi, linix_get(&sih->ix, blk)), ix,
+                               le64_to_cpu(src->ino), src->name, src->name_len,
+                               src->mtime, src->links_count, src->file_type);
+        hk_flush_buffer(dst, hk_dentry_units(sb, dst) * HK_DENTRY_UNIT, true);
+
+        hk_memunlock_dentry(sb, src, &irq_flags);
+        src->valid = 0;
+        src->name_len = 0;
+        hk_memlock_dentry(sb, src, &irq_flags);
+        hk_flush_buffer(src, CACHELINE_SIZE, false);
+
+        hk_update_dir_table(sb, sih, dst->name, dst->name_len, dst, blk);
+        hk_dir_set_blk(sih, blk, hk_dir_get_blk(sih, blk) | (1UL << ix));
+        live &= ~(1UL << i);
+        hk_dir_set_blk(sih, idx, live);
+        HK_STATS_ADD(dentries_compacted, 1);
+    }
+
+    if (live == 0)
+        hk_dir_free_blk(sb, dir, idx);
+}
+
+/* ======== Persistent index ======== */
+/* A dir with HK_DIR_INDEX_MIN entries or more checkpoints its DRAM index to
+   blocks of its own, chained from the inode, so that it is rebuilt without
+   reading and hashing its dentries. The index is dropped from the inode
+   before any dentry of the dir is changed, and written again on eviction
+   only: it is not kept up to date through the commit pipeline, so a dir
+   changed since it was last evicted is scanned after a crash. */
+static bool hk_dir_index_blk(u64 blk_addr, u64 ino)
+{
+    struct hk_dir_index_hdr *hdr = (struct hk_dir_index_hdr *)blk_addr;
+
+    return hdr->units == HK_DENTRY_UNITS_INDEX && le32_to_cpu(hdr->magic) == HK_DIR_INDEX_MAGIC &&
+           le64_to_cpu(hdr->ino) == ino;
+}
+
+static void hk_dir_set_index_blk(struct hk_inode_info_header *sih, u64 blk)
+{
+    struct hk_dir_table *dt = sih->dirs;
+
+    xa_erase(&dt->blks, blk);
+    xa_store(&dt->index_blks, blk, xa_mk_value(0), GFP_KERNEL);
+    dt->nr_index_blks++;
+
+    if (blk >= dt->nr_blks)
+        dt->nr_blks = blk + 1;
+}
+
+/* Index a block of the dir found by rebuild, whose dentries are read later */
+void hk_dir_register_blk(struct super_block *sb, struct hk_inode_info_header *sih, u64 f_blk)
+{
+    u64 blk_addr = TRANS_OFS_TO_ADDR(HK_SB(sb), linix_get(&sih->ix, f_blk));
+
+    if (hk_dir_index_blk(blk_addr, sih->ino))
+        hk_dir_set_index_blk(sih, f_blk);
+    else
+        hk_dir_set_blk(sih, f_blk, 0);
+}
+
+/* Blocks of a dropped index, or left by a checkpoint that crashed */
+static void hk_dir_index_free(struct super_block *sb, struct inode *dir)
+{
+    struct hk_dir_table *dt = HK_IH(dir)->dirs;
+    unsigned long idx;
+    void *entry;
+
+    xa_for_each(&dt->index_blks, idx, entry)
+        hk_dir_free_blk(sb, dir, idx);
+}
+
+static void hk_dir_index_drop(struct super_block *sb, struct inode *dir)
+{
+    struct hk_inode *pi = hk_get_pi_by_ino(sb, dir->i_ino);
+    unsigned long irq_flags = 0;
+
+    if (!pi->i_dindex)
+        return;
+
+    hk_memunlock_pi(sb, pi, &irq_flags);
+    pi->i_dindex = 0;
+    hk_memlock_pi(sb, pi, &irq_flags);
+    hk_flush_buffer(&pi->i_dindex, sizeof(pi->i_dindex), true);
+
+    hk_dir_index_free(sb, dir);
+}
+
+/* Write the header of an index block and make it a block of the dir.
+   Return the link to it, i.e., f_blk + 1. */
+static u64 hk_dir_index_seal(struct super_block *sb, struct inode *dir, u64 blk, u64 blk_addr,
+                             u16 nr_recs, u64 next)
+{
+    struct hk_dir_index_hdr hdr;
+    unsigned long irq_flags = 0;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.nr_recs = cpu_to_le16(nr_recs);
+    hdr.magic = cpu_to_le32(HK_DIR_INDEX_MAGIC);
+    hdr.ino = cpu_to_le64(dir->i_ino);
+    hdr.next = cpu_to_le64(next);
+    hdr.units = HK_DENTRY_UNITS_INDEX;
+
+    hk_memunlock_range(sb, (void *)blk_addr, sizeof(hdr), &irq_flags);
+    hk_memcpy_to_pmem((void *)blk_addr, &hdr, sizeof(hdr));
+    hk_memlock_range(sb, (void *)blk_addr, sizeof(hdr), &irq_flags);
+    /* rebuild would scan the block for dentries without the magic */
+    hk_flush_buffer((void *)blk_addr, HK_DENTRY_UNIT + nr_recs * sizeof(struct hk_dir_index_rec), true);
+
+    hk_dir_commit_blk(sb, dir, blk, blk_addr);
+    return blk + 1;
+}
+
+/* Called at eviction. The dir must be settled, so that no removed dentry
+   waits for reclaim when the index is current. */
+void hk_dir_index_checkpoint(struct super_block *sb, struct inode *dir)
+{
+    struct hk_inode_info_header *sih = HK_IH(dir);
+    struct hk_dir_table *dt = sih->dirs;
+    struct hk_inode *pi = hk_get_pi_by_ino(sb, dir->i_ino);
+    struct hk_dir_index_rec rec;
+    struct hk_dentry_info *di;
+    unsigned long irq_flags = 0;
+    u64 blk = 0, blk_addr = 0, head = 0;
+    void *rec_addr;
+    u16 nr_recs = 0;
+    int old;
+    u32 bkt;
+
+    if (!test_opt(sb, DIR_INDEX) || dt->nr_entries < HK_DIR_INDEX_MIN)
+        return;
+    if (pi->i_dindex || !hk_dir_settled(sih))
+        return;
+
+    hk_dir_index_free(sb, dir);
+
+    memset(&rec, 0, sizeof(rec));
+    for (old = 0; old <= 1; old++) {
+        for (bkt = 0; bkt < hk_dir_table_size(dt, old); bkt++) {
+            hlist_for_each_entry(di, &hk_dir_table_buckets(dt, old)[bkt], node)
+            {
+                if (nr_recs == HK_DIR_INDEX_RECS) {
+                    head = hk_dir_index_seal(sb, dir, blk, blk_addr, nr_recs, head);
+                    nr_recs = 0;
+                }
+                if (nr_recs == 0) {
+                    blk = hk_dir_new_blk(sih);
+                    blk_addr = hk_dir_prepare_blk(sb);
+                    if (!blk_addr)
+                        return;
+                    hk_dir_set_index_blk(sih, blk);
+                }
+
+                rec.hash = cpu_to_le32(di->hash);
+                rec.blk = cpu_to_le32(di->blk);
+                rec.ix = hk_dentry_ix(di->direntry);
+                rec.name_len = di->name_len;
+                memcpy(rec.prefix, di->prefix, HK_DENTRY_PREFIX_LEN);
+
+                rec_addr = (void *)(blk_addr + HK_DENTRY_UNIT + nr_recs * sizeof(rec));
+                /* written back with the header by hk_dir_index_seal */
+                hk_memunlock_range(sb, rec_addr, sizeof(rec), &irq_flags);
+                memcpy(rec_addr, &rec, sizeof(rec));
+                hk_memlock_range(sb, rec_addr, sizeof(rec), &irq_flags);
+                nr_recs++;
+            }
+        }
+    }
+    head = hk_dir_index_seal(sb, dir, blk, blk_addr, nr_recs, head);
+
+    PERSISTENT_BARRIER();
+    hk_memunlock_pi(sb, pi, &irq_flags);
+    pi->i_dindex = cpu_to_le64(head);
+    hk_memlock_pi(sb, pi, &irq_flags);
+    hk_flush_buffer(&pi->i_dindex, sizeof(pi->i_dindex), true);
+
+    HK_STATS_ADD(dir_index_checkpoints, 1);
+}
+
+/* Rebuild the DRAM index from the checkpoint, after the blocks of the dir
+   are registered. The chain is checked as a whole before anything is
+   inserted, so that the caller can fall back to scanning the dentries. */
+bool hk_dir_index_load(struct super_block *sb, struct hk_inode *pi, struct hk_inode_info_header *sih,
+                       u64 *nr_entries)
+{
+    struct hk_sb_info *sbi = HK_SB(sb);
+    struct hk_dir_table *dt = sih->dirs;
+    struct hk_dir_index_hdr *hdr;
+    struct hk_dir_index_rec *rec;
+    u64 next, blk, blk_addr, dblk, nr_blks;
+    u16 i, nr_recs;
+    int pass;
+
+    if (!pi->i_dindex)
+        return false;
+
+    for (pass = 0; pass < 2; pass++) {
+        next = le64_to_cpu(pi->i_dindex);
+        nr_blks = 0;
+        while (next) {
+            blk = next - 1;
+            /* a chain longer than the index blocks loops */
+            if (!xa_load(&dt->index_blks, blk) || ++nr_blks > dt->nr_index_blks)
+                return false;
+            blk_addr = TRANS_OFS_TO_ADDR(sbi, linix_get(&sih->ix, blk));
+            hdr = (struct hk_dir_index_hdr *)blk_addr;
+            nr_recs = le16_to_cpu(hdr->nr_recs);
+            if (nr_recs > HK_DIR_INDEX_RECS)
+                return false;
+
+            rec = (struct hk_dir_index_rec *)(blk_addr + HK_DENTRY_UNIT);
+            for (i = 0; i < nr_recs; i++, rec++) {
+                dblk = le32_to_cpu(rec->blk);
+                if (pass == 0) {
+                    if (!xa_load(&dt->blks, dblk) || rec->ix >= HK_DENTRY_SLOTS ||
+                        rec->name_len == 0 || rec->name_len > HK_NAME_LEN)
+                        return false;
+                    continue;
+                }
+                __hk_insert_dir_table(sih, le32_to_cpu(rec->hash), rec->prefix, rec->name_len,
+                                      hk_dentry_by_ix_from_blk(TRANS_OFS_TO_ADDR(sbi, linix_get(&sih->ix, dblk)), rec->ix),
+                                      dblk);
+                hk_dir_set_blk(sih, dblk, hk_dir_get_blk(sih, dblk) | (1UL << rec->ix));
+                (*nr_entries)++;
+            }
+            next = le64_to_cpu(hdr->next);
+        }
+    }
+
+    HK_STATS_ADD(dir_index_loads, 1);
+    return true;
+}
+
 int hk_append_dentry_innvm(struct super_block *sb, struct inode *dir, const char *name,
-                           int namelen, u64 ino, u16 link_change, struct hk_dentry **out_direntry)
+                           int namelen, u64 ino, umode_t mode, u16 link_change, struct hk_dentry **out_direntry)
 {
     struct hk_sb_info *sbi = HK_SB(sb);
     struct hk_inode_info *si = HK_I(dir);
     struct hk_inode_info_header *sih = &si->header;
     struct hk_inode *pidir;
-    struct hk_layout_preps preps;
-    struct hk_layout_prep *prep = NULL;
-    struct hk_layout_prep tmp_prep;
     struct hk_dentry_info *di;
     struct hk_dentry *direntry;
-    struct hk_cmt_dbatch dbatch;
     u64 blk_addr;
     u64 blk_cur;
     u16 dentry_ix;
     bool is_alloc_new = false;
     unsigned long irq_flags = 0;
 
+    hk_dir_index_drop(sb, dir);
+
     if (ino == 0) {
         di = hk_search_dir_table(sb, sih, name, namelen);
         if (!di) {
@@ -148,78 +926,60 @@ int hk_append_dentry_innvm(struct super_block *sb, struct inode *dir, const char
         }
 
         direntry = di->direntry;
+        blk_cur = di->blk;
         direntry->tstamp = get_version(sbi);
         hk_memunlock_dentry(sb, direntry, &irq_flags);
         direntry->valid = 0;
         hk_memlock_dentry(sb, direntry, &irq_flags);
-        hk_flush_buffer(direntry, sizeof(struct hk_dentry), true);
+        hk_flush_buffer(direntry, CACHELINE_SIZE, true);
 
         if (out_direntry) {
             *out_direntry = direntry;
         }
 
+        /* the slot is reused after the tx removing it is finished */
+        hk_dir_set_blk(sih, blk_cur, hk_dir_get_blk(sih, blk_cur) & ~(1UL << hk_dentry_ix(direntry)));
+        sih->i_num_dentrys--;
+
         hk_remove_dir_table(sb, sih, name, namelen);
         return 0;
     }
 
     pidir = hk_get_pi_by_ino(sb, dir->i_ino);
 
-    blk_cur = sih->i_num_dentrys / MAX_DENTRY_PER_BLK;
-    dentry_ix = sih->i_num_dentrys % MAX_DENTRY_PER_BLK;
-    if (dentry_ix == 0 && linix_get(&sih->ix, blk_cur) == 0) {
-        hk_prepare_layouts(sb, 1, true, &preps);
-        hk_trv_prepared_layouts_init(&preps);
-        prep = hk_trv_prepared_layouts(sb, &preps);
-        if (!prep) {
-            hk_dbg("%s: ERROR: No prep found\n", __func__);
-            hk_prepare_gap(sb, false, &tmp_prep);
-            if (tmp_prep.target_addr == 0) {
-                hk_dbgv("%s: prepare layout failed\n", __func__);
-                BUG_ON(1);
-                return -ENOSPC;
-            }
-            blk_addr = tmp_prep.target_addr;
-        } else {
-            blk_addr = prep->target_addr;
-        }
-        is_alloc_new = true;
-    } else {
+    /* no dentry of this dir is held by the caller yet */
+    hk_compact_dir(sb, dir);
+
+    if (hk_dir_find_slot(sb, sih, ULLONG_MAX, hk_dentry_units_for(sb, namelen), &blk_cur, &dentry_ix)) {
         blk_addr = TRANS_OFS_TO_ADDR(sbi, linix_get(&sih->ix, blk_cur));
+        HK_STATS_ADD(dentry_slots_reused, 1);
+    } else {
+        blk_cur = hk_dir_new_blk(sih);
+        dentry_ix = 0;
+        blk_addr = hk_dir_prepare_blk(sb);
+        if (!blk_addr)
+            return -ENOSPC;
+        is_alloc_new = true;
     }
 
-    direntry = hk_dentry_by_ix_from_blk(blk_addr, dentry_ix);
-
-    hk_memunlock_dentry(sb, direntry, &irq_flags);
-    direntry->ino = cpu_to_le64(ino);
-    direntry->name_len = namelen;
-    memcpy_to_pmem_nocache(direntry->name, name, direntry->name_len);
-    direntry->name[namelen] = '\0';
-    direntry->mtime = cpu_to_le32(dir->i_mtime.tv_sec);
-    direntry->links_count = cpu_to_le16(link_change);
-    direntry->valid = 1;
-    direntry->tstamp = get_version(sbi);
-    hk_memlock_dentry(sb, direntry, &irq_flags);
+    direntry = hk_dir_fill_slot(sb, blk_addr, dentry_ix, ino, name, namelen,
+                                cpu_to_le32(dir->i_mtime.tv_sec), cpu_to_le16(link_change),
+                                fs_umode_to_dtype(mode));
 
     if (out_direntry) {
         *out_direntry = direntry;
     }
 
-    if (is_alloc_new) {
-        hk_init_and_inc_cmt_dbatch(&dbatch, blk_addr, blk_cur, 1);
-        use_layout_for_addr(sb, blk_addr);
-        sm_valid_data_sync(sb, sm_get_prev_addr_by_dbatch(sb, sih, &dbatch), blk_addr, sm_get_next_addr_by_dbatch(sb, sih, &dbatch),
-                           dir->i_ino, blk_cur, get_version(sbi), 1, dir->i_ctime.tv_sec);
-        unuse_layout_for_addr(sb, blk_addr);
+    if (is_alloc_new)
+        hk_dir_commit_blk(sb, dir, blk_cur, blk_addr);
 
-        linix_insert(&sih->ix, blk_cur, blk_addr, true);
-    }
-
-    hk_flush_buffer(direntry, sizeof(struct hk_dentry), false);
+    hk_flush_buffer(direntry, hk_dentry_units(sb, direntry) * HK_DENTRY_UNIT, false);
 
     dir->i_mtime = dir->i_ctime = current_time(dir);
+    hk_dir_set_blk(sih, blk_cur, hk_dir_get_blk(sih, blk_cur) | (1UL << dentry_ix));
     sih->i_num_dentrys++;
 
-    hk_insert_dir_table(sb, sih, name, namelen, direntry);
+    hk_insert_dir_table(sb, sih, name, namelen, direntry, blk_cur);
 
     return 0;
 }
@@ -227,7 +987,7 @@ int hk_append_dentry_innvm(struct super_block *sb, struct inode *dir, const char
 /* adds a directory entry pointing to the inode.
  * return the directory in out_direntry field
  */
-int hk_add_dentry(struct dentry *dentry, u64 ino, u16 link_change,
+int hk_add_dentry(struct dentry *dentry, u64 ino, umode_t mode, u16 link_change,
                   struct hk_dentry **out_direntry)
 {
     struct inode *dir = dentry->d_parent->d_inode;
@@ -246,7 +1006,7 @@ int hk_add_dentry(struct dentry *dentry, u64 ino, u16 link_change,
     if (namelen == 0)
         return -EINVAL;
 
-    ret = hk_append_dentry_innvm(sb, dir, name, namelen, ino, link_change, out_direntry);
+    ret = hk_append_dentry_innvm(sb, dir, name, namelen, ino, mode, link_change, out_direntry);
 
     HK_END_TIMING(add_dentry_t, add_dentry_time);
     return ret;
@@ -279,6 +1039,19 @@ struct dentry *hk_get_parent(struct dentry *child)
     return d_obtain_alias(inode);
 }
 
+enum hk_journal_type hk_get_new_inode_jtype(umode_t mode)
+{
+    switch (mode & S_IFMT) {
+    case S_IFDIR:
+        return MKDIR;
+    case S_IFLNK: /* hard link only */
+        return LINK;
+    case S_IFREG:
+    default:
+        return CREATE;
+    }
+}
+
 int hk_start_tx_for_new_inode(struct super_block *sb, u64 ino, struct hk_dentry *direntry,
                               u64 dir_ino, umode_t mode)
 {
@@ -289,22 +1062,7 @@ int hk_start_tx_for_new_inode(struct super_block *sb, u64 ino, struct hk_dentry
     pidir = hk_get_pi_by_ino(sb, dir_ino);
     pi = hk_get_pi_by_ino(sb, ino);
 
-    hk_create_al_snapshot(sb, pidir);
-
-    switch (mode & S_IFMT) {
-    case S_IFDIR:
-        ret = hk_start_tx(sb, MKDIR, pi, direntry, pidir);
-        break;
-    case S_IFREG:
-        ret = hk_start_tx(sb, CREATE, pi, direntry, pidir);
-        break;
-    case S_IFLNK: /* hard link only */
-        ret = hk_start_tx(sb, LINK, pi, direntry, pidir);
-        break;
-    default:
-        ret = hk_start_tx(sb, CREATE, pi, direntry, pidir);
-        break;
-    }
+    ret = hk_start_tx(sb, hk_get_new_inode_jtype(mode), pi, direntry, pidir);
 
     hk_memunlock_pi(sb, pi, &irq_flags);
     pi->valid = 1;
@@ -321,10 +1079,7 @@ int hk_start_tx_for_unlink(struct super_block *sb, struct hk_inode *pi,
     int ret = 0;
     unsigned long irq_flags = 0;
 
-    /* make sure meta consistency */
-    hk_create_al_snapshot(sb, pidir);
-    hk_create_al_snapshot(sb, pi);
-
+    /* attr logs are snapshotted by the tx for meta consistency */
     ret = hk_start_tx(sb, UNLINK, pi, direntry, pidir);
 
     if (invalidate) {
@@ -337,14 +1092,14 @@ out:
     return ret;
 }
 
-static int hk_start_tx_for_symlink(struct super_block *sb, u64 ino, struct hk_dentry *direntry,
-                                   struct inode *dir, umode_t mode, u64 sym_blk_addr)
+int hk_start_tx_for_symlink(struct super_block *sb, u64 ino, struct hk_dentry *direntry,
+                            u64 dir_ino, u64 sym_blk_addr)
 {
     struct hk_inode *pidir = NULL;
 
     int ret = 0;
 
-    pidir = hk_get_pi_by_ino(sb, dir->i_ino);
+    pidir = hk_get_pi_by_ino(sb, dir_ino);
     if (!pidir) {
         ret = -ENOENT;
         goto out;
@@ -359,17 +1114,14 @@ out:
     return ret;
 }
 
-static int hk_start_tx_for_rename(struct super_block *sb, struct hk_inode *pi,
-                                  struct hk_dentry *pd, struct hk_dentry *pd_new,
-                                  struct hk_inode *pi_par, struct hk_inode *pi_new)
+int hk_start_tx_for_rename(struct super_block *sb, struct hk_inode *pi,
+                           struct hk_dentry *pd, struct hk_dentry *pd_new,
+                           struct hk_inode *pi_par, struct hk_inode *pi_new)
 {
     int ret;
     u64 ino = le64_to_cpu(pi->ino);
 
-    /* make sure meta consistency */
-    hk_create_al_snapshot(sb, pi_par);
-    hk_create_al_snapshot(sb, pi_new);
-
+    /* attr logs are snapshotted by the tx for meta consistency */
     ret = hk_start_tx(sb, RENAME, pi, pd, pd_new, pi_par, pi_new);
 out:
     return ret;
@@ -395,7 +1147,7 @@ static int __hk_create(struct inode *dir, struct dentry *dentry, umode_t mode,
     if (ino == -1)
         goto out_err;
 
-    err = hk_add_dentry(dentry, ino, 0, &direntry);
+    err = hk_add_dentry(dentry, ino, mode, 0, &direntry);
     if (err)
         goto out_err;
 
@@ -406,6 +1158,7 @@ static int __hk_create(struct inode *dir, struct dentry *dentry, umode_t mode,
 
 #ifdef CONFIG_CMT_BACKGROUND
     hk_delegate_create_async(sb, inode, dir, direntry);
+    hk_cmt_balance(sb, inode);
 #else
     int txid;
     hk_init_pi(sb, inode, mode, dir->i_flags);
@@ -536,7 +1289,7 @@ static int hk_symlink(struct inode *dir, struct dentry *dentry,
             dentry->d_name.name, symname);
     hk_dbgv("%s: inode %llu, dir %lu\n", __func__, ino, dir->i_ino);
 
-    err = hk_add_dentry(dentry, ino, 0, &direntry);
+    err = hk_add_dentry(dentry, ino, S_IFLNK, 0, &direntry);
     if (err)
         goto out_fail;
 
@@ -546,7 +1299,9 @@ static int hk_symlink(struct inode *dir, struct dentry *dentry,
         err = PTR_ERR(inode);
         goto out_fail;
     }
+#ifndef CONFIG_CMT_BACKGROUND
     hk_init_pi(sb, inode, S_IFLNK | 0777, dir->i_flags);
+#endif
 
     pi = hk_get_pi_by_ino(sb, inode->i_ino);
 
@@ -557,7 +1312,12 @@ static int hk_symlink(struct inode *dir, struct dentry *dentry,
     if (err)
         goto out_fail;
 
-    txid = hk_start_tx_for_symlink(sb, ino, direntry, dir, S_IFLNK | 0777, sym_blk_addr);
+#ifdef CONFIG_CMT_BACKGROUND
+    /* the symname is persisted already, the size goes with the inode checkpoint */
+    hk_delegate_symlink_async(sb, inode, dir, direntry, sym_blk_addr);
+    hk_cmt_balance(sb, inode);
+#else
+    txid = hk_start_tx_for_symlink(sb, ino, direntry, dir->i_ino, sym_blk_addr);
     if (txid < 0) {
         err = txid;
         goto out_fail;
@@ -565,6 +1325,7 @@ static int hk_symlink(struct inode *dir, struct dentry *dentry,
     hk_commit_attrchange(sb, dir);
     hk_commit_sizechange(sb, inode, len);
     hk_finish_tx(sb, txid);
+#endif
 
     d_instantiate(dentry, inode);
     unlock_new_inode(inode);
@@ -608,7 +1369,7 @@ static int hk_link(struct dentry *dest_dentry, struct inode *dir,
     hk_dbgv("%s: inode %lu, dir %lu\n", __func__,
             inode->i_ino, dir->i_ino);
 
-    err = hk_add_dentry(dentry, inode->i_ino, 0, &direntry);
+    err = hk_add_dentry(dentry, inode->i_ino, inode->i_mode, 0, &direntry);
     if (err) {
         iput(inode);
         goto out;
@@ -617,6 +1378,10 @@ static int hk_link(struct dentry *dest_dentry, struct inode *dir,
     inode->i_ctime = current_time(inode);
     inc_nlink(inode);
 
+#ifdef CONFIG_CMT_BACKGROUND
+    hk_delegate_link_async(sb, inode, dir, direntry);
+    hk_cmt_balance(sb, inode);
+#else
     txid = hk_start_tx_for_new_inode(sb, inode->i_ino, direntry, dir->i_ino, S_IFLNK | 0777);
     if (txid < 0) {
         err = txid;
@@ -626,6 +1391,7 @@ static int hk_link(struct dentry *dest_dentry, struct inode *dir,
     hk_commit_attrchange(sb, dir);
     hk_commit_linkchange(sb, inode);
     hk_finish_tx(sb, txid);
+#endif
 
     d_instantiate(dentry, inode);
 
@@ -653,7 +1419,7 @@ static int hk_unlink(struct inode *dir, struct dentry *dentry)
     if (!pidir)
         goto out_err;
 
-    retval = hk_add_dentry(dentry, 0, 0, &direntry);
+    retval = hk_add_dentry(dentry, 0, 0, 0, &direntry);
     if (retval)
         goto out_err;
 
@@ -667,6 +1433,7 @@ static int hk_unlink(struct inode *dir, struct dentry *dentry)
 
 #ifdef CONFIG_CMT_BACKGROUND
     hk_delegate_unlink_async(sb, inode, dir, direntry, invalidate);
+    hk_cmt_balance(sb, inode);
 #else
     txid = hk_start_tx_for_unlink(sb, pi, direntry, pidir, invalidate);
     if (txid < 0) {
@@ -677,6 +1444,7 @@ static int hk_unlink(struct inode *dir, struct dentry *dentry)
     hk_commit_linkchange(sb, inode);
 
     hk_finish_tx(sb, txid);
+    hk_reclaim_dentry(sb, direntry);
 #endif
 
     HK_END_TIMING(unlink_t, unlink_time);
@@ -696,15 +1464,8 @@ static bool hk_empty_dir(struct inode *inode)
     struct super_block *sb = inode->i_sb;
     struct hk_inode_info *si = HK_I(inode);
     struct hk_inode_info_header *sih = &si->header;
-    unsigned bkt;
-    struct hk_dentry_info *cur;
-
-    hash_for_each_bits(sih->dirs, HK_HASH_BITS, bkt, cur, node)
-    {
-        return false;
-    }
 
-    return true;
+    return sih->dirs->nr_entries == 0;
 }
 
 static int hk_rename(struct inode *old_dir,
@@ -720,7 +1481,7 @@ static int hk_rename(struct inode *old_dir,
     struct hk_inode *new_pidir = NULL, *old_pidir = NULL;
     struct hk_dentry *father_entry = NULL;
     struct hk_dentry *father_entryc, entry_copy;
-    struct hk_dentry *pd, *pd_new;
+    struct hk_dentry *pd, *pd_new, *pd_replaced;
     int invalidate_new_inode = 0;
     int err = 0;
     int inc_link = 0, dec_link = 0;
@@ -776,21 +1537,27 @@ static int hk_rename(struct inode *old_dir,
     old_pi = hk_get_pi_by_ino(sb, old_inode->i_ino);
 
     old_inode->i_ctime = current_time(old_inode);
+#ifndef CONFIG_CMT_BACKGROUND
     err = hk_commit_linkchange(sb, old_inode);
     if (err)
         goto out;
+#endif
 
     /* FIXME we don't support ".." for now */
 
     if (new_inode) {
         /* First remove the old entry in the new directory */
-        err = hk_add_dentry(new_dentry, 0, 0, NULL);
+        err = hk_add_dentry(new_dentry, 0, 0, 0, &pd_replaced);
         if (err)
             goto out;
+#ifndef CONFIG_CMT_BACKGROUND
+        /* not journaled, nothing can undo into it */
+        hk_reclaim_dentry(sb, pd_replaced);
+#endif
     }
 
     /* link into the new directory. */
-    err = hk_add_dentry(new_dentry, old_inode->i_ino, inc_link, &pd_new);
+    err = hk_add_dentry(new_dentry, old_inode->i_ino, old_inode->i_mode, inc_link, &pd_new);
     if (err)
         goto out;
 
@@ -798,7 +1565,7 @@ static int hk_rename(struct inode *old_dir,
         inc_nlink(new_dir);
 
     /* remove the old dentry */
-    err = hk_add_dentry(old_dentry, 0, dec_link, &pd);
+    err = hk_add_dentry(old_dentry, 0, 0, dec_link, &pd);
     if (err)
         goto out;
 
@@ -816,11 +1583,22 @@ static int hk_rename(struct inode *old_dir,
         if (new_inode->i_nlink)
             drop_nlink(new_inode);
 
+#ifdef CONFIG_CMT_BACKGROUND
+        /* journaled as an unlink of the replaced inode, its data blocks
+           are released on eviction */
+        hk_delegate_unlink_async(sb, new_inode, new_dir, pd_replaced, new_inode->i_nlink == 0);
+        hk_cmt_balance(sb, new_inode);
+#else
         err = hk_commit_linkchange(sb, new_inode);
         if (err)
             goto out;
+#endif
     }
 
+#ifdef CONFIG_CMT_BACKGROUND
+    hk_delegate_rename_async(sb, old_inode, old_dir, new_dir, pd, pd_new);
+    hk_cmt_balance(sb, old_inode);
+#else
     if (new_inode && new_inode->i_nlink == 0)
         invalidate_new_inode = 1;
 
@@ -841,6 +1619,8 @@ static int hk_rename(struct inode *old_dir,
     hk_commit_attrchange(sb, old_dir);
     hk_commit_attrchange(sb, new_dir);
     hk_finish_tx(sb, txid);
+    hk_reclaim_dentry(sb, pd);
+#endif
 
     HK_END_TIMING(rename_t, rename_time);
     return 0;
@@ -10,19 +10,151 @@ struct hk_dentry {
 	__le32	mtime;			        /* For both mtime and ctime */
 	__le64	ino;			        /* inode no pointed to by this entry */
     __le64  tstamp;					/* FIXME: tstamp should be used to append */
-    //! We don't need this now
-	__le32	csum;			        /* entry checksum */
-	u8	    name[HK_NAME_LEN + 1];	/* File name */
+	u8	    file_type;		        /* DT_* of the inode, garbage unless HK_FEATURE_DENTRY_TYPE */
+	u8	    units;			        /* HK_DENTRY_UNITs taken, 0 for 2, garbage unless HK_FEATURE_DENTRY_UNITS */
+	u8	    reserved[2];
+	u8	    name[HK_NAME_LEN + 1];	/* File name, cut to the units taken */
 } __attribute((__packed__));
 
 static_assert(sizeof(struct hk_dentry) == 128, "sizeof(struct hk_dentry) != 128");
 
+/* Dentries of short names take one unit, and the others take two units
+   starting at an even unit, i.e., a whole 128B slot as before packing. */
+#define HK_DENTRY_UNIT           64
+#define HK_DENTRY_SHORT_NAME_LEN (HK_DENTRY_UNIT - offsetof(struct hk_dentry, name) - 1)
+
+/* Images formatted before packing never wrote units, and all of their
+   dentries take two units */
+static inline int hk_dentry_units(struct super_block *sb, struct hk_dentry *direntry)
+{
+	if (!hk_has_feature(sb, HK_FEATURE_DENTRY_UNITS))
+		return 2;
+	return READ_ONCE(direntry->units) == 1 ? 1 : 2;
+}
+
+static inline int hk_dentry_units_for(struct super_block *sb, int namelen)
+{
+	if (!hk_has_feature(sb, HK_FEATURE_DENTRY_UNITS))
+		return 2;
+	return namelen <= HK_DENTRY_SHORT_NAME_LEN ? 1 : 2;
+}
+
+#define HK_DENTRY_PREFIX_LEN 15
+
+/* The hash, length and prefix of the name are kept in DRAM, so that lookup
+   rejects almost all mismatches without touching the dentry on PM */
 struct hk_dentry_info {
 	struct hlist_node node;
-	unsigned long hash;
-	struct hk_dentry *direntry;	
+	struct hk_dentry *direntry;
+	u32 hash;
+	u32 blk;		/* dir block holding the dentry */
+	u8 name_len;
+	char prefix[HK_DENTRY_PREFIX_LEN];
+};
+
+static_assert(sizeof(struct hk_dentry_info) == 48, "sizeof(struct hk_dentry_info) != 48");
+
+/* A dentry slot is free if it is not live and its name_len is 0, i.e., the
+   tx that removed it is finished and nothing can undo into it. */
+#define HK_DIR_BLK_FREE   XA_MARK_0 /* might have free slots */
+#define HK_DIR_BLK_HOLE   XA_MARK_1 /* freed by compaction, the index is reusable */
+#define HK_DIR_BLK_SPARSE XA_MARK_2 /* few live slots, worth compacting */
+
+/* DRAM index of a directory. It grows and shrinks with the number of entries,
+   and a resize moves a few buckets per dir op instead of rehashing at once.
+   Buckets of the old table below `migrated` are already moved (i.e., empty). */
+struct hk_dir_table {
+	struct hlist_head *buckets;
+	u32 bits;
+	struct hlist_head *old_buckets; /* NULL if not resizing */
+	u32 old_bits;
+	u32 migrated;
+	u64 nr_entries;
+
+	/* Bloom filter of names, so that most misses skip the buckets. Removed
+	   names stay set until the filter is refilled, a few buckets per dir op
+	   like a resize. NULL if out of memory. */
+	unsigned long *bloom;
+	u32 bloom_bits;
+	u64 bloom_stale;	/* names removed since the last refill */
+	unsigned long *next_bloom;	/* being refilled, NULL if not */
+	u32 next_bloom_bits;
+	u32 bloom_refilled;	/* buckets walked into next_bloom if not resizing */
+
+	/* dentry slots */
+	struct xarray blks;	/* f_blk -> bitmap of units holding live dentries */
+	u64 nr_blks;		/* blocks indexed, including holes */
+	u64 nr_holes;
+	unsigned long hint;	/* where to look for a free slot */
+	atomic_t nr_listing;	/* readdirs stopped midway, see hk_readdir */
+
+	/* persistent index, see hk_dir_index_checkpoint */
+	struct xarray index_blks;	/* f_blk of blocks holding the index */
+	u64 nr_index_blks;
 };
 
-#define MAX_DENTRY_PER_BLK (HK_PBLK_SZ / sizeof(struct hk_dentry))
+static inline struct hlist_head *hk_dir_table_buckets(struct hk_dir_table *dt, int old)
+{
+	return old ? dt->old_buckets : dt->buckets;
+}
+
+static inline u32 hk_dir_table_size(struct hk_dir_table *dt, int old)
+{
+	if (old)
+		return dt->old_buckets ? (1U << dt->old_bits) : 0;
+	return 1U << dt->bits;
+}
+
+#define MAX_DENTRY_PER_BLK (HK_PBLK_SZ / HK_DENTRY_UNIT)
+/* A dentry never starts at the last unit, so that live bits fit in an xarray value */
+#define HK_DENTRY_SLOTS    (MAX_DENTRY_PER_BLK - 1)
+
+static_assert(HK_DENTRY_SLOTS <= BITS_PER_XA_VALUE, "live units of a dir block should fit in an xarray value");
+
+static inline u16 hk_dentry_ix(struct hk_dentry *direntry)
+{
+	return ((u64)direntry & (HK_PBLK_SZ - 1)) / HK_DENTRY_UNIT;
+}
+
+/* Walk the dentries, live or not, of a dir block */
+#define hk_for_each_dentry_in_blk(sb, blk_addr, ix, direntry)				\
+	for (ix = 0; ix < HK_DENTRY_SLOTS &&						\
+		     ((direntry) = hk_dentry_by_ix_from_blk(blk_addr, ix), 1);		\
+	     ix += (ix & 1) ? 1 : hk_dentry_units(sb, direntry))
+
+#define HK_DIR_INDEX_MAGIC    0x48444958 /* HDIX */
+#define HK_DENTRY_UNITS_INDEX 0xff
+
+/* First unit of a dir index block. It reads as a free dentry of an unknown
+   size, so that the block is never taken as a dentry block. */
+struct hk_dir_index_hdr {
+	u8	name_len;		/* 0 */
+	u8	valid;			/* 0 */
+	__le16	nr_recs;
+	__le32	magic;
+	__le64	ino;			/* the dir */
+	__le64	next;			/* f_blk + 1 of the next index block, 0 if last */
+	u8	reserved;
+	u8	units;			/* HK_DENTRY_UNITS_INDEX */
+	u8	padding[38];
+} __attribute((__packed__));
+
+static_assert(sizeof(struct hk_dir_index_hdr) == HK_DENTRY_UNIT, "sizeof(struct hk_dir_index_hdr) != HK_DENTRY_UNIT");
+static_assert(offsetof(struct hk_dir_index_hdr, units) == offsetof(struct hk_dentry, units),
+	      "units of hk_dir_index_hdr should overlay the one of hk_dentry");
+
+/* A live dentry, i.e., a struct hk_dentry_info on PM */
+struct hk_dir_index_rec {
+	__le32	hash;
+	__le32	blk;
+	u8	ix;
+	u8	name_len;
+	char	prefix[HK_DENTRY_PREFIX_LEN];
+	u8	padding[9];
+} __attribute((__packed__));
+
+static_assert(sizeof(struct hk_dir_index_rec) == 32, "sizeof(struct hk_dir_index_rec) != 32");
+
+#define HK_DIR_INDEX_RECS ((HK_PBLK_SZ - HK_DENTRY_UNIT) / sizeof(struct hk_dir_index_rec))
 
 #endif /* _HK_NAMEI_H */
\ No newline at end of file
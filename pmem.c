@@ -0,0 +1,375 @@
+/*
+ * HUNTER copy routines for persistent memory.
+ *
+ * Copyright 2023-2024 Regents of the University of Harbin Institute of Technology, Shenzhen
+ * Computer science and technology, Yanqi Pan <deadpoolmine@qq.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <asm/fpu/api.h>
+#include <asm/simd.h>
+#include "hunter.h"
+
+/*
+ * Copies are dispatched by size:
+ *   [0, nt_thresh)           cached stores, then the lines are written back
+ *   [nt_thresh, simd_thresh) movnti
+ *   [simd_thresh, ...)       AVX-512 or AVX2 streaming of the 64B aligned body,
+ *                            edges are copied as small copies
+ * Every class ends with a fence, so that a copy is durable on return as with
+ * __copy_from_user_inatomic_nocache(). Callers order later commits on it.
+ */
+unsigned int hk_nt_thresh = HK_NT_THRESH;
+unsigned int hk_simd_thresh = HK_SIMD_THRESH;
+
+static DEFINE_STATIC_KEY_FALSE(hk_copy_avx2);
+static DEFINE_STATIC_KEY_FALSE(hk_copy_avx512);
+
+void hk_pmem_copy_init(void)
+{
+#ifdef CONFIG_AS_AVX2
+    if (boot_cpu_has(X86_FEATURE_AVX) && boot_cpu_has(X86_FEATURE_AVX2))
+        static_branch_enable(&hk_copy_avx2);
+#endif
+#ifdef CONFIG_AS_AVX512
+    if (boot_cpu_has(X86_FEATURE_AVX512F))
+        static_branch_enable(&hk_copy_avx512);
+#endif
+    hk_info("PM copy: AVX2 %s, AVX-512 %s, nt from %u, simd from %u bytes\n",
+            static_branch_unlikely(&hk_copy_avx2) ? "YES" : "NO",
+            static_branch_unlikely(&hk_copy_avx512) ? "YES" : "NO",
+            hk_nt_thresh, hk_simd_thresh);
+}
+
+static inline bool hk_simd_usable(void)
+{
+    return (static_branch_unlikely(&hk_copy_avx512) || static_branch_unlikely(&hk_copy_avx2)) &&
+           may_use_simd();
+}
+
+static inline void hk_memcpy_cached(void *dst, const void *src, size_t size)
+{
+    memcpy(dst, src, size);
+    hk_flush_small_buffer(dst, size, false);
+}
+
+/* ======================= ANCHOR: SIMD kernels ========================= */
+/* dst is 64B aligned and len is a multiple of 64. Callers hold the FPU. */
+#ifdef CONFIG_AS_AVX2
+static void hk_nt_copy_avx2(void *dst, const void *src, size_t len)
+{
+    for (; len >= 128; len -= 128, dst += 128, src += 128) {
+        asm volatile("vmovdqu 0(%1), %%ymm0\n"
+                     "vmovdqu 32(%1), %%ymm1\n"
+                     "vmovdqu 64(%1), %%ymm2\n"
+                     "vmovdqu 96(%1), %%ymm3\n"
+                     "vmovntdq %%ymm0, 0(%0)\n"
+                     "vmovntdq %%ymm1, 32(%0)\n"
+                     "vmovntdq %%ymm2, 64(%0)\n"
+                     "vmovntdq %%ymm3, 96(%0)\n"
+                     : : "r"(dst), "r"(src) : "memory");
+    }
+    if (len) {
+        asm volatile("vmovdqu 0(%1), %%ymm0\n"
+                     "vmovdqu 32(%1), %%ymm1\n"
+                     "vmovntdq %%ymm0, 0(%0)\n"
+                     "vmovntdq %%ymm1, 32(%0)\n"
+                     : : "r"(dst), "r"(src) : "memory");
+    }
+}
+#endif
+
+#ifdef CONFIG_AS_AVX512
+static void hk_nt_copy_avx512(void *dst, const void *src, size_t len)
+{
+    for (; len >= 256; len -= 256, dst += 256, src += 256) {
+        asm volatile("vmovdqu64 0(%1), %%zmm0\n"
+                     "vmovdqu64 64(%1), %%zmm1\n"
+                     "vmovdqu64 128(%1), %%zmm2\n"
+                     "vmovdqu64 192(%1), %%zmm3\n"
+                     "vmovntdq %%zmm0, 0(%0)\n"
+                     "vmovntdq %%zmm1, 64(%0)\n"
+                     "vmovntdq %%zmm2, 128(%0)\n"
+                     "vmovntdq %%zmm3, 192(%0)\n"
+                     : : "r"(dst), "r"(src) : "memory");
+    }
+    for (; len; len -= 64, dst += 64, src += 64) {
+        asm volatile("vmovdqu64 0(%1), %%zmm0\n"
+                     "vmovntdq %%zmm0, 0(%0)\n"
+                     : : "r"(dst), "r"(src) : "memory");
+    }
+}
+#endif
+
+static void hk_nt_copy_simd(void *dst, const void *src, size_t len)
+{
+    kernel_fpu_begin();
+#ifdef CONFIG_AS_AVX512
+    if (static_branch_likely(&hk_copy_avx512)) {
+        hk_nt_copy_avx512(dst, src, len);
+        goto out;
+    }
+#endif
+#ifdef CONFIG_AS_AVX2
+    hk_nt_copy_avx2(dst, src, len);
+    goto out;
+#endif
+out:
+    kernel_fpu_end();
+}
+
+/* Same as hk_nt_copy_simd() but src is a user buffer. Loads go through the
+   exception table, and with page faults disabled a fault stops the copy.
+   Returns the bytes copied, the caller copies the rest the slow way. */
+static size_t hk_nt_copy_simd_user(void *dst, const void __user *src, size_t len)
+{
+    size_t done = 0;
+    bool faulted = false;
+
+    kernel_fpu_begin();
+    pagefault_disable();
+    if (!user_access_begin(src, len))
+        goto out_fpu;
+#ifdef CONFIG_AS_AVX512
+    if (static_branch_likely(&hk_copy_avx512)) {
+        for (; done < len; done += 64) {
+            asm goto("1: vmovdqu64 0(%0), %%zmm0\n"
+                     "vmovntdq %%zmm0, 0(%1)\n"
+                     _ASM_EXTABLE(1b, %l[fault])
+                     : : "r"(src + done), "r"(dst + done) : "memory" : fault);
+        }
+        goto out;
+    }
+#endif
+#ifdef CONFIG_AS_AVX2
+    for (; done < len; done += 64) {
+        asm goto("1: vmovdqu 0(%0), %%ymm0\n"
+                 "2: vmovdqu 32(%0), %%ymm1\n"
+                 "vmovntdq %%ymm0, 0(%1)\n"
+                 "vmovntdq %%ymm1, 32(%1)\n"
+                 _ASM_EXTABLE(1b, %l[fault])
+                 _ASM_EXTABLE(2b, %l[fault])
+                 : : "r"(src + done), "r"(dst + done) : "memory" : fault);
+    }
+#endif
+    goto out;
+fault:
+    faulted = true;
+out:
+    user_access_end();
+    /* no calls while user access is open */
+    if (faulted)
+        hk_dbgv("%s: fault at %lu of %lu\n", __func__, done, len);
+out_fpu:
+    pagefault_enable();
+    kernel_fpu_end();
+    return done;
+}
+
+/* ======================= ANCHOR: Copy to PM ========================= */
+/* Copy from a kernel buffer */
+void hk_memcpy_to_pmem(void *dst, const void *src, size_t size)
+{
+    size_t head, body;
+
+    if (size < hk_nt_thresh) {
+        hk_memcpy_cached(dst, src, size);
+        goto out;
+    }
+
+    if (size >= hk_simd_thresh && hk_simd_usable()) {
+        head = min_t(size_t, PTR_ALIGN(dst, CACHELINE_SIZE) - dst, size);
+        body = round_down(size - head, CACHELINE_SIZE);
+        if (head)
+            hk_memcpy_cached(dst, src, head);
+        hk_nt_copy_simd(dst + head, src + head, body);
+        if (size - head - body)
+            hk_memcpy_cached(dst + head + body, src + head + body, size - head - body);
+        goto out;
+    }
+
+    memcpy_flushcache(dst, src, size);
+out:
+    PERSISTENT_BARRIER();
+}
+
+/* Copy from a user buffer, returns the bytes not copied */
+int memcpy_to_pmem_nocache(void *dst, const void *src, unsigned int size)
+{
+    size_t head, done;
+    int ret;
+
+    if (size < hk_nt_thresh) {
+        ret = __copy_from_user_inatomic(dst, src, size);
+        hk_flush_small_buffer(dst, size, false);
+        goto out;
+    }
+
+    if (size >= hk_simd_thresh && hk_simd_usable()) {
+        head = min_t(size_t, PTR_ALIGN(dst, CACHELINE_SIZE) - dst, size);
+        if (head) {
+            ret = __copy_from_user_inatomic(dst, src, head);
+            hk_flush_small_buffer(dst, head, false);
+            if (ret) {
+                ret += size - head;
+                goto out;
+            }
+        }
+        done = hk_nt_copy_simd_user(dst + head, src + head, round_down(size - head, CACHELINE_SIZE));
+        head += done;
+        if (head == size) {
+            ret = 0;
+            goto out;
+        }
+        /* fences on its own */
+        return __copy_from_user_inatomic_nocache(dst + head, src + head, size - head);
+    }
+
+    return __copy_from_user_inatomic_nocache(dst, src, size);
+out:
+    PERSISTENT_BARRIER();
+    return ret;
+}
+
+/* ======================= ANCHOR: Copy bench ========================= */
+enum hk_copy_variant {
+    HK_COPY_CACHED, /* memcpy + clwb */
+    HK_COPY_MOVNTI,
+    HK_COPY_AVX2,
+    HK_COPY_AVX512,
+    HK_COPY_VARIANTS
+};
+
+static const char *hk_copy_variant_names[] = {
+    [HK_COPY_CACHED] = "cached",
+    [HK_COPY_MOVNTI] = "movnti",
+    [HK_COPY_AVX2] = "avx2",
+    [HK_COPY_AVX512] = "avx512",
+};
+
+static bool hk_copy_bench_one(enum hk_copy_variant v, void *dst, const void *src, size_t size)
+{
+    size_t head = min_t(size_t, PTR_ALIGN(dst, CACHELINE_SIZE) - dst, size);
+    size_t body = round_down(size - head, CACHELINE_SIZE);
+
+    switch (v) {
+    case HK_COPY_CACHED:
+        hk_memcpy_cached(dst, src, size);
+        return true;
+    case HK_COPY_MOVNTI:
+        memcpy_flushcache(dst, src, size);
+        return true;
+#ifdef CONFIG_AS_AVX2
+    case HK_COPY_AVX2:
+        if (!static_branch_unlikely(&hk_copy_avx2))
+            return false;
+        if (head)
+            hk_memcpy_cached(dst, src, head);
+        kernel_fpu_begin();
+        hk_nt_copy_avx2(dst + head, src + head, body);
+        kernel_fpu_end();
+        break;
+#endif
+#ifdef CONFIG_AS_AVX512
+    case HK_COPY_AVX512:
+        if (!static_branch_unlikely(&hk_copy_avx512))
+            return false;
+        if (head)
+            hk_memcpy_cached(dst, src, head);
+        kernel_fpu_begin();
+        hk_nt_copy_avx512(dst + head, src + head, body);
+        kernel_fpu_end();
+        break;
+#endif
+    default:
+        return false;
+    }
+
+    if (size - head - body)
+        hk_memcpy_cached(dst + head + body, src + head + body, size - head - body);
+    return true;
+}
+
+/* Sweep sizes, alignments and variants over the physically contiguous blocks
+   at the start of a scratch file, whose content is overwritten. Results go
+   to the kernel log. */
+int hk_copy_bench(struct file *filp)
+{
+    static const size_t sizes[] = {64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 65536};
+    static const size_t aligns[] = {0, 8, 32};
+    struct inode *inode = file_inode(filp);
+    struct super_block *sb = inode->i_sb;
+    struct hk_sb_info *sbi = HK_SB(sb);
+    struct hk_inode_info_header *sih = &HK_I(inode)->header;
+    unsigned long irq_flags = 0;
+    void *src, *dst;
+    size_t area, rounds, r;
+    u64 blks, start;
+    int s, a, v;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+
+    inode_lock(inode);
+
+    dst = (void *)TRANS_OFS_TO_ADDR(sbi, linix_get(&sih->ix, 0));
+    if (!dst) {
+        inode_unlock(inode);
+        return -EINVAL;
+    }
+    for (blks = 1; blks * HK_PBLK_SZ < 2 * sizes[ARRAY_SIZE(sizes) - 1]; blks++) {
+        if ((void *)TRANS_OFS_TO_ADDR(sbi, linix_get(&sih->ix, blks)) != dst + blks * HK_PBLK_SZ)
+            break;
+    }
+    area = blks * HK_PBLK_SZ;
+
+    src = vmalloc(area);
+    if (!src) {
+        inode_unlock(inode);
+        return -ENOMEM;
+    }
+    memset(src, 0x5a, area);
+
+    hk_info("copy bench over %llu contiguous blocks\n", blks);
+    hk_memunlock_range(sb, dst, area, &irq_flags);
+    for (s = 0; s < ARRAY_SIZE(sizes); s++) {
+        for (a = 0; a < ARRAY_SIZE(aligns); a++) {
+            if (sizes[s] + aligns[a] > area)
+                continue;
+            rounds = (area - aligns[a]) / round_up(sizes[s] + aligns[a], CACHELINE_SIZE);
+            for (v = 0; v < HK_COPY_VARIANTS; v++) {
+                bool ok = true;
+
+                start = ktime_get_ns();
+                for (r = 0; r < rounds * 16 && ok; r++) {
+                    size_t ofs = (r % rounds) * round_up(sizes[s] + aligns[a], CACHELINE_SIZE) + aligns[a];
+
+                    ok = hk_copy_bench_one(v, dst + ofs, src + ofs, sizes[s]);
+                    PERSISTENT_BARRIER();
+                }
+                if (ok)
+                    hk_info("copy bench: %-6s size %6lu align %2lu: %llu ns/op\n",
+                            hk_copy_variant_names[v], sizes[s], aligns[a],
+                            (ktime_get_ns() - start) / (rounds * 16));
+                cond_resched();
+            }
+        }
+    }
+    hk_memlock_range(sb, dst, area, &irq_flags);
+
+    vfree(src);
+    inode_unlock(inode);
+    return 0;
+}
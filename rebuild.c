@@ -88,8 +88,7 @@ void hk_init_header(struct super_block *sb, struct hk_inode_info_header *sih,
     }
 
     if (S_ISDIR(i_mode)) {
-        sih->dirs = kmalloc(sizeof(struct hlist_head) * (1 << HK_HASH_BITS), GFP_KERNEL);
-        __hash_init(sih->dirs, 1 << HK_HASH_BITS);
+        sih->dirs = hk_alloc_dir_table();
     } else
         sih->dirs = NULL;
 
@@ -101,6 +100,7 @@ void hk_init_header(struct super_block *sb, struct hk_inode_info_header *sih,
     sih->last_dentry = 0;
 
     sih->tstamp = 0;
+    sih->tbuf = NULL;
 
     return 0;
 }
@@ -140,21 +140,83 @@ static int hk_rebuild_blks_finish(struct super_block *sb, struct hk_inode *pi,
     return 0;
 }
 
+/* Compaction crashed after copying a dentry, keep the newer copy */
+static bool hk_rebuild_dedup_dentry(struct super_block *sb, struct hk_inode_info_header *sih,
+                                    struct hk_dentry *direntry, u64 f_blk)
+{
+    struct hk_dentry_info *di;
+    struct hk_dentry *stale;
+    unsigned long irq_flags = 0;
+    u64 blk;
+
+    di = hk_search_dir_table(sb, sih, direntry->name, direntry->name_len);
+    if (!di)
+        return false;
+
+    if (di->direntry->tstamp < direntry->tstamp) {
+        stale = di->direntry;
+        blk = di->blk;
+        hk_update_dir_table(sb, sih, direntry->name, direntry->name_len, direntry, f_blk);
+        hk_dir_set_blk(sih, blk, xa_to_value(xa_load(&sih->dirs->blks, blk)) & ~(1UL << hk_dentry_ix(stale)));
+    } else {
+        stale = direntry;
+    }
+
+    hk_memunlock_dentry(sb, stale, &irq_flags);
+    stale->valid = 0;
+    stale->name_len = 0;
+    hk_memlock_dentry(sb, stale, &irq_flags);
+    hk_flush_buffer(stale, CACHELINE_SIZE, true);
+
+    return true;
+}
+
 static int hk_rebuild_dir_table_for_blk(struct super_block *sb, u64 f_blk, struct hk_inode_info_header *sih,
                                         struct hk_inode_rebuild *reb)
 {
     struct hk_sb_info *sbi = HK_SB(sb);
     struct hk_dentry *direntry;
+    bool settled = hk_dir_settled(sih);
+    unsigned long live = 0;
     u16 i;
     u64 blk_addr;
-    for (i = 0; i < MAX_DENTRY_PER_BLK; i++) {
-        blk_addr = TRANS_OFS_TO_ADDR(sbi, linix_get(&sih->ix, f_blk));
-        direntry = hk_dentry_by_ix_from_blk(blk_addr, i);
+
+    blk_addr = TRANS_OFS_TO_ADDR(sbi, linix_get(&sih->ix, f_blk));
+    hk_for_each_dentry_in_blk(sb, blk_addr, i, direntry) {
         if (direntry->valid) {
+            if (hk_rebuild_dedup_dentry(sb, sih, direntry, f_blk)) {
+                if (direntry->valid)
+                    live |= 1UL << i;
+                continue;
+            }
             reb->i_num_entrys += 1;
-            hk_insert_dir_table(sb, sih, direntry->name, direntry->name_len, direntry);
+            hk_insert_dir_table(sb, sih, direntry->name, direntry->name_len, direntry, f_blk);
+            live |= 1UL << i;
+        } else if (direntry->name_len && settled) {
+            /* removed by a tx finished before a crash, or undone */
+            hk_reclaim_dentry(sb, direntry);
         }
     }
+    hk_dir_set_blk(sih, f_blk, live);
+    return 0;
+}
+
+/* Blocks of the dir are registered, load the dir index if it is current,
+   or read the dentries of each block */
+static void hk_rebuild_dir_table(struct super_block *sb, struct hk_inode *pi, struct hk_inode_info_header *sih,
+                                 struct hk_inode_rebuild *reb)
+{
+    unsigned long blk;
+    void *entry;
+    u64 nr_entries = 0;
+
+    if (hk_dir_index_load(sb, pi, sih, &nr_entries)) {
+        reb->i_num_entrys += nr_entries;
+        return;
+    }
+
+    xa_for_each(&sih->dirs->blks, blk, entry)
+        hk_rebuild_dir_table_for_blk(sb, blk, sih, reb);
 }
 
 static int hk_rebuild_inode_blks(struct super_block *sb, struct hk_inode *pi,
@@ -164,6 +226,7 @@ static int hk_rebuild_inode_blks(struct super_block *sb, struct hk_inode *pi,
     struct hk_inode_rebuild rebuild, *reb;
     u64 ino = pi->ino;
     u64 addr;
+    u64 i, run;
     struct hk_header *hdr;
     struct hk_header *conflict_hdr;
 
@@ -178,24 +241,42 @@ static int hk_rebuild_inode_blks(struct super_block *sb, struct hk_inode *pi,
     if (ret)
         goto out;
 
+#if defined(CONFIG_EXTENT_HDR) && defined(CONFIG_CMT_BACKGROUND)
+    hk_range_free_all(&sih->cmt_node->runs);
+#endif
+
     /* Inconsistency is fixed before */
     traverse_inode_hdr(sbi, pi, hdr)
     {
-        linix_insert(&sih->ix, hdr->f_blk, sm_get_addr_by_hdr(sb, hdr), true);
-
-        switch (__le16_to_cpu(pi->i_mode) & S_IFMT) {
-        case S_IFLNK:
-        case S_IFREG:
-            break;
-        case S_IFDIR:
-            hk_dbgv("hdr @ %llx, pi root @ %llx", hdr, &pi->root);
-            hk_rebuild_dir_table_for_blk(sb, hdr->f_blk, sih, reb);
-            break;
-        default:
-            break;
+        /* a head describes `run` contiguous blocks */
+        run = sm_hdr_run(hdr);
+        addr = sm_get_addr_by_hdr(sb, hdr);
+#if defined(CONFIG_EXTENT_HDR) && defined(CONFIG_CMT_BACKGROUND)
+        sm_track_run(sb, sih->cmt_node, addr, run);
+#endif
+
+        for (i = 0; i < run; i++) {
+            linix_insert(&sih->ix, hdr->f_blk + i, addr + i * HK_PBLK_SZ, true);
+
+            switch (__le16_to_cpu(pi->i_mode) & S_IFMT) {
+            case S_IFLNK:
+            case S_IFREG:
+                break;
+            case S_IFDIR:
+                hk_dbgv("hdr @ %llx, pi root @ %llx", hdr, &pi->root);
+                hk_dir_register_blk(sb, sih, hdr->f_blk + i);
+                break;
+            default:
+                break;
+            }
         }
     }
 
+    if (S_ISDIR(__le16_to_cpu(pi->i_mode))) {
+        hk_rebuild_dir_table(sb, pi, sih, reb);
+        hk_dir_fill_holes(sih);
+    }
+
     ret = hk_rebuild_blks_finish(sb, pi, sih, reb);
     sih->i_blocks = sih->i_size / HK_LBLK_SZ;
 
@@ -239,7 +320,11 @@ int hk_rebuild_inode(struct super_block *sb, struct hk_inode_info *si, u64 ino,
 	cmt_node = hk_cmt_search_node(sb, ino);
 	if (cmt_node) {
 		/* flush the inode attr */
-		hk_flush_cmt_node_fast(sb, ino);
+		mutex_lock(&cmt_node->processing);
+		hk_flush_cmt_node_fast(sb, cmt_node);
+		mutex_unlock(&cmt_node->processing);
+		hk_cmt_tx_commit_node(sb, cmt_node);
+		hk_flush_al_stage(sb, &cmt_node->al_stage, ino);
 	}
 #endif
 
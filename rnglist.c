@@ -97,6 +97,30 @@ int hk_find_range_node(struct rb_root_cached *tree, unsigned long key, struct hk
     return ret;
 }
 
+/* Find the node whose [range_low, range_high] covers key */
+struct hk_range_node *hk_range_find_cover(struct rb_root_cached *tree, unsigned long key)
+{
+    struct hk_range_node *curr, *floor = NULL;
+    struct rb_node *temp;
+
+    temp = tree->rb_root.rb_node;
+
+    while (temp) {
+        curr = container_of(temp, struct hk_range_node, rbnode);
+        if (key < curr->range_low) {
+            temp = temp->rb_left;
+        } else {
+            floor = curr;
+            temp = temp->rb_right;
+        }
+    }
+
+    if (floor && key <= floor->range_high) {
+        return floor;
+    }
+    return NULL;
+}
+
 int hk_find_free_slot(struct rb_root_cached *tree, unsigned long range_low,
                       unsigned long range_high, struct hk_range_node **prev,
                       struct hk_range_node **next)
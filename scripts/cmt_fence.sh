@@ -0,0 +1,8 @@
+# Fences per committed summary header, compare the IO_stats before and after a change
+mkdir -p mnt && mount -t HUNTER -o init /dev/pmem0 /mnt
+echo 1 > /proc/fs/HUNTER/pmem0/IO_stats
+fio -filename=/mnt/c -fallocate=none -direct=0 -iodepth 1 -rw=write -ioengine=sync -bs=1M -size=1G -name=write
+fio -filename=/mnt/c -fallocate=none -direct=0 -iodepth 1 -rw=randwrite -ioengine=sync -bs=4K -size=1G -name=randwrite
+sync /mnt/c
+grep "summary headers" /proc/fs/HUNTER/pmem0/IO_stats
+umount /mnt
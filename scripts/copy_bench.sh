@@ -0,0 +1,8 @@
+# Sweep PM copy variants over a scratch file, results go to dmesg. Use them to
+# set the nt_thresh and simd_thresh module parameters for this cpu model.
+mkdir -p mnt && mount -t HUNTER -o init /dev/pmem0 /mnt
+dd if=/dev/zero of=/mnt/copy_bench bs=1M count=1 oflag=sync
+# HK_IOC_COPY_BENCH is _IO('h', 1)
+python3 -c "import fcntl, os; fd = os.open('/mnt/copy_bench', os.O_RDONLY); fcntl.ioctl(fd, 0x6801)"
+dmesg | grep "copy bench"
+umount /mnt
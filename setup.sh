@@ -45,8 +45,9 @@ HK_ENABLE_ASYNC=$(get_build_options HK_ENABLE_ASYNC)
 HK_ENABLE_IDX_ALLOC_PREDICT=$(get_build_options HK_ENABLE_IDX_ALLOC_PREDICT)
 HK_ENABLE_DECOUPLE_WORKER=$(get_build_options HK_ENABLE_DECOUPLE_WORKER)
 HK_CHECKPOINT_INTERVAL=$(get_build_options HK_CHECKPOINT_INTERVAL)
+HK_ENABLE_EXTENT_HDR=$(get_build_options HK_ENABLE_EXTENT_HDR)
 
-sudo make -j"$(nproc)" HK_ENABLE_LFS="$HK_ENABLE_LFS" HK_ENABLE_ASYNC="$HK_ENABLE_ASYNC" HK_ENABLE_IDX_ALLOC_PREDICT="$HK_ENABLE_IDX_ALLOC_PREDICT" HK_ENABLE_DECOUPLE_WORKER="$HK_ENABLE_DECOUPLE_WORKER" HK_CHECKPOINT_INTERVAL="$HK_CHECKPOINT_INTERVAL"
+sudo make -j"$(nproc)" HK_ENABLE_LFS="$HK_ENABLE_LFS" HK_ENABLE_ASYNC="$HK_ENABLE_ASYNC" HK_ENABLE_IDX_ALLOC_PREDICT="$HK_ENABLE_IDX_ALLOC_PREDICT" HK_ENABLE_DECOUPLE_WORKER="$HK_ENABLE_DECOUPLE_WORKER" HK_CHECKPOINT_INTERVAL="$HK_CHECKPOINT_INTERVAL" HK_ENABLE_EXTENT_HDR="$HK_ENABLE_EXTENT_HDR"
 sudo dmesg -C
 
 fs_init=$(get_fs_options init)
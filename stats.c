@@ -109,8 +109,10 @@ const char *Timingstring[TIMING_NUM] = {
     "process_data_info",
     "process_new_inode_info",
     "process_unlink_inode_info",
+    "process_rename_info",
     "process_delete_inode_info",
     "process_close_inode_info",
+    "process_tx_batch",
     "flush_cmt",
 
     /* Linear index */
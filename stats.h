@@ -111,8 +111,10 @@ enum timing_category {
     process_data_info_t,
     process_new_inode_info_t,
     process_unlink_inode_info_t,
+    process_rename_info_t,
     process_delete_inode_info_t,
     process_close_inode_info_t,
+    process_tx_batch_t,
     flush_cmt_t,
 
     /* Linix */
@@ -145,6 +147,29 @@ enum stats_category {
     dax_new_blocks,
     inplace_new_blocks,
     fdatasync,
+    cmt_pool_waits,
+    cmt_throttles,
+    cmt_workers_up,
+    cmt_workers_down,
+    sm_hdrs_committed,
+    sm_hdr_fences,
+    xpline_full_flushes,
+    xpline_partial_flushes,
+    tail_buf_appends,
+    tail_buf_flushes,
+    tx_batches,
+    tx_batched_ops,
+    al_entries_absorbed,
+    al_slot_evictions,
+    al_slot_waits,
+    dir_table_resizes,
+    dentry_slots_reused,
+    dentries_compacted,
+    dir_blks_freed,
+    dir_bloom_negatives,
+    dir_bloom_false_pos,
+    dir_index_checkpoints,
+    dir_index_loads,
 
     /* Sentinel */
     STATS_NUM,
@@ -45,6 +45,23 @@ int measure_timing;
 int wprotect;
 int support_clwb;
 
+DEFINE_STATIC_KEY_FALSE(hk_persist_noflush);
+DEFINE_STATIC_KEY_FALSE(hk_persist_clwb);
+DEFINE_STATIC_KEY_FALSE(hk_persist_clflushopt);
+
+/* mounted instances by whether they need cache flushes */
+static DEFINE_MUTEX(hk_persist_lock);
+static int hk_eadr_mounts;
+static int hk_flush_mounts;
+
+static const char *hk_persist_names[] = {
+    [HK_PERSIST_AUTO] = "auto",
+    [HK_PERSIST_EADR] = "eadr",
+    [HK_PERSIST_CLWB] = "clwb",
+    [HK_PERSIST_CLFLUSHOPT] = "clflushopt",
+    [HK_PERSIST_CLFLUSH] = "clflush",
+};
+
 module_param(measure_timing, int, 0444);
 MODULE_PARM_DESC(measure_timing, "Timing measurement");
 
@@ -54,6 +71,12 @@ MODULE_PARM_DESC(wprotect, "Write-protect pmem region and use CR0.WP to allow up
 module_param(hk_dbgmask, int, 0444);
 MODULE_PARM_DESC(hk_dbgmask, "Control debugging output");
 
+module_param_named(nt_thresh, hk_nt_thresh, uint, 0644);
+MODULE_PARM_DESC(nt_thresh, "Copies to PM at least this long use non-temporal stores");
+
+module_param_named(simd_thresh, hk_simd_thresh, uint, 0644);
+MODULE_PARM_DESC(simd_thresh, "Non-temporal copies to PM at least this long use AVX");
+
 static struct super_operations hk_sops;
 static const struct export_operations hk_export_ops;
 static struct kmem_cache *hk_inode_cachep;
@@ -168,6 +191,11 @@ enum {
     Opt_err_panic,
     Opt_err_ro,
     Opt_dbgmask,
+    Opt_persist,
+    Opt_tailbuf,
+    Opt_dirindex,
+    Opt_jslots,
+    Opt_alslots,
     Opt_err
 };
 
@@ -183,6 +211,11 @@ static const match_table_t tokens = {
     {Opt_err_panic, "errors=panic"},
     {Opt_err_ro, "errors=remount-ro"},
     {Opt_dbgmask, "dbgmask=%u"},
+    {Opt_persist, "persist=%s"},
+    {Opt_tailbuf, "tailbuf"},
+    {Opt_dirindex, "dirindex"},
+    {Opt_jslots, "jslots=%u"},
+    {Opt_alslots, "alslots=%u"},
     {Opt_err, NULL},
 };
 
@@ -193,6 +226,7 @@ static int hk_parse_options(char *options, struct hk_sb_info *sbi,
     substring_t args[MAX_OPT_ARGS];
     int option;
     kuid_t uid;
+    char persist[16];
 
     if (!options)
         return 0;
@@ -257,6 +291,46 @@ static int hk_parse_options(char *options, struct hk_sb_info *sbi,
                 goto bad_val;
             hk_dbgmask = option;
             break;
+        case Opt_persist:
+            if (remount)
+                goto bad_opt;
+            match_strlcpy(persist, &args[0], sizeof(persist));
+            option = match_string(hk_persist_names, ARRAY_SIZE(hk_persist_names), persist);
+            if (option < 0)
+                goto bad_val;
+            sbi->persist_mode = option;
+            break;
+        case Opt_tailbuf:
+            set_opt(sbi->s_mount_opt, TAIL_BUF);
+            break;
+        case Opt_dirindex:
+            set_opt(sbi->s_mount_opt, DIR_INDEX);
+            break;
+        case Opt_jslots:
+            if (match_int(&args[0], &option))
+                goto bad_val;
+            /* fixed at format, remount only takes the value shown in mounts */
+            if (remount) {
+                if (option != sbi->percore_jslots)
+                    goto bad_opt;
+                break;
+            }
+            if (option < 1 || option > HK_MAX_PERCORE_JSLOTS)
+                goto bad_val;
+            sbi->percore_jslots = option;
+            break;
+        case Opt_alslots:
+            if (match_int(&args[0], &option))
+                goto bad_val;
+            if (remount) {
+                if (option != sbi->al_slots)
+                    goto bad_opt;
+                break;
+            }
+            if (option < HK_MIN_ATTRLOG_SLOTS || option > HK_NUM_INO)
+                goto bad_val;
+            sbi->al_slots = option;
+            break;
         default: {
             goto bad_opt;
         }
@@ -381,6 +455,9 @@ static struct hk_inode *hk_init(struct super_block *sb,
     sbi->hk_sb->s_size = cpu_to_le64(size);
     sbi->hk_sb->s_blocksize = cpu_to_le32(blocksize);
     sbi->hk_sb->s_magic = cpu_to_le32(HUNTER_SUPER_MAGIC);
+    sbi->hk_sb->s_jslots = cpu_to_le32(sbi->percore_jslots);
+    sbi->hk_sb->s_features = cpu_to_le32(HK_FEATURES);
+    sbi->hk_sb->s_al_slots = cpu_to_le32(sbi->al_slots);
     sbi->s_inodes_used_count = 0;
     hk_update_super_crc(sb);
 
@@ -418,11 +495,88 @@ static struct hk_inode *hk_init(struct super_block *sb,
     return root_pi;
 }
 
+/* The flush instruction is shared by all instances, any of them is enough
+   for an ADR platform, so the last flushing mount picks it */
+static void hk_persist_select_insn(int mode)
+{
+    if (mode == HK_PERSIST_CLWB)
+        static_branch_enable(&hk_persist_clwb);
+    else
+        static_branch_disable(&hk_persist_clwb);
+
+    if (mode == HK_PERSIST_CLFLUSHOPT)
+        static_branch_enable(&hk_persist_clflushopt);
+    else
+        static_branch_disable(&hk_persist_clflushopt);
+}
+
+/* Resolve persist= against the platform and patch the flush variant in */
+static int hk_persist_setup(struct super_block *sb)
+{
+    struct hk_sb_info *sbi = HK_SB(sb);
+    int mode = sbi->persist_mode;
+
+    if (mode == HK_PERSIST_AUTO) {
+        /* libnvdimm turns the dax write cache off for regions whose cpu
+           caches are flushed on power failure */
+        if (!dax_write_cache_enabled(sbi->s_dax_dev))
+            mode = HK_PERSIST_EADR;
+        else if (arch_has_clwb())
+            mode = HK_PERSIST_CLWB;
+        else if (arch_has_clflushopt())
+            mode = HK_PERSIST_CLFLUSHOPT;
+        else
+            mode = HK_PERSIST_CLFLUSH;
+    }
+
+    if ((mode == HK_PERSIST_CLWB && !arch_has_clwb()) ||
+        (mode == HK_PERSIST_CLFLUSHOPT && !arch_has_clflushopt())) {
+        hk_err(sb, "persist=%s is not supported by this cpu\n", hk_persist_names[mode]);
+        return -EINVAL;
+    }
+
+    mutex_lock(&hk_persist_lock);
+    if (mode == HK_PERSIST_EADR) {
+        if (hk_eadr_mounts++ == 0 && hk_flush_mounts == 0)
+            static_branch_enable(&hk_persist_noflush);
+    } else {
+        if (hk_flush_mounts++ == 0)
+            static_branch_disable(&hk_persist_noflush);
+        hk_persist_select_insn(mode);
+    }
+    mutex_unlock(&hk_persist_lock);
+
+    sbi->persist_used = mode;
+    hk_info("persistence: %s (requested %s)\n", hk_persist_names[mode],
+            hk_persist_names[sbi->persist_mode]);
+    return 0;
+}
+
+static void hk_persist_teardown(struct super_block *sb)
+{
+    struct hk_sb_info *sbi = HK_SB(sb);
+
+    if (sbi->persist_used == HK_PERSIST_AUTO)
+        return;
+
+    mutex_lock(&hk_persist_lock);
+    if (sbi->persist_used == HK_PERSIST_EADR) {
+        if (--hk_eadr_mounts == 0)
+            static_branch_disable(&hk_persist_noflush);
+    } else {
+        if (--hk_flush_mounts == 0 && hk_eadr_mounts)
+            static_branch_enable(&hk_persist_noflush);
+    }
+    mutex_unlock(&hk_persist_lock);
+
+    sbi->persist_used = HK_PERSIST_AUTO;
+}
+
 static inline void set_default_opts(struct hk_sb_info *sbi)
 {
     set_opt(sbi->s_mount_opt, HUGEIOREMAP);
     set_opt(sbi->s_mount_opt, ERRORS_CONT);
-    sbi->cpus = num_online_cpus(); // TODO: num_online_cpus();
+    sbi->cpus = num_online_cpus();
     hk_info("%d cpus online\n", sbi->cpus);
 }
 
@@ -468,10 +622,50 @@ static int hk_check_integrity(struct super_block *sb)
     return 0;
 }
 
+static void hk_setup_jslots(struct super_block *sb)
+{
+    struct hk_sb_info *sbi = HK_SB(sb);
+    u32 jslots;
+
+    if (sbi->s_mount_opt & HUNTER_MOUNT_FORMAT) {
+        if (!sbi->percore_jslots)
+            sbi->percore_jslots = HK_PERCORE_JSLOTS;
+        return;
+    }
+
+    if (sbi->percore_jslots)
+        hk_warn("jslots only takes effect with init, using the formatted one\n");
+
+    /* Read from PM, a bad superblock is caught by hk_check_integrity later */
+    jslots = le32_to_cpu(hk_get_super(sb)->s_jslots);
+    if (jslots == 0 || jslots > HK_MAX_PERCORE_JSLOTS)
+        jslots = 1;
+    sbi->percore_jslots = jslots;
+}
+
+static void hk_setup_al_slots(struct super_block *sb)
+{
+    struct hk_sb_info *sbi = HK_SB(sb);
+    u32 al_slots;
+
+    if (sbi->s_mount_opt & HUNTER_MOUNT_FORMAT) {
+        if (!sbi->al_slots)
+            sbi->al_slots = HK_ATTRLOG_SLOTS;
+        return;
+    }
+
+    if (sbi->al_slots)
+        hk_warn("alslots only takes effect with init, using the formatted one\n");
+
+    al_slots = le32_to_cpu(hk_get_super(sb)->s_al_slots);
+    if (al_slots < HK_MIN_ATTRLOG_SLOTS || al_slots > HK_NUM_INO)
+        al_slots = HK_NUM_INO;
+    sbi->al_slots = al_slots;
+}
+
 static int hk_super_layout_init(struct hk_sb_info *sbi)
 {
     u64 max_al_size;
-    int i;
 
     /* Layout Related */
     sbi->m_addr = _round_up((u64)sbi->virt_addr + HK_SB_SIZE, PAGE_SIZE);
@@ -493,19 +687,39 @@ static int hk_super_layout_init(struct hk_sb_info *sbi)
 
     /* Build Journal */
     sbi->j_addr = sbi->sm_addr + sbi->sm_size;
-    sbi->j_slots = sbi->cpus * HK_PERCORE_JSLOTS;
+    sbi->j_slots = sbi->cpus * sbi->percore_jslots;
     sbi->j_size = _round_up(sbi->j_slots * HK_JOURNAL_SIZE, PAGE_SIZE);
-    sbi->j_locks = kcalloc(sbi->j_slots, sizeof(struct mutex), GFP_KERNEL);
-    if (!sbi->j_locks) {
+    sbi->j_busy = bitmap_zalloc(sbi->j_slots, GFP_KERNEL);
+    if (!sbi->j_busy) {
         return -ENOMEM;
     }
-    for (i = 0; i < sbi->j_slots; i++)
-        mutex_init(&sbi->j_locks[i]);
+    init_waitqueue_head(&sbi->j_wq);
 
     /* Build Attr Log */
     sbi->al_addr = sbi->j_addr + sbi->j_size;
-    sbi->al_slots = HK_ATTRLOG_SLOTS > HK_NUM_INO ? HK_NUM_INO : HK_ATTRLOG_SLOTS;
     sbi->al_size = _round_up(sbi->al_slots * sizeof(struct hk_attr_log), PAGE_SIZE);
+    sbi->al_busy = bitmap_zalloc(sbi->al_slots, GFP_KERNEL);
+    if (!sbi->al_busy) {
+        bitmap_free(sbi->j_busy);
+        sbi->j_busy = NULL;
+        return -ENOMEM;
+    }
+    xa_init(&sbi->al_map);
+    mutex_init(&sbi->al_lock);
+    sbi->al_hand = 0;
+    /* only a compact region evicts its slots */
+    if (sbi->al_slots < HK_NUM_INO) {
+        sbi->al_holds = kcalloc(sbi->al_slots, sizeof(unsigned int), GFP_KERNEL);
+        if (!sbi->al_holds) {
+            bitmap_free(sbi->al_busy);
+            sbi->al_busy = NULL;
+            bitmap_free(sbi->j_busy);
+            sbi->j_busy = NULL;
+            return -ENOMEM;
+        }
+    }
+    sbi->al_nr_held = 0;
+    init_waitqueue_head(&sbi->al_wq);
 
     /* Calc Meta Size and Data Size */
     sbi->m_size = _round_up(sbi->al_addr - sbi->m_addr + sbi->al_size, PAGE_SIZE);
@@ -549,7 +763,7 @@ static int hk_super_dram_init(struct hk_sb_info *sbi)
 
 #ifdef CONFIG_CMT_BACKGROUND
     /* Background Commit Related */
-    sbi->cq = hk_init_cmt_queue(HK_CMT_WORKER_NUM);
+    sbi->cq = hk_init_cmt_queue(clamp_t(int, sbi->cpus, 1, HK_CMT_MAX_WORKERS), sbi->cpus);
     if (!sbi->cq) {
         ret = -ENOMEM;
         goto err4;
@@ -631,9 +845,6 @@ static int hk_fill_super(struct super_block *sb, void *data, int silent)
         goto out;
     }
 
-    hk_super_layout_init(sbi);
-    hk_super_dram_init(sbi);
-
     hk_info("measure timing %d, wprotect %d\n", measure_timing, wprotect);
 
     get_random_bytes(&random, sizeof(u32));
@@ -657,6 +868,19 @@ static int hk_fill_super(struct super_block *sb, void *data, int silent)
         goto out;
     }
 
+    /* The journal and attr log areas are sized at format time */
+    hk_setup_jslots(sb);
+    hk_setup_al_slots(sb);
+
+    retval = hk_super_layout_init(sbi);
+    if (retval)
+        goto out;
+    hk_super_dram_init(sbi);
+
+    retval = hk_persist_setup(sb);
+    if (retval)
+        goto out;
+
     hk_sysfs_init(sb);
 
     /* Init a new hk instance */
@@ -746,8 +970,13 @@ setup_sb:
 
 out:
     hk_sysfs_exit(sb);
+    hk_persist_teardown(sb);
 
     hk_layouts_free(sbi);
+    bitmap_free(sbi->j_busy);
+    bitmap_free(sbi->al_busy);
+    kfree(sbi->al_holds);
+    xa_destroy(&sbi->al_map);
     kfree(sbi->hk_sb);
     kfree(sbi);
     hk_dbg("%s failed: return %d\n", __func__, retval);
@@ -796,6 +1025,14 @@ static int hk_show_options(struct seq_file *seq, struct dentry *root)
     /* memory protection disabled by default */
     if (test_opt(root->d_sb, PROTECT))
         seq_puts(seq, ",wprotect");
+    if (sbi->persist_mode != HK_PERSIST_AUTO)
+        seq_printf(seq, ",persist=%s", hk_persist_names[sbi->persist_mode]);
+    if (test_opt(root->d_sb, TAIL_BUF))
+        seq_puts(seq, ",tailbuf");
+    if (test_opt(root->d_sb, DIR_INDEX))
+        seq_puts(seq, ",dirindex");
+    seq_printf(seq, ",jslots=%u", sbi->percore_jslots);
+    seq_printf(seq, ",alslots=%llu", sbi->al_slots);
 
     return 0;
 }
@@ -869,7 +1106,12 @@ static void hk_put_super(struct super_block *sb)
     hk_dbgmask = 0;
 
     hk_sysfs_exit(sb);
+    hk_persist_teardown(sb);
 
+    bitmap_free(sbi->j_busy);
+    bitmap_free(sbi->al_busy);
+    kfree(sbi->al_holds);
+    xa_destroy(&sbi->al_map);
     kfree(sbi->hk_sb);
     kfree(sbi);
     sb->s_fs_info = NULL;
@@ -1018,6 +1260,14 @@ static int __init init_hk_fs(void)
     hk_info("Arch new instructions support: CLWB %s\n",
             support_clwb ? "YES" : "NO");
 
+    hk_pmem_copy_init();
+
+    /* until a mount probes its platform */
+    if (arch_has_clwb())
+        hk_persist_select_insn(HK_PERSIST_CLWB);
+    else if (arch_has_clflushopt())
+        hk_persist_select_insn(HK_PERSIST_CLFLUSHOPT);
+
     hk_proc_root = proc_mkdir(proc_dirname, NULL);
 
     rc = init_hk_range_node_cache();
@@ -1032,55 +1282,25 @@ static int __init init_hk_fs(void)
     if (rc)
         goto out2;
 
-    rc = init_hk_cmt_data_info_cache();
-    if (rc)
-        goto out3;
-    
-    rc = init_hk_cmt_new_inode_info_cache();
-    if (rc)
-        goto out4;
-    
-    rc = init_hk_cmt_unlink_inode_info_cache();
-    if (rc)
-        goto out5;
-
-    rc = init_hk_cmt_delete_inode_info_cache();
-    if (rc)
-        goto out6;
-
-    rc = init_hk_cmt_close_info_cache();
-    if (rc)
-        goto out7;
-
     rc = init_hk_cmt_node_cache();
     if (rc)
-        goto out8;
+        goto out3;
 
     rc = init_hk_cmt_node_ref_cache();
     if (rc)
-        goto out9;
+        goto out4;
 
     rc = register_filesystem(&hk_fs_type);
     if (rc)
-        goto out10;
+        goto out5;
 
     HK_END_TIMING(init_t, init_time);
     return 0;
 
-out10:
+out5:
     destroy_hk_cmt_node_ref_cache();
-out9:
+out4:
     destroy_hk_cmt_node_cache();
-out8:
-    destroy_hk_cmt_close_info_cache();
-out7:
-    destroy_hk_cmt_delete_inode_info_cache();
-out6:
-    destroy_hk_cmt_unlink_inode_info_cache();
-out5:
-    destroy_hk_cmt_new_inode_info_cache();
-out4:   
-    destroy_hk_cmt_data_info_cache();
 out3:   
     destroy_hk_dentry_info_cache();
 out2:   
@@ -1096,11 +1316,6 @@ static void __exit exit_hk_fs(void)
     destroy_inodecache();
     destroy_hk_range_node_cache();
     destroy_hk_dentry_info_cache();
-    destroy_hk_cmt_data_info_cache();
-    destroy_hk_cmt_new_inode_info_cache();
-    destroy_hk_cmt_unlink_inode_info_cache();
-    destroy_hk_cmt_delete_inode_info_cache();
-    destroy_hk_cmt_close_info_cache();
     destroy_hk_cmt_node_cache();
     destroy_hk_cmt_node_ref_cache();
 }
@@ -20,10 +20,12 @@ struct hk_super_block {
      */
     __le32 s_sum;   /* checksum of this sb */
     __le32 s_magic; /* magic signature */
-    __le32 s_padding32;
+    __le32 s_jslots;        /* journals per cpu, 0 for images formatted with one */
     __le32 s_blocksize;     /* blocksize in bytes */
     __le64 s_size;          /* total size of fs in bytes */
-    char s_volume_name[16]; /* volume name */
+    char s_volume_name[8];  /* volume name */
+    __le32 s_features;      /* HK_FEATURE_*, 0 for images formatted without them */
+    __le32 s_al_slots;      /* attr logs, 0 for images formatted with one per inode */
 
     /* all the dynamic fields should go here */
     /* s_mtime and s_wtime should be together and their order should not be
@@ -49,6 +51,11 @@ struct hk_super_block {
 
 #define HK_SB_SIZE roundup(sizeof(struct hk_super_block), HK_LBLK_SZ) /* must be power of two */
 
+/* On-media layouts that older images do not have, see s_features */
+#define HK_FEATURE_DENTRY_TYPE  (1 << 0) /* hk_dentry.file_type is always written */
+#define HK_FEATURE_DENTRY_UNITS (1 << 1) /* hk_dentry.units is always written, short dentries are packed */
+#define HK_FEATURES             (HK_FEATURE_DENTRY_TYPE | HK_FEATURE_DENTRY_UNITS)
+
 #define HK_ROOT_INO (0)
 #define HK_RESV_NUM (1)
 /*
@@ -76,6 +83,8 @@ struct hk_sb_info {
     unsigned long blocksize;
     unsigned long initsize;
     unsigned long s_mount_opt;
+    int persist_mode; /* enum hk_persist_mode asked by persist= */
+    int persist_used; /* the mode resolved at mount */
     kuid_t uid;   /* Mount uid for root directory */
     kgid_t gid;   /* Mount gid for root directory */
     umode_t mode; /* Mount mode for root directory */
@@ -110,16 +119,26 @@ struct hk_sb_info {
     u64 al_addr;
     u64 al_slots;
     u64 al_size;
+    /* ino to slot of a compact attr log region, see hk_alloc_attr_log() */
+    struct xarray al_map;
+    unsigned long *al_busy;
+    struct mutex al_lock;
+    u64 al_hand; /* next slot to evict when all are busy */
+    unsigned int *al_holds; /* holders of each slot, which is not evicted then */
+    u64 al_nr_held; /* slots with holders */
+    wait_queue_head_t al_wq; /* allocators waiting for a slot nobody holds */
     /* per cpu structure */
     struct hk_layout_info *layouts;
     u32 num_layout;
 
     /* for journal */
-    struct mutex *j_locks;
+    u32 percore_jslots;
+    unsigned long *j_busy; /* bitmap of claimed journals */
+    wait_queue_head_t j_wq; /* tx starters waiting for a journal */
 
     /* for background cmt */
     struct hk_cmt_queue *cq;
-    struct task_struct *cmt_workers[HK_CMT_WORKER_NUM];
+    struct task_struct **cmt_workers;
 
     /* inode management */
     spinlock_t *inode_forest_locks;
@@ -143,8 +162,9 @@ static inline void hk_dump_super(struct super_block *sb)
 
     hk_info("hk_sb->s_sum: 0x%x\n", hk_sb->s_sum);
     hk_info("hk_sb->s_magic: 0x%x\n", hk_sb->s_magic);
-    hk_info("hk_sb->s_padding32: 0x%x\n", hk_sb->s_padding32);
-    hk_info("hk_sb->s_vol_name: %s\n", hk_sb->s_volume_name);
+    hk_info("hk_sb->s_jslots: 0x%x\n", hk_sb->s_jslots);
+    hk_info("hk_sb->s_vol_name: %.8s\n", hk_sb->s_volume_name);
+    hk_info("hk_sb->s_features: 0x%x\n", hk_sb->s_features);
     hk_info("hk_sb->s_blocksize: 0x%x\n", hk_sb->s_blocksize);
     hk_info("hk_sb->s_size: 0x%llx\n", hk_sb->s_size);
     hk_info("hk_sb->s_mtime: 0x%x\n", hk_sb->s_mtime);
@@ -165,6 +185,11 @@ static inline struct hk_sb_info *HK_SB(struct super_block *sb)
     return sb->s_fs_info;
 }
 
+static inline bool hk_has_feature(struct super_block *sb, u32 feature)
+{
+    return le32_to_cpu(HK_SB(sb)->hk_sb->s_features) & feature;
+}
+
 /* If this is part of a read-modify-write of the super block,
  * hk_memunlock_super() before calling!
  */
@@ -183,6 +208,38 @@ static inline struct hk_super_block *hk_get_super(struct super_block *sb)
                      : "r"(qword), "0"(crc)); \
     } while (0)
 
+/* Lanes of hk_crc32c_multi. crc32q has a latency of three cycles and a
+   throughput of one, so three independent chains keep it busy. */
+#define HK_CRC_LANES 3
+
+/* crc32c of HK_CRC_LANES independent buffers of len bytes each, len being a
+   multiple of 8. Gives the same values as hk_crc32c on each buffer. */
+static inline void hk_crc32c_multi(u32 crc, const u8 *data[HK_CRC_LANES], size_t len, u32 *out)
+{
+    u64 acc0 = crc, acc1 = crc, acc2 = crc;
+    size_t i;
+
+    if (!static_cpu_has(X86_FEATURE_XMM4_2)) {
+        for (i = 0; i < HK_CRC_LANES; i++)
+            out[i] = crc32c(crc, data[i], len);
+        return;
+    }
+
+    for (i = 0; i < len; i += 8) {
+        asm volatile("crc32q %3, %0\n\t"
+                     "crc32q %4, %1\n\t"
+                     "crc32q %5, %2"
+                     : "+r"(acc0), "+r"(acc1), "+r"(acc2)
+                     : "m"(*(const u64 *)(data[0] + i)),
+                       "m"(*(const u64 *)(data[1] + i)),
+                       "m"(*(const u64 *)(data[2] + i)));
+    }
+
+    out[0] = (u32)acc0;
+    out[1] = (u32)acc1;
+    out[2] = (u32)acc2;
+}
+
 static inline u32 hk_crc32c(u32 crc, const u8 *data, size_t len)
 {
     u8 *ptr = (u8 *)data;
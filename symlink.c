@@ -60,13 +60,13 @@ int hk_block_symlink(struct super_block *sb, struct hk_inode *pi,
 
     /* the block is zeroed already */
     hk_memunlock_block(sb, (void *)blk_addr, &irq_flags);
-    memcpy_to_pmem_nocache((void *)blk_addr, symname, len);
+    hk_memcpy_to_pmem((void *)blk_addr, symname, len);
     hk_memlock_block(sb, (void *)blk_addr, &irq_flags);
 
     hk_init_and_inc_cmt_dbatch(&dbatch, blk_addr, blk_cur, 1);
     use_layout_for_addr(sb, blk_addr);
     sm_valid_data_sync(sb, sm_get_prev_addr_by_dbatch(sb, sih, &dbatch), blk_addr, sm_get_next_addr_by_dbatch(sb, sih, &dbatch),
-                       inode->i_ino, blk_cur, get_version(sbi), len, inode->i_ctime.tv_sec);
+                       sih->cmt_node, blk_cur, get_version(sbi), len, inode->i_ctime.tv_sec);
     unuse_layout_for_addr(sb, blk_addr);
 
     /* first block */
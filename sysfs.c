@@ -128,6 +128,32 @@ static int hk_seq_IO_show(struct seq_file *seq, void *v)
 			: 0);
 	seq_printf(seq, "fsync %llu, fdatasync %llu\n",
 			Countstats[fsync_t], IOstats[fdatasync]);
+	seq_printf(seq, "cmt pool waits %llu, throttles %llu, workers activated %llu, parked %llu\n",
+			IOstats[cmt_pool_waits], IOstats[cmt_throttles],
+			IOstats[cmt_workers_up], IOstats[cmt_workers_down]);
+	seq_printf(seq, "summary headers %llu, fences %llu, fences per 1K headers %llu\n",
+			IOstats[sm_hdrs_committed], IOstats[sm_hdr_fences],
+			IOstats[sm_hdrs_committed] ?
+			IOstats[sm_hdr_fences] * 1000 / IOstats[sm_hdrs_committed] : 0);
+	seq_printf(seq, "XPLine flushes: full %llu, partial %llu, full per 1K flushes %llu\n",
+			IOstats[xpline_full_flushes], IOstats[xpline_partial_flushes],
+			IOstats[xpline_full_flushes] + IOstats[xpline_partial_flushes] ?
+			IOstats[xpline_full_flushes] * 1000 /
+			(IOstats[xpline_full_flushes] + IOstats[xpline_partial_flushes]) : 0);
+	seq_printf(seq, "tail buffer appends %llu, flushes %llu\n",
+			IOstats[tail_buf_appends], IOstats[tail_buf_flushes]);
+	seq_printf(seq, "compound txs %llu, ops %llu\n",
+			IOstats[tx_batches], IOstats[tx_batched_ops]);
+	seq_printf(seq, "attr log entries absorbed %llu, slot evictions %llu, waits %llu\n",
+			IOstats[al_entries_absorbed], IOstats[al_slot_evictions],
+			IOstats[al_slot_waits]);
+	seq_printf(seq, "dir table resizes %llu\n", IOstats[dir_table_resizes]);
+	seq_printf(seq, "dentry slots reused %llu, dentries compacted %llu, dir blocks freed %llu\n",
+			IOstats[dentry_slots_reused], IOstats[dentries_compacted], IOstats[dir_blks_freed]);
+	seq_printf(seq, "dir filter negatives %llu, false positives %llu\n",
+			IOstats[dir_bloom_negatives], IOstats[dir_bloom_false_pos]);
+	seq_printf(seq, "dir index checkpoints %llu, loads %llu\n",
+			IOstats[dir_index_checkpoints], IOstats[dir_index_loads]);
 
 	seq_puts(seq, "\n");
 
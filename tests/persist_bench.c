@@ -0,0 +1,129 @@
+/*
+ * Cost of each persistence variant of HUNTER for its three kinds of PM
+ * writes: a summary header (64B), a dentry (128B) and a data block (4KB).
+ *
+ * HUNTER has no mmap, so point it to a file on another DAX file system or
+ * to a device dax, e.g. ./persist_bench /dev/dax0.0
+ */
+#define _GNU_SOURCE
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cpuid.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "common.h"
+
+#define BENCH_REGION_SIZE (256UL * 1024 * 1024)
+#define BENCH_OPS         (64 * 1024)
+#define CACHELINE_SIZE    64
+
+enum { NOFLUSH, CLWB, CLFLUSHOPT, CLFLUSH, NR_VARIANTS };
+
+static const char *variant_names[NR_VARIANTS] = {"eadr", "clwb", "clflushopt", "clflush"};
+
+static const struct {
+    const char *name;
+    size_t size;
+} objects[] = {
+    {"header", 64},
+    {"dentry", 128},
+    {"data", 4096},
+};
+
+static int cpu_has(int variant)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (variant == NOFLUSH || variant == CLFLUSH)
+        return 1;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return 0;
+    return variant == CLWB ? !!(ebx & (1 << 24)) : !!(ebx & (1 << 23));
+}
+
+static inline void persist(int variant, char *buf, size_t len)
+{
+    size_t i;
+
+    switch (variant) {
+    case CLWB:
+        for (i = 0; i < len; i += CACHELINE_SIZE)
+            asm volatile(".byte 0x66; xsaveopt %0" : "+m"(*(volatile char *)(buf + i)));
+        break;
+    case CLFLUSHOPT:
+        for (i = 0; i < len; i += CACHELINE_SIZE)
+            asm volatile(".byte 0x66; clflush %0" : "+m"(*(volatile char *)(buf + i)));
+        break;
+    case CLFLUSH:
+        for (i = 0; i < len; i += CACHELINE_SIZE)
+            asm volatile("clflush %0" : "+m"(*(volatile char *)(buf + i)));
+        break;
+    default:
+        break;
+    }
+    asm volatile("sfence" : : : "memory");
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char const *argv[])
+{
+    const char *path = argc > 1 ? argv[1] : TARGET_FILE_PATH;
+    struct stat st;
+    char *region;
+    int fd, v, o;
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        printf("open %s failed\n", path);
+        return -1;
+    }
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size < BENCH_REGION_SIZE)
+        ftruncate(fd, BENCH_REGION_SIZE);
+
+    region = mmap(NULL, BENCH_REGION_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED_VALIDATE | MAP_SYNC, fd, 0);
+    if (region == MAP_FAILED) {
+        printf("mmap %s with MAP_SYNC failed, is it on DAX?\n", path);
+        return -1;
+    }
+    memset(region, 0, BENCH_REGION_SIZE);
+
+    printf("%-12s %-8s %10s\n", "variant", "object", "ns/op");
+    for (v = 0; v < NR_VARIANTS; v++) {
+        if (!cpu_has(v))
+            continue;
+        for (o = 0; o < sizeof(objects) / sizeof(objects[0]); o++) {
+            size_t size = objects[o].size;
+            size_t slots = BENCH_REGION_SIZE / size;
+            double start, end;
+            int i;
+
+            start = now_ns();
+            for (i = 0; i < BENCH_OPS; i++) {
+                /* stride over the region so that every op misses the cache */
+                char *obj = region + ((size_t)i * 97 % slots) * size;
+
+                memset(obj, i, size);
+                persist(v, obj, size);
+            }
+            end = now_ns();
+
+            printf("%-12s %-8s %10.1f\n", variant_names[v], objects[o].name, (end - start) / BENCH_OPS);
+        }
+    }
+
+    munmap(region, BENCH_REGION_SIZE);
+    close(fd);
+    return 0;
+}